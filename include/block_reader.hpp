@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "compressed_input.hpp"
+
+//
+// Reads (and decompresses) a byte source on a thread of its own into a ring
+// of large buffers. Every buffer handed out holds complete lines: the
+// partial last line of a block is carried over to the start of the next.
+// While the consumer parses one block the reader fills the others, so I/O,
+// decompression and parsing overlap.
+//
+
+class line_block_reader {
+public:
+    line_block_reader(std::unique_ptr<compressed_input::byte_source> s,
+                      size_t block_bytes = size_t(32) << 20,
+                      size_t num_blocks = 4)
+        : src(std::move(s))
+        , block(block_bytes)
+        , buffers(std::max<size_t>(2, num_blocks))
+    {
+        for (size_t b = 0; b < buffers.size(); b++)
+            free_blocks.push_back(b);
+        worker = std::thread([this] { run(); });
+    }
+    ~line_block_reader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cond.notify_all();
+        worker.join();
+    }
+
+    // next block of complete lines (the last may lack its '\n'); releases
+    // the block returned before. Returns false at the end of the input and
+    // rethrows errors of the reader thread.
+    bool next(const char*& begin, const char*& end)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (current != none) {
+            free_blocks.push_back(current);
+            current = none;
+            cond.notify_all();
+        }
+        auto start = std::chrono::steady_clock::now();
+        cond.wait(lock, [&] { return !filled.empty() || finished; });
+        consumer_wait += std::chrono::steady_clock::now() - start;
+        if (filled.empty()) {
+            if (error)
+                std::rethrow_exception(error);
+            return false;
+        }
+        current = filled.front();
+        filled.pop_front();
+        begin = buffers[current].data();
+        end = begin + buffers[current].size();
+        return true;
+    }
+
+    // decompressed bytes handed out so far
+    size_t bytes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return total_bytes;
+    }
+    // time the consumer waited for data (the reader is the bottleneck) and
+    // the reader waited for free buffers (parsing is the bottleneck)
+    double consumer_wait_secs() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::chrono::duration<double>(consumer_wait).count();
+    }
+    double reader_wait_secs() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::chrono::duration<double>(reader_wait).count();
+    }
+
+private:
+    static const size_t none = size_t(-1);
+
+    void run()
+    {
+        std::vector<char> carry;
+        try {
+            bool eof = false;
+            while (!eof) {
+                size_t b;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    auto start = std::chrono::steady_clock::now();
+                    cond.wait(lock,
+                        [&] { return !free_blocks.empty() || stopping; });
+                    reader_wait += std::chrono::steady_clock::now() - start;
+                    if (stopping)
+                        break;
+                    b = free_blocks.front();
+                    free_blocks.pop_front();
+                }
+                // (1) the carried partial line, then fresh bytes
+                auto& buf = buffers[b];
+                buf.resize(carry.size() + block);
+                if (!carry.empty())
+                    memcpy(buf.data(), carry.data(), carry.size());
+                size_t have = carry.size();
+                size_t got = src->read(buf.data() + have, block);
+                eof = got == 0;
+                buf.resize(have + got);
+                // (2) keep the trailing partial line for the next block
+                size_t last = buf.size();
+                if (!eof) {
+                    while (last > 0 && buf[last - 1] != '\n')
+                        last--;
+                }
+                carry.assign(buf.begin() + last, buf.end());
+                buf.resize(last);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (buf.empty()) {
+                    free_blocks.push_back(b);
+                } else {
+                    total_bytes += buf.size();
+                    filled.push_back(b);
+                }
+                cond.notify_all();
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+        cond.notify_all();
+    }
+
+    std::unique_ptr<compressed_input::byte_source> src;
+    size_t block;
+    std::vector<std::vector<char>> buffers;
+    mutable std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<size_t> free_blocks;
+    std::deque<size_t> filled;
+    size_t current = none;
+    bool stopping = false;
+    bool finished = false;
+    std::exception_ptr error;
+    size_t total_bytes = 0;
+    std::chrono::steady_clock::duration consumer_wait{};
+    std::chrono::steady_clock::duration reader_wait{};
+    std::thread worker;
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "logging.hpp"
+#include "word_table.hpp"
+
+//
+// Clustering checkpoints: centroids, assignments and iteration state.
+// Files are written to <name>.tmp and renamed, so a job killed while
+// writing keeps the previous checkpoint intact. Version 2 adds the metric,
+// the fp16 flag and a fingerprint of the input, so a resume can reject a
+// checkpoint of another run of the same shape; version 1 files still load.
+//
+
+const char kmeans_checkpoint_magic[9] = "CWVCKPT2";
+const char kmeans_checkpoint_magic_v1[9] = "CWVCKPT1";
+
+// cheap fingerprint of the input: every word and up to 4096 rows spread
+// evenly over the matrix
+inline uint64_t input_fingerprint(const word_table& words,
+                                  const float* rows,
+                                  size_t num_samples,
+                                  size_t num_features)
+{
+    uint64_t h = word_hash::mix(num_samples) ^ num_features;
+    if (words.size() > 0)
+        h = word_hash::hash(words.c_str(0), words.bytes(), h);
+    size_t picks = std::min<size_t>(num_samples, 4096);
+    for (size_t p = 0; p < picks; p++) {
+        const float* row = rows + p * num_samples / picks * num_features;
+        h = word_hash::hash(reinterpret_cast<const char*>(row),
+                            num_features * sizeof(float),
+                            h);
+    }
+    return h;
+}
+
+struct kmeans_checkpoint {
+    uint32_t version = 2;
+    uint64_t iteration = 0;
+    uint64_t num_samples = 0;
+    uint64_t num_features = 0;
+    uint64_t num_clusters = 0;
+    uint32_t seed = 0;
+    uint32_t finished = 0;
+    // version 2: KMCUDADistanceMetric, fp16x2 (centroids hold packed
+    // halves) and input_fingerprint() of the clustered rows
+    uint32_t metric = 0;
+    uint32_t fp16 = 0;
+    uint64_t fingerprint = 0;
+    std::vector<float> centroids;
+    std::vector<uint32_t> assignments;
+
+    void save(const std::string& file_name) const
+    {
+        std::string tmp_name = file_name + ".tmp";
+        FILE* f = fopen(tmp_name.c_str(), "wb");
+        if (f == nullptr)
+            throw std::runtime_error("cannot create " + tmp_name);
+        bool ok = fwrite(kmeans_checkpoint_magic, 1, 8, f) == 8
+            && fwrite(&iteration, sizeof(iteration), 1, f) == 1
+            && fwrite(&num_samples, sizeof(num_samples), 1, f) == 1
+            && fwrite(&num_features, sizeof(num_features), 1, f) == 1
+            && fwrite(&num_clusters, sizeof(num_clusters), 1, f) == 1
+            && fwrite(&seed, sizeof(seed), 1, f) == 1
+            && fwrite(&finished, sizeof(finished), 1, f) == 1
+            && fwrite(&metric, sizeof(metric), 1, f) == 1
+            && fwrite(&fp16, sizeof(fp16), 1, f) == 1
+            && fwrite(&fingerprint, sizeof(fingerprint), 1, f) == 1
+            && fwrite(centroids.data(), sizeof(float), centroids.size(), f)
+                == centroids.size()
+            && fwrite(assignments.data(), sizeof(uint32_t), assignments.size(),
+                   f)
+                == assignments.size();
+        if (fclose(f) != 0 || !ok)
+            throw std::runtime_error("error writing " + tmp_name);
+        if (rename(tmp_name.c_str(), file_name.c_str()) != 0)
+            throw std::runtime_error("cannot rename " + tmp_name);
+        LOG_INFO << "wrote checkpoint " << file_name
+                 << " (iteration = " << iteration << ")";
+    }
+
+    // true if file_name starts with the checkpoint magic
+    static bool probe(const std::string& file_name)
+    {
+        FILE* f = fopen(file_name.c_str(), "rb");
+        if (f == nullptr)
+            return false;
+        char buf[8];
+        bool ok = fread(buf, 1, 8, f) == 8
+            && (memcmp(buf, kmeans_checkpoint_magic, 8) == 0
+                   || memcmp(buf, kmeans_checkpoint_magic_v1, 8) == 0);
+        fclose(f);
+        return ok;
+    }
+
+    static kmeans_checkpoint load(const std::string& file_name)
+    {
+        kmeans_checkpoint c;
+        FILE* f = fopen(file_name.c_str(), "rb");
+        if (f == nullptr)
+            throw std::runtime_error("cannot open checkpoint " + file_name);
+        char buf[8];
+        bool ok = fread(buf, 1, 8, f) == 8;
+        if (ok && memcmp(buf, kmeans_checkpoint_magic_v1, 8) == 0)
+            c.version = 1;
+        else if (ok && memcmp(buf, kmeans_checkpoint_magic, 8) != 0)
+            ok = false;
+        ok = ok && fread(&c.iteration, sizeof(c.iteration), 1, f) == 1
+            && fread(&c.num_samples, sizeof(c.num_samples), 1, f) == 1
+            && fread(&c.num_features, sizeof(c.num_features), 1, f) == 1
+            && fread(&c.num_clusters, sizeof(c.num_clusters), 1, f) == 1
+            && fread(&c.seed, sizeof(c.seed), 1, f) == 1
+            && fread(&c.finished, sizeof(c.finished), 1, f) == 1;
+        if (ok && c.version >= 2) {
+            ok = fread(&c.metric, sizeof(c.metric), 1, f) == 1
+                && fread(&c.fp16, sizeof(c.fp16), 1, f) == 1
+                && fread(&c.fingerprint, sizeof(c.fingerprint), 1, f) == 1;
+        }
+        if (ok) {
+            c.centroids.resize(c.num_clusters * c.num_features);
+            c.assignments.resize(c.num_samples);
+            ok = fread(c.centroids.data(), sizeof(float), c.centroids.size(), f)
+                    == c.centroids.size()
+                && fread(c.assignments.data(), sizeof(uint32_t),
+                       c.assignments.size(), f)
+                    == c.assignments.size();
+        }
+        fclose(f);
+        if (!ok)
+            throw std::runtime_error("corrupt checkpoint " + file_name);
+        LOG_INFO << "loaded checkpoint " << file_name
+                 << " (iteration = " << c.iteration
+                 << ", finished = " << c.finished << ")";
+        return c;
+    }
+};
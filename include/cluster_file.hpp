@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "logging.hpp"
+#include "mmap_file.hpp"
+#include "parallel.hpp"
+#include "timing.hpp"
+#include "word_table.hpp"
+
+//
+// Binary clustering result that readers map instead of parsing the text
+// report:
+//
+//   [header][centroids: k x d floats]
+//   [cluster offsets: (k + 1) x u64][members: n x u32][member dists: n x f32]
+//   [row cluster: n x u32][row member: n x u32][word table]
+//
+// Sections start on 64 byte boundaries. members lists the rows of cluster
+// c in [offsets[c], offsets[c + 1]) (CSR), closest to the centroid first;
+// member dists are their distances. row cluster and row member map a row
+// to its cluster and its position in members. The word table is a
+// serialised word_table including its hash index, so words are found
+// without building anything.
+//
+
+namespace cluster_file {
+
+const char magic[8] = { 'C', 'W', 'V', 'C', 'L', 'U', 'S', 'T' };
+const uint32_t version = 1;
+const size_t alignment = 64;
+// bytes per pwrite() of the parallel writer
+const size_t write_chunk = size_t(8) << 20;
+
+struct header {
+    char magic[8];
+    uint32_t version;
+    // 1 if the distances are angular (cosine metric), 0 for euclidean
+    uint32_t angular;
+    uint64_t num_samples;
+    uint64_t num_features;
+    uint64_t num_clusters;
+    uint64_t centroids_offset;
+    uint64_t offsets_offset;
+    uint64_t members_offset;
+    uint64_t dists_offset;
+    uint64_t row_cluster_offset;
+    uint64_t row_member_offset;
+    uint64_t words_offset;
+    uint64_t words_bytes;
+};
+
+inline uint64_t align(uint64_t x)
+{
+    return (x + alignment - 1) & ~uint64_t(alignment - 1);
+}
+
+inline bool is_cluster_file(const std::string& file_name)
+{
+    char buf[sizeof(magic)] = { 0 };
+    FILE* f = fopen(file_name.c_str(), "rb");
+    if (f == nullptr)
+        return false;
+    size_t read = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    return read == sizeof(buf) && memcmp(buf, magic, sizeof(magic)) == 0;
+}
+
+// writes the clustering of the rows (dists: distance of every row to its
+// centroid, as computed for the report). The index is built on the thread
+// pool and its sections are written with parallel pwrite() calls.
+inline void write(const std::string& file_name,
+                  size_t num_samples,
+                  size_t num_features,
+                  size_t num_clusters,
+                  const float* centroids,
+                  const uint32_t* assignments,
+                  const float* dists,
+                  const word_table& words,
+                  bool angular = false)
+{
+    cl_timer<> write_timer("write cluster file");
+    size_t n = num_samples;
+    size_t k = num_clusters;
+
+    // (1) CSR index: counting sort by cluster, then every cluster sorted
+    // by distance
+    std::vector<uint64_t> offsets(k + 1, 0);
+    for (size_t i = 0; i < n; i++)
+        offsets[assignments[i] + 1]++;
+    for (size_t c = 0; c < k; c++)
+        offsets[c + 1] += offsets[c];
+    std::vector<uint32_t> members(n);
+    {
+        std::vector<uint64_t> pos(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < n; i++)
+            members[pos[assignments[i]]++] = uint32_t(i);
+    }
+    std::vector<float> member_dists(n);
+    std::vector<uint32_t> row_member(n);
+    parallel::parallel_for(0, k, [&](size_t b, size_t e, size_t) {
+        for (size_t c = b; c < e; c++) {
+            auto first = members.begin() + offsets[c];
+            auto last = members.begin() + offsets[c + 1];
+            std::sort(first, last, [&](uint32_t x, uint32_t y) {
+                return dists[x] < dists[y] || (dists[x] == dists[y] && x < y);
+            });
+            for (size_t m = offsets[c]; m < offsets[c + 1]; m++) {
+                member_dists[m] = dists[members[m]];
+                row_member[members[m]] = uint32_t(m);
+            }
+        }
+    });
+
+    // (2) layout
+    header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, magic, sizeof(magic));
+    h.version = version;
+    h.angular = angular ? 1 : 0;
+    h.num_samples = n;
+    h.num_features = num_features;
+    h.num_clusters = k;
+    h.centroids_offset = align(sizeof(h));
+    h.offsets_offset
+        = align(h.centroids_offset + k * num_features * sizeof(float));
+    h.members_offset = align(h.offsets_offset + (k + 1) * sizeof(uint64_t));
+    h.dists_offset = align(h.members_offset + n * sizeof(uint32_t));
+    h.row_cluster_offset = align(h.dists_offset + n * sizeof(float));
+    h.row_member_offset = align(h.row_cluster_offset + n * sizeof(uint32_t));
+    h.words_offset = align(h.row_member_offset + n * sizeof(uint32_t));
+    h.words_bytes = words.serialized_bytes();
+
+    // (3) the word table through stdio at its offset, then every other
+    // section in write_chunk pieces on the thread pool
+    FILE* f = fopen(file_name.c_str(), "wb");
+    if (f == nullptr)
+        throw std::runtime_error("cannot create " + file_name);
+    bool ok = fseek(f, long(h.words_offset), SEEK_SET) == 0 && words.write(f)
+        && fflush(f) == 0;
+    struct section {
+        const void* data;
+        uint64_t bytes;
+        uint64_t offset;
+    };
+    std::vector<section> sections = {
+        { &h, sizeof(h), 0 },
+        { centroids, k * num_features * sizeof(float), h.centroids_offset },
+        { offsets.data(), offsets.size() * sizeof(uint64_t),
+            h.offsets_offset },
+        { members.data(), n * sizeof(uint32_t), h.members_offset },
+        { member_dists.data(), n * sizeof(float), h.dists_offset },
+        { assignments, n * sizeof(uint32_t), h.row_cluster_offset },
+        { row_member.data(), n * sizeof(uint32_t), h.row_member_offset },
+    };
+    std::vector<section> chunks;
+    for (const auto& s : sections) {
+        for (uint64_t b = 0; b < s.bytes; b += write_chunk) {
+            chunks.push_back({ static_cast<const char*>(s.data) + b,
+                std::min<uint64_t>(write_chunk, s.bytes - b), s.offset + b });
+        }
+    }
+    int fd = fileno(f);
+    std::vector<char> failed(chunks.size(), 0);
+    parallel::parallel_for(0, chunks.size(), 1,
+        [&](size_t b, size_t e, size_t) {
+            for (size_t c = b; c < e; c++) {
+                const char* p = static_cast<const char*>(chunks[c].data);
+                uint64_t left = chunks[c].bytes;
+                off_t off = off_t(chunks[c].offset);
+                while (left > 0) {
+                    ssize_t w = pwrite(fd, p, left, off);
+                    if (w < 0 && errno == EINTR)
+                        continue;
+                    if (w <= 0) {
+                        failed[c] = 1;
+                        break;
+                    }
+                    p += w;
+                    off += w;
+                    left -= uint64_t(w);
+                }
+            }
+        });
+    ok = ok && std::find(failed.begin(), failed.end(), 1) == failed.end();
+    if (fclose(f) != 0 || !ok)
+        throw std::runtime_error("error writing " + file_name);
+    LOG_INFO << "wrote cluster file " << file_name << " ("
+             << (h.words_offset + h.words_bytes) / (1024 * 1024) << " MiB)";
+}
+
+// read-only view of a cluster file: every lookup is O(1) on the mapping
+class reader {
+public:
+    explicit reader(const std::string& file_name)
+        : mapping(file_name)
+    {
+        if (mapping.size() < sizeof(h))
+            throw std::runtime_error("truncated cluster file " + file_name);
+        memcpy(&h, mapping.data(), sizeof(h));
+        if (memcmp(h.magic, magic, sizeof(magic)) != 0
+            || h.version != version)
+            throw std::runtime_error("unsupported cluster file " + file_name);
+        if (h.words_offset + h.words_bytes > mapping.size())
+            throw std::runtime_error("truncated cluster file " + file_name);
+        table.attach(mapping.data() + h.words_offset, h.words_bytes);
+        if (table.size() != h.num_samples)
+            throw std::runtime_error("corrupt word table in " + file_name);
+    }
+
+    size_t num_samples() const { return h.num_samples; }
+    size_t num_features() const { return h.num_features; }
+    size_t num_clusters() const { return h.num_clusters; }
+    bool angular() const { return h.angular != 0; }
+
+    const float* centroids() const
+    {
+        return section<float>(h.centroids_offset);
+    }
+    const float* centroid(size_t c) const
+    {
+        return centroids() + c * h.num_features;
+    }
+
+    // members of cluster c, closest first, and their distances
+    size_t cluster_size(size_t c) const
+    {
+        return offsets()[c + 1] - offsets()[c];
+    }
+    const uint32_t* members(size_t c) const
+    {
+        return section<uint32_t>(h.members_offset) + offsets()[c];
+    }
+    const float* member_dists(size_t c) const
+    {
+        return section<float>(h.dists_offset) + offsets()[c];
+    }
+
+    // row of a word (word_table::npos if unknown) and what it was assigned
+    uint32_t find(const std::string& word) const { return table.find(word); }
+    uint32_t cluster_of(size_t row) const
+    {
+        return section<uint32_t>(h.row_cluster_offset)[row];
+    }
+    float distance_of(size_t row) const
+    {
+        return section<float>(h.dists_offset)[member_position(row)];
+    }
+    // 0 for the member closest to its centroid
+    size_t rank_of(size_t row) const
+    {
+        return member_position(row) - offsets()[cluster_of(row)];
+    }
+
+    const word_table& words() const { return table; }
+
+private:
+    template <class t_val> const t_val* section(uint64_t offset) const
+    {
+        return reinterpret_cast<const t_val*>(mapping.data() + offset);
+    }
+    const uint64_t* offsets() const
+    {
+        return section<uint64_t>(h.offsets_offset);
+    }
+    size_t member_position(size_t row) const
+    {
+        return section<uint32_t>(h.row_member_offset)[row];
+    }
+
+    mmap_file mapping;
+    header h;
+    word_table table;
+};
+}
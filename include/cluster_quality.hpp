@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <ostream>
+#include <random>
+#include <vector>
+
+#include "kmeans_cpu.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+#include "timing.hpp"
+
+//
+// Internal quality measures of a clustering, computed from the vectors,
+// centroids and assignments still in memory:
+//
+//   simplified silhouette  mean of (b - a) / max(a, b) over the samples,
+//                          a and b the distances to the own and to the
+//                          nearest other centroid (-1 worst, 1 best)
+//   Davies-Bouldin         mean over clusters i of the max over j != i of
+//                          (S_i + S_j) / d(c_i, c_j), S the mean distance
+//                          of the members to their centroid (lower is
+//                          better)
+//
+// Both need k distances per sample or cluster, so they are estimated on
+// sampled rows and clusters; inertia, S and the cluster sizes use all rows.
+//
+
+struct cluster_quality_options {
+    // rows of the silhouette and clusters of Davies-Bouldin (0 = all)
+    size_t sample_rows = 65536;
+    size_t sample_clusters = 4096;
+    uint32_t seed = 1234;
+};
+
+struct cluster_quality {
+    size_t num_samples = 0;
+    size_t num_clusters = 0;
+    double inertia = 0.0;
+    double average_distance = 0.0;
+    double silhouette = 0.0;
+    size_t silhouette_rows = 0;
+    double davies_bouldin = 0.0;
+    size_t davies_bouldin_clusters = 0;
+    size_t empty_clusters = 0;
+    size_t singleton_clusters = 0;
+    size_t min_size = 0;
+    size_t median_size = 0;
+    size_t max_size = 0;
+    // size_histogram[b]: clusters of size 0 (b = 0) or of [2^(b-1), 2^b)
+    std::vector<size_t> size_histogram;
+};
+
+namespace cluster_quality_detail {
+
+// the first m of 0..n-1 in a seeded random order (all of them if m = 0)
+inline std::vector<uint32_t> sample_ids(size_t n, size_t m, uint32_t seed)
+{
+    std::vector<uint32_t> ids(n);
+    std::iota(ids.begin(), ids.end(), 0);
+    if (m == 0 || m >= n)
+        return ids;
+    std::mt19937_64 rng(seed);
+    for (size_t i = 0; i < m; i++) {
+        std::uniform_int_distribution<size_t> pick(i, n - 1);
+        std::swap(ids[i], ids[pick(rng)]);
+    }
+    ids.resize(m);
+    return ids;
+}
+}
+
+inline cluster_quality evaluate_clusters(const kmeans_cpu_engine& engine,
+                                         size_t n,
+                                         size_t d,
+                                         size_t k,
+                                         const uint32_t* assignments,
+                                         const cluster_quality_options& opts
+                                         = cluster_quality_options())
+{
+    cl_timer<> eval_timer("evaluate clusters");
+    cluster_quality q;
+    q.num_samples = n;
+    q.num_clusters = k;
+    size_t threads = parallel::num_threads();
+
+    // (1) sizes, inertia and the mean member distance S of every cluster
+    std::vector<size_t> sizes(k, 0);
+    for (size_t i = 0; i < n; i++)
+        sizes[assignments[i]]++;
+    std::vector<std::vector<double>> slot_sums(threads);
+    std::vector<double> inertia(threads, 0.0);
+    parallel::parallel_for(0, n, [&](size_t b, size_t e, size_t slot) {
+        auto& sums = slot_sums[slot];
+        if (sums.empty())
+            sums.assign(k, 0.0);
+        std::vector<float> scratch(d);
+        double s = 0.0;
+        for (size_t i = b; i < e; i++) {
+            double dist = engine.dist(
+                engine.row(i, scratch.data()), engine.centroid(assignments[i]));
+            sums[assignments[i]] += dist;
+            s += dist * dist;
+        }
+        inertia[slot] += s;
+    });
+    std::vector<double> spread(k, 0.0);
+    double dist_total = 0.0;
+    for (const auto& sums : slot_sums) {
+        for (size_t c = 0; c < sums.size(); c++)
+            spread[c] += sums[c];
+    }
+    for (size_t c = 0; c < k; c++) {
+        dist_total += spread[c];
+        if (sizes[c] > 0)
+            spread[c] /= double(sizes[c]);
+    }
+    q.inertia = std::accumulate(inertia.begin(), inertia.end(), 0.0);
+    q.average_distance = n ? dist_total / double(n) : 0.0;
+
+    // (2) size statistics
+    std::vector<size_t> sorted(sizes);
+    std::sort(sorted.begin(), sorted.end());
+    if (k > 0) {
+        q.min_size = sorted.front();
+        q.median_size = sorted[k / 2];
+        q.max_size = sorted.back();
+    }
+    for (size_t s : sizes) {
+        size_t bucket = 0;
+        while (bucket < 64 && (size_t(1) << bucket) <= s)
+            bucket++;
+        if (q.size_histogram.size() <= bucket)
+            q.size_histogram.resize(bucket + 1, 0);
+        q.size_histogram[bucket]++;
+        q.empty_clusters += s == 0;
+        q.singleton_clusters += s == 1;
+    }
+
+    // (3) simplified silhouette of the sampled rows
+    auto rows = cluster_quality_detail::sample_ids(
+        n, opts.sample_rows, opts.seed);
+    std::vector<double> sil(threads, 0.0);
+    parallel::parallel_for(0, rows.size(),
+        [&](size_t b, size_t e, size_t slot) {
+            std::vector<float> scratch(d);
+            double s = 0.0;
+            for (size_t r = b; r < e; r++) {
+                size_t i = rows[r];
+                uint32_t own = assignments[i];
+                const float* x = engine.row(i, scratch.data());
+                float best = std::numeric_limits<float>::max();
+                size_t other = k;
+                for (size_t c = 0; c < k; c++) {
+                    if (c == own || sizes[c] == 0)
+                        continue;
+                    float dc = engine.dist_cmp(x, engine.centroid(c));
+                    if (dc < best) {
+                        best = dc;
+                        other = c;
+                    }
+                }
+                if (other == k)
+                    continue;
+                double a = engine.dist(x, engine.centroid(own));
+                double bd = engine.dist(x, engine.centroid(other));
+                double m = std::max(a, bd);
+                if (m > 0.0)
+                    s += (bd - a) / m;
+            }
+            sil[slot] += s;
+        });
+    q.silhouette_rows = rows.size();
+    if (!rows.empty())
+        q.silhouette = std::accumulate(sil.begin(), sil.end(), 0.0)
+            / double(rows.size());
+
+    // (4) Davies-Bouldin over the sampled non-empty clusters. Coincident
+    // centroids (duplicates) would make it infinite and are skipped.
+    std::vector<uint32_t> used;
+    for (size_t c = 0; c < k; c++) {
+        if (sizes[c] > 0)
+            used.push_back(uint32_t(c));
+    }
+    auto picked = cluster_quality_detail::sample_ids(
+        used.size(), opts.sample_clusters, opts.seed + 1);
+    std::vector<double> db(threads, 0.0);
+    parallel::parallel_for(0, picked.size(), 1,
+        [&](size_t b, size_t e, size_t slot) {
+            double s = 0.0;
+            for (size_t p = b; p < e; p++) {
+                uint32_t ci = used[picked[p]];
+                double worst = 0.0;
+                for (uint32_t cj : used) {
+                    if (cj == ci)
+                        continue;
+                    double m = engine.dist(
+                        engine.centroid(ci), engine.centroid(cj));
+                    if (m > 0.0)
+                        worst = std::max(worst, (spread[ci] + spread[cj]) / m);
+                }
+                s += worst;
+            }
+            db[slot] += s;
+        });
+    q.davies_bouldin_clusters = used.size() > 1 ? picked.size() : 0;
+    if (q.davies_bouldin_clusters)
+        q.davies_bouldin = std::accumulate(db.begin(), db.end(), 0.0)
+            / double(picked.size());
+    return q;
+}
+
+// the measures as JSON members without the enclosing braces, to be merged
+// into other records
+inline void write_quality_fields(std::ostream& os, const cluster_quality& q)
+{
+    os << "\"num_samples\":" << q.num_samples
+       << ",\"num_clusters\":" << q.num_clusters
+       << ",\"inertia\":" << q.inertia
+       << ",\"average_distance\":" << q.average_distance
+       << ",\"silhouette\":" << q.silhouette
+       << ",\"silhouette_rows\":" << q.silhouette_rows
+       << ",\"davies_bouldin\":" << q.davies_bouldin
+       << ",\"davies_bouldin_clusters\":" << q.davies_bouldin_clusters
+       << ",\"empty_clusters\":" << q.empty_clusters
+       << ",\"singleton_clusters\":" << q.singleton_clusters
+       << ",\"min_size\":" << q.min_size
+       << ",\"median_size\":" << q.median_size
+       << ",\"max_size\":" << q.max_size << ",\"size_histogram\":[";
+    for (size_t b = 0; b < q.size_histogram.size(); b++)
+        os << (b ? "," : "") << q.size_histogram[b];
+    os << "]";
+}
+
+inline void log_cluster_quality(const cluster_quality& q)
+{
+    LOG_INFO << "quality: inertia = " << q.inertia
+             << " average distance = " << q.average_distance;
+    LOG_INFO << "quality: simplified silhouette = " << q.silhouette << " ("
+             << q.silhouette_rows << " rows)";
+    LOG_INFO << "quality: davies-bouldin = " << q.davies_bouldin << " ("
+             << q.davies_bouldin_clusters << " clusters)";
+    LOG_INFO << "quality: cluster sizes min/median/max = " << q.min_size
+             << "/" << q.median_size << "/" << q.max_size
+             << ", empty = " << q.empty_clusters
+             << ", singletons = " << q.singleton_clusters;
+    for (size_t b = 0; b < q.size_histogram.size(); b++) {
+        if (q.size_histogram[b] == 0)
+            continue;
+        size_t lo = b == 0 ? 0 : size_t(1) << (b - 1);
+        size_t hi = b == 0 ? 0 : (size_t(1) << b) - 1;
+        LOG_INFO << "quality: size " << lo << "-" << hi << ": "
+                 << q.size_histogram[b] << " clusters";
+    }
+}
@@ -0,0 +1,274 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "distance.hpp"
+#include "half.hpp"
+#include "parallel.hpp"
+#include "word_table.hpp"
+
+//
+// Text report of a clustering run:
+//   "<cluster>: <word> <dist> <avg dist of the cluster>" per sample, grouped
+//   by cluster id and in input order within a cluster, followed by
+//   "CENTROID <i>: <f_1> ... <f_d> " per centroid.
+// Numbers are printed like std::ostream with default flags ("%g").
+// half_samples, if set, replaces samples with packed half rows. With angular
+// set (cosine metric, unit-norm rows) <dist> is the angle in radians
+// between the sample and its centroid instead of the euclidean distance.
+//
+
+namespace cluster_report {
+
+// formats items [0,count) with format(i, buf) on all threads and writes the
+// buffers in order. Works in rounds so only a bounded amount of text is
+// held in memory.
+template <class t_format>
+void write_parallel(std::ostream& os, size_t count, size_t grain,
+    t_format format)
+{
+    size_t blocks_per_round = parallel::num_threads() * 4;
+    std::vector<std::string> bufs(blocks_per_round);
+    for (size_t round_begin = 0; round_begin < count;
+         round_begin += blocks_per_round * grain) {
+        size_t round_end
+            = std::min(count, round_begin + blocks_per_round * grain);
+        size_t blocks = (round_end - round_begin + grain - 1) / grain;
+        parallel::parallel_for(0, blocks, 1, [&](size_t b, size_t e, size_t) {
+            for (size_t blk = b; blk < e; blk++) {
+                auto& buf = bufs[blk];
+                buf.clear();
+                size_t first = round_begin + blk * grain;
+                size_t last = std::min(round_end, first + grain);
+                for (size_t i = first; i < last; i++)
+                    format(i, buf);
+            }
+        });
+        for (size_t blk = 0; blk < blocks; blk++)
+            os.write(bufs[blk].data(), bufs[blk].size());
+    }
+}
+
+// euclidean distance summed in feature order. The report keeps this exact
+// summation order (not distance::l2_sq) so the printed digits do not change;
+// this relies on -ffp-contract=off (CMakeLists.txt), as a fused multiply-add
+// rounds differently.
+inline float sequential_l2(const float* a, const float* b, size_t n)
+{
+    float dist = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        dist += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return std::sqrt(dist);
+}
+
+inline void append_float(std::string& buf, float v)
+{
+    char tmp[32];
+    int len = snprintf(tmp, sizeof(tmp), "%g", double(v));
+    buf.append(tmp, len);
+}
+
+// distance of every sample to its centroid as printed in the report
+inline std::vector<float> sample_distances(size_t num_samples,
+                                           size_t num_features,
+                                           const float* samples,
+                                           const float* centroids,
+                                           const uint32_t* assignments,
+                                           const uint16_t* half_samples,
+                                           bool angular)
+{
+    std::vector<float> dists(num_samples);
+    parallel::parallel_for(0, num_samples, [&](size_t b, size_t e, size_t) {
+        std::vector<float> scratch(half_samples ? num_features : 0);
+        for (size_t i = b; i < e; i++) {
+            const float* x = samples + i * num_features;
+            if (half_samples) {
+                half::widen(half_samples + i * num_features, scratch.data(),
+                    num_features);
+                x = scratch.data();
+            }
+            const float* centr
+                = centroids + size_t(assignments[i]) * num_features;
+            dists[i] = angular
+                ? distance::angular(x, centr, num_features)
+                : cluster_report::sequential_l2(x, centr, num_features);
+        }
+    });
+    return dists;
+}
+}
+
+// report from the distances of the samples to their centroids, e.g. as
+// computed by the workers of a distributed run
+inline void write_cluster_report_dists(std::ostream& os,
+                                       size_t num_samples,
+                                       size_t num_features,
+                                       size_t num_clusters,
+                                       const float* centroids,
+                                       const uint32_t* assignments,
+                                       const float* dists,
+                                       const word_table& words)
+{
+    // (1) stable counting sort of the samples by cluster id
+    std::vector<size_t> offsets(num_clusters + 1, 0);
+    for (size_t i = 0; i < num_samples; i++)
+        offsets[assignments[i] + 1]++;
+    for (size_t c = 0; c < num_clusters; c++)
+        offsets[c + 1] += offsets[c];
+    std::vector<uint32_t> members(num_samples);
+    {
+        std::vector<size_t> pos(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < num_samples; i++)
+            members[pos[assignments[i]]++] = uint32_t(i);
+    }
+
+    // (2) average distance per cluster, summed in input order
+    std::vector<float> avg_dists(num_clusters, 0.0f);
+    parallel::parallel_for(0, num_clusters, [&](size_t b, size_t e, size_t) {
+        for (size_t c = b; c < e; c++) {
+            float total = 0.0f;
+            for (size_t m = offsets[c]; m < offsets[c + 1]; m++)
+                total += dists[members[m]];
+            avg_dists[c] = total / float(offsets[c + 1] - offsets[c]);
+        }
+    });
+
+    // (3) sample lines, then centroid lines
+    std::vector<uint32_t> member_cluster(num_samples);
+    for (size_t c = 0; c < num_clusters; c++)
+        std::fill(member_cluster.begin() + offsets[c],
+            member_cluster.begin() + offsets[c + 1], uint32_t(c));
+    cluster_report::write_parallel(
+        os, num_samples, 1 << 14, [&](size_t m, std::string& buf) {
+            uint32_t c = member_cluster[m];
+            uint32_t i = members[m];
+            buf += std::to_string(c);
+            buf += ": ";
+            buf.append(words.c_str(i), words.length(i));
+            buf += ' ';
+            cluster_report::append_float(buf, dists[i]);
+            buf += ' ';
+            cluster_report::append_float(buf, avg_dists[c]);
+            buf += '\n';
+        });
+    cluster_report::write_parallel(
+        os, num_clusters, 64, [&](size_t c, std::string& buf) {
+            buf += "CENTROID ";
+            buf += std::to_string(c);
+            buf += ": ";
+            const float* centr = centroids + c * num_features;
+            for (size_t j = 0; j < num_features; j++) {
+                cluster_report::append_float(buf, centr[j]);
+                buf += ' ';
+            }
+            buf += '\n';
+        });
+    os.flush();
+}
+
+inline void write_cluster_report(std::ostream& os,
+                                 size_t num_samples,
+                                 size_t num_features,
+                                 size_t num_clusters,
+                                 const float* samples,
+                                 const float* centroids,
+                                 const uint32_t* assignments,
+                                 const word_table& words,
+                                 const uint16_t* half_samples = nullptr,
+                                 bool angular = false)
+{
+    auto dists = cluster_report::sample_distances(num_samples,
+                                                  num_features,
+                                                  samples,
+                                                  centroids,
+                                                  assignments,
+                                                  half_samples,
+                                                  angular);
+    write_cluster_report_dists(os,
+                               num_samples,
+                               num_features,
+                               num_clusters,
+                               centroids,
+                               assignments,
+                               dists.data(),
+                               words);
+}
+
+// clustering result read back from a report. Log lines mixed into the
+// report (the logger writes to stdout as well) are skipped.
+struct cluster_result {
+    size_t num_clusters = 0;
+    size_t num_features = 0;
+    std::vector<float> centroids;
+    // sample lines in report order: word, cluster and printed distance
+    word_table words;
+    std::vector<uint32_t> word_cluster;
+    std::vector<float> word_dist;
+};
+
+inline cluster_result read_cluster_report(const std::string& file_name)
+{
+    std::ifstream in(file_name);
+    if (!in)
+        throw std::runtime_error("cannot open " + file_name);
+    cluster_result res;
+    std::vector<std::vector<float>> cents;
+    std::string line;
+    while (std::getline(in, line)) {
+        const char* p = line.c_str();
+        if (line.compare(0, 9, "CENTROID ") == 0) {
+            char* end;
+            size_t id = strtoul(p + 9, &end, 10);
+            if (*end != ':')
+                continue;
+            std::vector<float> v;
+            p = end + 1;
+            while (true) {
+                float f = strtof(p, &end);
+                if (end == p)
+                    break;
+                v.push_back(f);
+                p = end;
+            }
+            if (cents.size() <= id)
+                cents.resize(id + 1);
+            cents[id] = std::move(v);
+            continue;
+        }
+        // "<cluster>: <word> <dist> <avg dist>"
+        size_t digits = 0;
+        while (p[digits] >= '0' && p[digits] <= '9')
+            digits++;
+        if (digits == 0 || p[digits] != ':' || p[digits + 1] != ' ')
+            continue;
+        size_t word_begin = digits + 2;
+        size_t word_end = line.find(' ', word_begin);
+        if (word_end == std::string::npos)
+            continue;
+        res.words.push_back(p + word_begin, word_end - word_begin);
+        res.word_cluster.push_back(uint32_t(strtoul(p, nullptr, 10)));
+        res.word_dist.push_back(strtof(p + word_end, nullptr));
+    }
+    res.num_clusters = cents.size();
+    for (auto& c : cents)
+        res.num_features = std::max(res.num_features, c.size());
+    for (size_t i = 0; i < cents.size(); i++) {
+        if (cents[i].size() != res.num_features)
+            throw std::runtime_error("missing or short CENTROID line "
+                + std::to_string(i) + " in " + file_name);
+    }
+    res.centroids.reserve(res.num_clusters * res.num_features);
+    for (auto& c : cents)
+        res.centroids.insert(res.centroids.end(), c.begin(), c.end());
+    return res;
+}
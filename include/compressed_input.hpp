@@ -0,0 +1,204 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+#ifdef CWV_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+//
+// Sequential byte sources over plain, gzip and zstd compressed files. The
+// compression is detected from the magic bytes, not the file name. zstd
+// needs a build with CWV_HAVE_ZSTD (set by CMakeLists.txt if libzstd is
+// found).
+//
+
+namespace compressed_input {
+
+enum class compression { none, gzip, zstd };
+
+inline compression detect(const std::string& file_name)
+{
+    unsigned char m[4] = { 0 };
+    FILE* f = fopen(file_name.c_str(), "rb");
+    if (f == nullptr)
+        return compression::none;
+    size_t got = fread(m, 1, sizeof(m), f);
+    fclose(f);
+    if (got >= 2 && m[0] == 0x1f && m[1] == 0x8b)
+        return compression::gzip;
+    if (got == 4 && m[0] == 0x28 && m[1] == 0xb5 && m[2] == 0x2f
+        && m[3] == 0xfd)
+        return compression::zstd;
+    return compression::none;
+}
+
+inline const char* name(compression c)
+{
+    switch (c) {
+    case compression::gzip:
+        return "gzip";
+    case compression::zstd:
+        return "zstd";
+    default:
+        return "none";
+    }
+}
+
+class byte_source {
+public:
+    virtual ~byte_source() = default;
+    // up to len decompressed bytes into buf, 0 at the end of the file
+    virtual size_t read(char* buf, size_t len) = 0;
+};
+
+class plain_source : public byte_source {
+public:
+    explicit plain_source(const std::string& file_name)
+        : name(file_name)
+    {
+        f = fopen(file_name.c_str(), "rb");
+        if (f == nullptr)
+            throw std::runtime_error("cannot open " + file_name);
+    }
+    ~plain_source() { fclose(f); }
+
+    size_t read(char* buf, size_t len) override
+    {
+        size_t got = fread(buf, 1, len, f);
+        if (got < len && ferror(f))
+            throw std::runtime_error("error reading " + name);
+        return got;
+    }
+
+private:
+    std::string name;
+    FILE* f;
+};
+
+// gzip through zlib; concatenated members are read as one stream
+class gzip_source : public byte_source {
+public:
+    explicit gzip_source(const std::string& file_name)
+        : name(file_name)
+    {
+        gz = gzopen(file_name.c_str(), "rb");
+        if (gz == nullptr)
+            throw std::runtime_error("cannot open " + file_name);
+        gzbuffer(gz, 1 << 20);
+    }
+    ~gzip_source() { gzclose(gz); }
+
+    size_t read(char* buf, size_t len) override
+    {
+        size_t done = 0;
+        while (done < len) {
+            unsigned want = unsigned(std::min<size_t>(len - done, 1 << 30));
+            int got = gzread(gz, buf + done, want);
+            if (got < 0) {
+                int err;
+                const char* msg = gzerror(gz, &err);
+                throw std::runtime_error(
+                    "error decompressing " + name + ": " + msg);
+            }
+            if (got == 0)
+                break;
+            done += size_t(got);
+        }
+        // a short read at the end: zlib flags a truncated stream
+        int err = Z_OK;
+        if (done < len)
+            gzerror(gz, &err);
+        if (err == Z_BUF_ERROR)
+            throw std::runtime_error("truncated gzip file " + name);
+        return done;
+    }
+
+private:
+    std::string name;
+    gzFile gz;
+};
+
+#ifdef CWV_HAVE_ZSTD
+class zstd_source : public byte_source {
+public:
+    explicit zstd_source(const std::string& file_name)
+        : name(file_name)
+        , in_buf(ZSTD_DStreamInSize())
+    {
+        f = fopen(file_name.c_str(), "rb");
+        if (f == nullptr)
+            throw std::runtime_error("cannot open " + file_name);
+        dctx = ZSTD_createDCtx();
+        if (dctx == nullptr) {
+            fclose(f);
+            throw std::runtime_error("cannot create zstd context");
+        }
+        in = { in_buf.data(), 0, 0 };
+    }
+    ~zstd_source()
+    {
+        ZSTD_freeDCtx(dctx);
+        fclose(f);
+    }
+
+    size_t read(char* buf, size_t len) override
+    {
+        ZSTD_outBuffer out = { buf, len, 0 };
+        while (out.pos < out.size) {
+            if (in.pos == in.size) {
+                in.size = fread(in_buf.data(), 1, in_buf.size(), f);
+                in.pos = 0;
+                if (in.size == 0) {
+                    if (ferror(f))
+                        throw std::runtime_error("error reading " + name);
+                    if (!frame_done)
+                        throw std::runtime_error(
+                            "truncated zstd file " + name);
+                    break;
+                }
+            }
+            size_t ret = ZSTD_decompressStream(dctx, &out, &in);
+            if (ZSTD_isError(ret))
+                throw std::runtime_error("error decompressing " + name + ": "
+                    + ZSTD_getErrorName(ret));
+            frame_done = ret == 0;
+        }
+        return out.pos;
+    }
+
+private:
+    std::string name;
+    FILE* f;
+    ZSTD_DCtx* dctx;
+    std::vector<char> in_buf;
+    ZSTD_inBuffer in;
+    bool frame_done = true;
+};
+#endif
+
+inline std::unique_ptr<byte_source> open(const std::string& file_name)
+{
+    switch (detect(file_name)) {
+    case compression::gzip:
+        return std::unique_ptr<byte_source>(new gzip_source(file_name));
+    case compression::zstd:
+#ifdef CWV_HAVE_ZSTD
+        return std::unique_ptr<byte_source>(new zstd_source(file_name));
+#else
+        throw std::runtime_error(
+            file_name + " is zstd compressed: rebuild with libzstd");
+#endif
+    default:
+        return std::unique_ptr<byte_source>(new plain_source(file_name));
+    }
+}
+}
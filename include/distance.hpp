@@ -0,0 +1,257 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+//
+// Distance kernels used by the CPU engine and the post-processing stage.
+// The build targets the portable baseline (-msse4.2 in CMakeLists.txt); the
+// AVX2 and AVX-512 kernels are compiled with target attributes and picked
+// at runtime from the features of the CPU. A -DCWV_NATIVE=ON build enables
+// the widest kernel at compile time and skips the dispatch.
+//
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CWV_DISTANCE_DISPATCH 1
+#define CWV_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+namespace distance_detail {
+
+// baseline kernels: SSE if the build enables it, else scalar
+inline float l2_sq_base(const float* a, const float* b, size_t n)
+{
+    size_t i = 0;
+    float dist = 0.0f;
+#if defined(__SSE4_2__)
+    __m128 acc0 = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+    }
+    __m128 shuf = _mm_movehdup_ps(acc0);
+    __m128 sums = _mm_add_ps(acc0, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    dist = _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+#endif
+    for (; i < n; i++) {
+        dist += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return dist;
+}
+
+inline float dot_base(const float* a, const float* b, size_t n)
+{
+    size_t i = 0;
+    float sum = 0.0f;
+#if defined(__SSE4_2__)
+    __m128 acc0 = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_ps(
+            acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    __m128 shuf = _mm_movehdup_ps(acc0);
+    __m128 sums = _mm_add_ps(acc0, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sum = _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+#endif
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#if defined(CWV_DISTANCE_DISPATCH)
+CWV_TARGET("avx2,fma") inline float hsum256(__m256 v)
+{
+    __m128 lo = _mm_add_ps(
+        _mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    __m128 shuf = _mm_movehdup_ps(lo);
+    __m128 sums = _mm_add_ps(lo, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+
+CWV_TARGET("avx2,fma")
+inline float l2_sq_avx2(const float* a, const float* b, size_t n)
+{
+    size_t i = 0;
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0
+            = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(
+            _mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d0
+            = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(d0, d0));
+    }
+    float dist = hsum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; i++) {
+        dist += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return dist;
+}
+
+CWV_TARGET("avx2,fma")
+inline float dot_avx2(const float* a, const float* b, size_t n)
+{
+    size_t i = 0;
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(
+            _mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(
+            _mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_ps(acc0,
+            _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+    float sum = hsum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+CWV_TARGET("avx512f")
+inline float l2_sq_avx512(const float* a, const float* b, size_t n)
+{
+    size_t i = 0;
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    for (; i + 32 <= n; i += 32) {
+        __m512 d0
+            = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(
+            _mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m512 d0
+            = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+    }
+    if (i < n) {
+        __mmask16 m = (__mmask16)((1U << (n - i)) - 1);
+        __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i),
+            _mm512_maskz_loadu_ps(m, b + i));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+CWV_TARGET("avx512f")
+inline float dot_avx512(const float* a, const float* b, size_t n)
+{
+    size_t i = 0;
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(
+            _mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(
+            _mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_fmadd_ps(
+            _mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    }
+    if (i < n) {
+        __mmask16 m = (__mmask16)((1U << (n - i)) - 1);
+        acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i),
+            _mm512_maskz_loadu_ps(m, b + i), acc0);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+#endif
+
+typedef float (*kernel_fn)(const float*, const float*, size_t);
+
+struct kernels {
+    kernel_fn l2_sq;
+    kernel_fn dot;
+    const char* name;
+};
+
+// the widest kernels the CPU supports, resolved once
+inline const kernels& select()
+{
+    static const kernels k = [] {
+#if defined(CWV_DISTANCE_DISPATCH)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return kernels{ l2_sq_avx512, dot_avx512, "avx512" };
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return kernels{ l2_sq_avx2, dot_avx2, "avx2" };
+#endif
+#if defined(__SSE4_2__)
+        return kernels{ l2_sq_base, dot_base, "sse4.2" };
+#else
+        return kernels{ l2_sq_base, dot_base, "scalar" };
+#endif
+    }();
+    return k;
+}
+}
+
+namespace distance {
+
+// name of the kernels in use, for logs and benchmark records
+inline const char* kernel_name()
+{
+#if defined(CWV_DISTANCE_DISPATCH) && defined(__AVX512F__)
+    return "avx512";
+#elif defined(CWV_DISTANCE_DISPATCH) && defined(__AVX2__) && defined(__FMA__)
+    return "avx2";
+#else
+    return distance_detail::select().name;
+#endif
+}
+
+// squared euclidean distance
+inline float l2_sq(const float* a, const float* b, size_t n)
+{
+#if defined(CWV_DISTANCE_DISPATCH) && defined(__AVX512F__)
+    return distance_detail::l2_sq_avx512(a, b, n);
+#elif defined(CWV_DISTANCE_DISPATCH) && defined(__AVX2__) && defined(__FMA__)
+    return distance_detail::l2_sq_avx2(a, b, n);
+#else
+    return distance_detail::select().l2_sq(a, b, n);
+#endif
+}
+
+inline float dot(const float* a, const float* b, size_t n)
+{
+#if defined(CWV_DISTANCE_DISPATCH) && defined(__AVX512F__)
+    return distance_detail::dot_avx512(a, b, n);
+#elif defined(CWV_DISTANCE_DISPATCH) && defined(__AVX2__) && defined(__FMA__)
+    return distance_detail::dot_avx2(a, b, n);
+#else
+    return distance_detail::select().dot(a, b, n);
+#endif
+}
+
+// angle between two L2 normalised vectors
+inline float angular(const float* a, const float* b, size_t n)
+{
+    float d = dot(a, b, n);
+    if (d > 1.0f)
+        d = 1.0f;
+    if (d < -1.0f)
+        d = -1.0f;
+    return std::acos(d);
+}
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "parallel.hpp"
+#include "util.hpp"
+
+//
+// IEEE half precision storage. float -> half uses the basetable/shifttable
+// lookup from util.hpp (truncating, as in van der Zee's "Fast Half Float
+// Conversions"); half -> float uses F16C when the CPU has it (checked at
+// runtime, see distance.hpp). Rows are stored as packed halves, i.e. the half2 layout that
+// kmeans_cuda() expects with fp16x2 set.
+//
+
+namespace half {
+
+inline void init_tables()
+{
+    static bool done = (generatetables(), true);
+    (void)done;
+}
+
+// init_tables() must have been called
+inline uint16_t from_float(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t e = (x >> 23) & 0x1ff;
+    return uint16_t(basetable[e] + ((x & 0x007fffff) >> shifttable[e]));
+}
+
+inline float to_float(uint16_t h)
+{
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if (exp == 0x1f) {
+        x = sign | 0x7f800000 | (mant << 13);
+    } else if (exp != 0) {
+        x = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        x = sign;
+    } else {
+        // denormal half: normalise the mantissa
+        exp = 113;
+        while ((mant & 0x400) == 0) {
+            mant <<= 1;
+            exp--;
+        }
+        x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+inline void narrow(const float* src, uint16_t* dst, size_t n)
+{
+    init_tables();
+    for (size_t i = 0; i < n; i++)
+        dst[i] = from_float(src[i]);
+}
+
+inline void widen_scalar(const uint16_t* src, float* dst, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        dst[i] = to_float(src[i]);
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+__attribute__((target("avx,f16c"))) inline void widen_f16c(
+    const uint16_t* src, float* dst, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+    }
+    widen_scalar(src + i, dst + i, n - i);
+}
+
+inline bool has_f16c()
+{
+    static const bool f16c = [] {
+        unsigned a, b, c, d;
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx") && __get_cpuid(1, &a, &b, &c, &d)
+            && (c & bit_F16C) != 0;
+    }();
+    return f16c;
+}
+#endif
+
+inline void widen(const uint16_t* src, float* dst, size_t n)
+{
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    if (has_f16c()) {
+        widen_f16c(src, dst, n);
+        return;
+    }
+#endif
+    widen_scalar(src, dst, n);
+}
+
+// converts a rows x cols float matrix on all threads
+inline std::vector<uint16_t> narrow_matrix(
+    const float* src, size_t rows, size_t cols)
+{
+    init_tables();
+    std::vector<uint16_t> dst(rows * cols);
+    parallel::parallel_for(0, rows, [&](size_t b, size_t e, size_t) {
+        narrow(src + b * cols, dst.data() + b * cols, (e - b) * cols);
+    });
+    return dst;
+}
+}
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kmcuda.h"
+
+#include "cluster_report.hpp"
+#include "distance.hpp"
+#include "kmeans_cpu.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+#include "timing.hpp"
+
+//
+// Two-level k-means for large cluster counts. The samples are first
+// clustered into about sqrt(k) coarse groups, then every group is split
+// into its share of the k leaf clusters. The groups are independent and run
+// concurrently on the thread pool. An optional refinement pass reassigns
+// each sample among the leaves of its nearest coarse groups, so a sample
+// costs O(coarse + probes * k / coarse) distances instead of O(k).
+//
+
+// coarse -> leaf tree. The leaves of coarse group g are the flat clusters
+// [child_offsets[g], child_offsets[g + 1]).
+struct kmeans_tree {
+    size_t num_coarse = 0;
+    std::vector<float> coarse_centroids;
+    std::vector<uint32_t> leaf_parent;
+    std::vector<size_t> child_offsets;
+};
+
+// writes the tree as "COARSE <g>: <f_1> ... <f_d> " per coarse centroid and
+// "PARENT <leaf>: <g>" per leaf, formatted in parallel like the report
+inline void write_tree(std::ostream& os, const kmeans_tree& tree, size_t d)
+{
+    cluster_report::write_parallel(
+        os, tree.num_coarse, 64, [&](size_t g, std::string& buf) {
+            buf += "COARSE ";
+            buf += std::to_string(g);
+            buf += ": ";
+            for (size_t j = 0; j < d; j++) {
+                cluster_report::append_float(
+                    buf, tree.coarse_centroids[g * d + j]);
+                buf += ' ';
+            }
+            buf += '\n';
+        });
+    cluster_report::write_parallel(
+        os, tree.leaf_parent.size(), 4096, [&](size_t i, std::string& buf) {
+            buf += "PARENT ";
+            buf += std::to_string(i);
+            buf += ": ";
+            buf += std::to_string(tree.leaf_parent[i]);
+            buf += '\n';
+        });
+}
+
+struct hierarchical_options {
+    // number of coarse groups, 0 picks ceil(sqrt(k))
+    size_t coarse_clusters = 0;
+    // global refinement passes after the per-group runs
+    size_t refine_iterations = 1;
+    // coarse groups searched per sample during refinement
+    size_t refine_probes = 2;
+};
+
+// runs flat k-means for the coarse level, so the coarse stage can use any
+// backend. Same meaning of the arguments as in kmeans_cuda().
+using flat_kmeans_fn = std::function<KMCUDAResult(uint32_t samples_size,
+    uint32_t clusters_size,
+    const float* samples,
+    float* centroids,
+    uint32_t* assignments)>;
+
+namespace hierarchical {
+
+// splits k leaves over the groups proportionally to the group sizes. Every
+// non-empty group gets at least one leaf and never more leaves than samples.
+inline std::vector<size_t> allocate_leaves(
+    const std::vector<size_t>& sizes, size_t n, size_t k)
+{
+    size_t groups = sizes.size();
+    std::vector<size_t> leaves(groups, 0);
+    size_t total = 0;
+    for (size_t g = 0; g < groups; g++) {
+        if (sizes[g] == 0)
+            continue;
+        size_t share = size_t(double(k) * double(sizes[g]) / double(n));
+        leaves[g] = std::min(std::max<size_t>(share, 1), sizes[g]);
+        total += leaves[g];
+    }
+    // hand out / take back the rounding difference where the samples per
+    // leaf are largest / smallest
+    while (total < k) {
+        size_t best = groups;
+        double best_ratio = 0.0;
+        for (size_t g = 0; g < groups; g++) {
+            if (leaves[g] >= sizes[g])
+                continue;
+            double ratio = double(sizes[g]) / double(leaves[g] + 1);
+            if (best == groups || ratio > best_ratio) {
+                best = g;
+                best_ratio = ratio;
+            }
+        }
+        if (best == groups)
+            break;
+        leaves[best]++;
+        total++;
+    }
+    while (total > k) {
+        size_t best = groups;
+        double best_ratio = 0.0;
+        for (size_t g = 0; g < groups; g++) {
+            if (leaves[g] <= 1)
+                continue;
+            double ratio = double(sizes[g]) / double(leaves[g] - 1);
+            if (best == groups || ratio < best_ratio) {
+                best = g;
+                best_ratio = ratio;
+            }
+        }
+        if (best == groups)
+            break;
+        leaves[best]--;
+        total--;
+    }
+    return leaves;
+}
+}
+
+/// Clusters samples into clusters_size leaves with the two-level scheme
+/// above. centroids / assignments are the same flat outputs as for
+/// kmeans_cuda(); the coarse level and the leaf parents go to tree.
+/// Subproblems use init / init_params with a per-group seed and the
+/// tolerance of the flat run.
+inline KMCUDAResult kmeans_hierarchical(const flat_kmeans_fn& coarse_kmeans,
+                                        KMCUDAInitMethod init,
+                                        const void* init_params,
+                                        float tolerance,
+                                        KMCUDADistanceMetric metric,
+                                        uint32_t samples_size,
+                                        uint16_t features_size,
+                                        uint32_t clusters_size,
+                                        uint32_t seed,
+                                        int32_t verbosity,
+                                        const float* samples,
+                                        float* centroids,
+                                        uint32_t* assignments,
+                                        kmeans_tree& tree,
+                                        const hierarchical_options& opts
+                                        = hierarchical_options())
+{
+    size_t n = samples_size;
+    size_t d = features_size;
+    size_t k = clusters_size;
+    if (k < 2 || n < k || d == 0)
+        return kmcudaInvalidArguments;
+    size_t coarse = opts.coarse_clusters;
+    if (coarse == 0)
+        coarse = size_t(std::ceil(std::sqrt(double(k))));
+    coarse = std::min(std::max<size_t>(coarse, 2), k);
+    LOG_INFO << "hierarchical: " << coarse << " coarse groups, " << k
+             << " leaves";
+
+    // (1) coarse level
+    tree.num_coarse = coarse;
+    tree.coarse_centroids.assign(coarse * d, 0.0f);
+    std::vector<uint32_t> coarse_assignments(n);
+    {
+        cl_timer<> coarse_timer("hierarchical coarse");
+        auto res = coarse_kmeans(samples_size,
+                                 uint32_t(coarse),
+                                 samples,
+                                 tree.coarse_centroids.data(),
+                                 coarse_assignments.data());
+        if (res != kmcudaSuccess)
+            return res;
+    }
+
+    // (2) group the samples by coarse cluster and split the leaves
+    std::vector<size_t> offsets(coarse + 1, 0);
+    for (size_t i = 0; i < n; i++)
+        offsets[coarse_assignments[i] + 1]++;
+    for (size_t g = 0; g < coarse; g++)
+        offsets[g + 1] += offsets[g];
+    std::vector<uint32_t> members(n);
+    {
+        std::vector<size_t> pos(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < n; i++)
+            members[pos[coarse_assignments[i]]++] = uint32_t(i);
+    }
+    std::vector<size_t> sizes(coarse);
+    for (size_t g = 0; g < coarse; g++)
+        sizes[g] = offsets[g + 1] - offsets[g];
+    auto leaves = hierarchical::allocate_leaves(sizes, n, k);
+    tree.child_offsets.assign(coarse + 1, 0);
+    for (size_t g = 0; g < coarse; g++)
+        tree.child_offsets[g + 1] = tree.child_offsets[g] + leaves[g];
+    if (tree.child_offsets[coarse] != k) {
+        LOG_ERROR << "hierarchical: cannot place " << k << " leaves";
+        return kmcudaInvalidArguments;
+    }
+    tree.leaf_parent.resize(k);
+    for (size_t g = 0; g < coarse; g++)
+        std::fill(tree.leaf_parent.begin() + tree.child_offsets[g],
+            tree.leaf_parent.begin() + tree.child_offsets[g + 1],
+            uint32_t(g));
+
+    // (3) cluster every group into its leaves, largest groups first so the
+    // pool stays busy towards the end
+    std::vector<size_t> order(coarse);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(),
+        [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+    {
+        cl_timer<> leaf_timer("hierarchical leaves");
+        parallel::parallel_for(0, coarse, 1, [&](size_t b, size_t e, size_t) {
+            std::vector<float> rows;
+            std::vector<uint32_t> local;
+            for (size_t o = b; o < e; o++) {
+                size_t g = order[o];
+                size_t ng = sizes[g];
+                size_t kg = leaves[g];
+                if (kg == 0)
+                    continue;
+                rows.resize(ng * d);
+                for (size_t m = 0; m < ng; m++) {
+                    const float* x
+                        = samples + size_t(members[offsets[g] + m]) * d;
+                    std::copy(x, x + d, rows.data() + m * d);
+                }
+                local.assign(ng, 0);
+                float* leaf_centroids = centroids + tree.child_offsets[g] * d;
+                kmeans_cpu_engine engine(metric,
+                                         ng,
+                                         d,
+                                         kg,
+                                         0,
+                                         rows.data(),
+                                         leaf_centroids,
+                                         local.data());
+                if (kg == 1) {
+                    // a single leaf is the mean of the group
+                    engine.update_centroids();
+                } else if (kg == ng) {
+                    for (size_t m = 0; m < ng; m++) {
+                        std::copy(rows.data() + m * d,
+                            rows.data() + (m + 1) * d,
+                            leaf_centroids + m * d);
+                        local[m] = uint32_t(m);
+                    }
+                } else {
+                    engine.init_centroids(
+                        init, init_params, seed + uint32_t(g));
+                    engine.run(tolerance, 0.0f);
+                }
+                for (size_t m = 0; m < ng; m++)
+                    assignments[members[offsets[g] + m]]
+                        = uint32_t(tree.child_offsets[g] + local[m]);
+            }
+        });
+    }
+
+    // (4) refinement: move samples to the nearest leaf of their nearest
+    // coarse groups, then recompute the leaf centroids
+    size_t probes = std::min(std::max<size_t>(opts.refine_probes, 1), coarse);
+    kmeans_cpu_engine leaf_engine(
+        metric, n, d, k, 0, samples, centroids, assignments);
+    kmeans_cpu_engine coarse_engine(metric,
+                                    n,
+                                    d,
+                                    coarse,
+                                    0,
+                                    samples,
+                                    tree.coarse_centroids.data(),
+                                    nullptr);
+    for (size_t it = 0; it < opts.refine_iterations; it++) {
+        cl_timer<> refine_timer("hierarchical refine");
+        std::vector<size_t> changed(parallel::num_threads(), 0);
+        parallel::parallel_for(0, n, [&](size_t b, size_t e, size_t slot) {
+            std::vector<std::pair<float, uint32_t>> near(coarse);
+            for (size_t i = b; i < e; i++) {
+                const float* x = samples + i * d;
+                for (size_t g = 0; g < coarse; g++)
+                    near[g] = { coarse_engine.dist_cmp(
+                                    x, tree.coarse_centroids.data() + g * d),
+                        uint32_t(g) };
+                std::partial_sort(
+                    near.begin(), near.begin() + probes, near.end());
+                uint32_t best = assignments[i];
+                float best_dist = leaf_engine.dist_cmp(x, centroids + best * d);
+                for (size_t p = 0; p < probes; p++) {
+                    size_t g = near[p].second;
+                    for (size_t c = tree.child_offsets[g];
+                         c < tree.child_offsets[g + 1]; c++) {
+                        float dc = leaf_engine.dist_cmp(x, centroids + c * d);
+                        if (dc < best_dist) {
+                            best_dist = dc;
+                            best = uint32_t(c);
+                        }
+                    }
+                }
+                if (best != assignments[i]) {
+                    assignments[i] = best;
+                    changed[slot]++;
+                }
+            }
+        });
+        size_t total
+            = std::accumulate(changed.begin(), changed.end(), size_t(0));
+        if (verbosity > 0)
+            LOG_INFO << "hierarchical: refinement " << it << ": " << total
+                     << " reassignments";
+        if (total == 0)
+            break;
+        leaf_engine.update_centroids();
+    }
+    if (verbosity > 0 && opts.refine_iterations > 0)
+        LOG_INFO << "hierarchical: ~"
+                 << coarse + probes * double(k) / double(coarse)
+                 << " distances per sample and refinement pass (flat: " << k
+                 << ")";
+    return kmcudaSuccess;
+}
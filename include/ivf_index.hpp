@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "distance.hpp"
+#include "parallel.hpp"
+
+//
+// Inverted-file (IVF) index over a clustering result: the vectors of every
+// cluster are stored contiguously, so a query computes its distance to all
+// centroids, picks the closest probes clusters and scans only their lists.
+// probes == num_clusters gives the exact answer.
+//
+
+struct ivf_neighbor {
+    float dist; // squared euclidean distance
+    uint32_t id;
+    bool operator<(const ivf_neighbor& o) const
+    {
+        return dist < o.dist || (dist == o.dist && id < o.id);
+    }
+};
+
+class ivf_index {
+public:
+    ivf_index() = default;
+
+    // samples: n x d, centroids: k x d, assignments: n cluster ids
+    ivf_index(const float* samples,
+              size_t n,
+              size_t d,
+              const float* cents,
+              size_t k,
+              const uint32_t* assignments)
+        : num_samples(n)
+        , num_features(d)
+        , num_clusters(k)
+        , centroids(cents, cents + k * d)
+    {
+        list_offsets.assign(k + 1, 0);
+        for (size_t i = 0; i < n; i++)
+            list_offsets[assignments[i] + 1]++;
+        for (size_t c = 0; c < k; c++)
+            list_offsets[c + 1] += list_offsets[c];
+        list_ids.resize(n);
+        positions.resize(n);
+        {
+            std::vector<size_t> pos(
+                list_offsets.begin(), list_offsets.end() - 1);
+            for (size_t i = 0; i < n; i++) {
+                positions[i] = uint32_t(pos[assignments[i]]);
+                list_ids[pos[assignments[i]]++] = uint32_t(i);
+            }
+        }
+        list_vectors.resize(n * d);
+        parallel::parallel_for(0, n, [&](size_t b, size_t e, size_t) {
+            for (size_t m = b; m < e; m++)
+                std::copy(samples + size_t(list_ids[m]) * d,
+                    samples + size_t(list_ids[m] + 1) * d,
+                    list_vectors.data() + m * d);
+        });
+    }
+
+    size_t size() const { return num_samples; }
+    size_t dimensions() const { return num_features; }
+    size_t clusters() const { return num_clusters; }
+    const float* vector(uint32_t id) const
+    {
+        return list_vectors.data() + size_t(positions[id]) * num_features;
+    }
+
+    // top-k neighbours of q among the lists of the probes closest clusters,
+    // closest first. exclude is skipped (e.g. the query word itself).
+    std::vector<ivf_neighbor> search(const float* q,
+                                     size_t topk,
+                                     size_t probes,
+                                     uint32_t exclude = no_id) const
+    {
+        probes = std::min(std::max<size_t>(probes, 1), num_clusters);
+        std::vector<ivf_neighbor> cents(num_clusters);
+        for (size_t c = 0; c < num_clusters; c++)
+            cents[c] = { distance::l2_sq(q,
+                             centroids.data() + c * num_features,
+                             num_features),
+                uint32_t(c) };
+        std::partial_sort(cents.begin(), cents.begin() + probes, cents.end());
+        topk = std::min(topk, num_samples);
+        std::vector<ivf_neighbor> heap;
+        heap.reserve(topk + 1);
+        for (size_t p = 0; p < probes; p++) {
+            size_t c = cents[p].id;
+            scan(q, list_offsets[c], list_offsets[c + 1], topk, exclude, heap);
+        }
+        std::sort_heap(heap.begin(), heap.end());
+        return heap;
+    }
+
+    // exact top-k over all vectors, the baseline for recall measurements
+    std::vector<ivf_neighbor> brute_force(
+        const float* q, size_t topk, uint32_t exclude = no_id) const
+    {
+        topk = std::min(topk, num_samples);
+        std::vector<ivf_neighbor> heap;
+        heap.reserve(topk + 1);
+        scan(q, 0, num_samples, topk, exclude, heap);
+        std::sort_heap(heap.begin(), heap.end());
+        return heap;
+    }
+
+    static const uint32_t no_id = std::numeric_limits<uint32_t>::max();
+
+private:
+    // max-heap of the best topk candidates
+    void scan(const float* q,
+              size_t begin,
+              size_t end,
+              size_t topk,
+              uint32_t exclude,
+              std::vector<ivf_neighbor>& heap) const
+    {
+        if (topk == 0)
+            return;
+        for (size_t m = begin; m < end; m++) {
+            uint32_t id = list_ids[m];
+            if (id == exclude)
+                continue;
+            float d = distance::l2_sq(
+                q, list_vectors.data() + m * num_features, num_features);
+            if (heap.size() < topk) {
+                heap.push_back({ d, id });
+                std::push_heap(heap.begin(), heap.end());
+            } else if (ivf_neighbor{ d, id } < heap.front()) {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = { d, id };
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+    }
+
+    size_t num_samples = 0;
+    size_t num_features = 0;
+    size_t num_clusters = 0;
+    std::vector<float> centroids;
+    std::vector<size_t> list_offsets;
+    std::vector<uint32_t> list_ids;
+    std::vector<float> list_vectors;
+    std::vector<uint32_t> positions;
+};
@@ -0,0 +1,1049 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "kmcuda.h"
+
+#include "distance.hpp"
+#include "half.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+#include "timing.hpp"
+
+//
+// Multi-threaded CPU k-means engine with the same contract as kmeans_cuda()
+// from external/kmcuda: same init methods, tolerance semantics (stop once
+// the number of reassignments drops below tolerance * samples_size), Yinyang
+// group filtering, L2 / cosine metric, seed and outputs.
+//
+
+// kmcuda switches from Lloyd to Yinyang below this reassignment ratio
+#define KMEANS_CPU_YINYANG_DRAFT_REASSIGNMENTS 0.11
+// upper limit for the per-sample Yinyang group bounds
+#define KMEANS_CPU_YINYANG_MAX_BOUND_BYTES (size_t(4) << 30)
+
+// state passed to the per-iteration callback. It is invoked after the
+// centroid update, so the output centroids together with the output
+// assignments of the previous step are a consistent restart point. The
+// final assignment step that meets the tolerance is reported with
+// converged set and no centroid update.
+struct kmeans_iteration {
+    size_t iteration = 0;
+    size_t reassignments = 0;
+    bool yinyang = false;
+    bool converged = false;
+    // wall time of the phases of this iteration in microseconds; yinyang_us
+    // covers group setup and drift bookkeeping
+    double assign_us = 0.0;
+    double update_us = 0.0;
+    double yinyang_us = 0.0;
+    // only with kmeans_cpu_options::iteration_stats, negative otherwise
+    double inertia = -1.0;
+    int64_t empty_clusters = -1;
+};
+
+struct kmeans_cpu_options {
+    std::function<void(const kmeans_iteration&)> on_iteration;
+    // resume support: iteration number to continue from and whether the
+    // passed assignments are valid (they are reset otherwise)
+    size_t first_iteration = 0;
+    bool keep_assignments = false;
+    // compute inertia and empty clusters for every iteration (one extra
+    // pass over the samples)
+    bool iteration_stats = false;
+    // stop after this many centroid updates even if not converged (0 = no
+    // limit). The assignments returned match the final centroids.
+    size_t max_iterations = 0;
+};
+
+class kmeans_cpu_engine {
+public:
+    static const uint32_t unassigned = std::numeric_limits<uint32_t>::max();
+
+    kmeans_cpu_engine(KMCUDADistanceMetric m,
+                      size_t n,
+                      size_t d,
+                      size_t k,
+                      int32_t v,
+                      const float* s,
+                      float* c,
+                      uint32_t* a)
+        : metric(m)
+        , num_samples(n)
+        , num_features(d)
+        , num_clusters(k)
+        , verbosity(v)
+        , samples(s)
+        , centroids(c)
+        , assignments(a)
+    {
+    }
+
+    // half precision samples (num_features halves per row) instead of
+    // samples. Rows are widened to float in the kernels.
+    void set_half_samples(const uint16_t* h)
+    {
+        static std::atomic<uint64_t> next_id(0);
+        half_samples = h;
+        half_id = ++next_id;
+    }
+
+    // row i, widened into scratch (num_features floats) for half storage
+    const float* row(size_t i, float* scratch) const
+    {
+        if (half_samples == nullptr)
+            return samples + i * num_features;
+        half::widen(half_samples + i * num_features, scratch, num_features);
+        return scratch;
+    }
+
+    const float* sample(size_t i) const
+    {
+        if (half_samples == nullptr)
+            return samples + i * num_features;
+        // widen into a small per-thread cache, so that sample(i) stays
+        // valid while another row is in use and repeated calls for the
+        // same row return the same pointer
+        struct cached_row {
+            uint64_t owner = 0;
+            size_t index = 0;
+            std::vector<float> buf;
+        };
+        thread_local cached_row cache[2];
+        thread_local size_t next = 0;
+        for (auto& c : cache) {
+            if (c.owner == half_id && c.index == i)
+                return c.buf.data();
+        }
+        auto& c = cache[next++ & 1];
+        c.owner = half_id;
+        c.index = i;
+        c.buf.resize(num_features);
+        return row(i, c.buf.data());
+    }
+    float* centroid(size_t i) const { return centroids + i * num_features; }
+
+    // true metric distance (euclidean or angular)
+    float dist(const float* a, const float* b) const
+    {
+        if (metric == kmcudaDistanceMetricCosine)
+            return distance::angular(a, b, num_features);
+        return std::sqrt(distance::l2_sq(a, b, num_features));
+    }
+
+    // monotone proxy of dist() used for arg-min searches
+    float dist_cmp(const float* a, const float* b) const
+    {
+        if (metric == kmcudaDistanceMetricCosine)
+            return 1.0f - distance::dot(a, b, num_features);
+        return distance::l2_sq(a, b, num_features);
+    }
+
+    void init_centroids(KMCUDAInitMethod init,
+                        const void* init_params,
+                        uint32_t seed)
+    {
+        std::mt19937_64 rng(seed);
+        switch (init) {
+        case kmcudaInitMethodImport:
+            break;
+        case kmcudaInitMethodRandom:
+            init_random(rng);
+            break;
+        case kmcudaInitMethodPlusPlus:
+            init_plusplus(rng);
+            break;
+        case kmcudaInitMethodAFKMC2: {
+            uint32_t m = 0;
+            if (init_params)
+                m = *reinterpret_cast<const uint32_t*>(init_params);
+            init_afkmc2(rng, m == 0 ? 200 : m);
+            break;
+        }
+        }
+    }
+
+    // assign every sample to its nearest centroid. returns #reassignments
+    size_t assign_lloyd()
+    {
+        const size_t sample_block = 32;
+        const size_t centroid_block = 256;
+        std::vector<size_t> changed(parallel::num_threads(), 0);
+        std::vector<std::vector<float>> tiles(parallel::num_threads());
+        parallel::parallel_for(0,
+                               num_samples,
+                               sample_block,
+                               [&](size_t b, size_t e, size_t slot) {
+            // widen half rows once per tile, not once per centroid block
+            const float* tile = samples + b * num_features;
+            if (half_samples) {
+                tiles[slot].resize(sample_block * num_features);
+                half::widen(half_samples + b * num_features,
+                    tiles[slot].data(), (e - b) * num_features);
+                tile = tiles[slot].data();
+            }
+            float best_d[sample_block];
+            uint32_t best_c[sample_block];
+            std::fill(best_d, best_d + sample_block,
+                std::numeric_limits<float>::max());
+            std::fill(best_c, best_c + sample_block, 0);
+            // tile centroids so a block of them stays cache resident
+            for (size_t cb = 0; cb < num_clusters; cb += centroid_block) {
+                size_t ce = std::min(num_clusters, cb + centroid_block);
+                for (size_t i = b; i < e; i++) {
+                    const float* x = tile + (i - b) * num_features;
+                    float bd = best_d[i - b];
+                    uint32_t bc = best_c[i - b];
+                    for (size_t c = cb; c < ce; c++) {
+                        float dc = dist_cmp(x, centroid(c));
+                        if (dc < bd) {
+                            bd = dc;
+                            bc = c;
+                        }
+                    }
+                    best_d[i - b] = bd;
+                    best_c[i - b] = bc;
+                }
+            }
+            for (size_t i = b; i < e; i++) {
+                if (assignments[i] != best_c[i - b]) {
+                    assignments[i] = best_c[i - b];
+                    changed[slot]++;
+                }
+            }
+        });
+        return std::accumulate(changed.begin(), changed.end(), size_t(0));
+    }
+
+    // recompute centroids as the mean of their members. empty clusters
+    // keep their previous centroid.
+    void update_centroids()
+    {
+        group_by_cluster();
+        parallel::parallel_for(0,
+                               num_clusters,
+                               [&](size_t b, size_t e, size_t) {
+            std::vector<double> sum(num_features);
+            std::vector<float> scratch(num_features);
+            for (size_t c = b; c < e; c++) {
+                size_t mb = member_offsets[c];
+                size_t me = member_offsets[c + 1];
+                if (mb == me)
+                    continue;
+                std::fill(sum.begin(), sum.end(), 0.0);
+                for (size_t m = mb; m < me; m++) {
+                    const float* x = row(members[m], scratch.data());
+                    for (size_t j = 0; j < num_features; j++)
+                        sum[j] += x[j];
+                }
+                float* cent = centroid(c);
+                double norm = 0.0;
+                for (size_t j = 0; j < num_features; j++) {
+                    cent[j] = float(sum[j] / double(me - mb));
+                    norm += double(cent[j]) * double(cent[j]);
+                }
+                if (metric == kmcudaDistanceMetricCosine && norm > 0.0) {
+                    float inv = float(1.0 / std::sqrt(norm));
+                    for (size_t j = 0; j < num_features; j++)
+                        cent[j] *= inv;
+                }
+            }
+        });
+    }
+
+    double average_distance()
+    {
+        std::vector<double> sums(parallel::num_threads(), 0.0);
+        parallel::parallel_for(0,
+                               num_samples,
+                               [&](size_t b, size_t e, size_t slot) {
+            double s = 0.0;
+            std::vector<float> scratch(num_features);
+            for (size_t i = b; i < e; i++)
+                s += dist(row(i, scratch.data()), centroid(assignments[i]));
+            sums[slot] += s;
+        });
+        return std::accumulate(sums.begin(), sums.end(), 0.0)
+            / double(num_samples);
+    }
+
+    // sum of squared distances of the samples to their assigned centroids
+    double inertia()
+    {
+        std::vector<double> sums(parallel::num_threads(), 0.0);
+        parallel::parallel_for(0,
+                               num_samples,
+                               [&](size_t b, size_t e, size_t slot) {
+            double s = 0.0;
+            std::vector<float> scratch(num_features);
+            for (size_t i = b; i < e; i++) {
+                double d
+                    = dist(row(i, scratch.data()), centroid(assignments[i]));
+                s += d * d;
+            }
+            sums[slot] += s;
+        });
+        return std::accumulate(sums.begin(), sums.end(), 0.0);
+    }
+
+    // k-means|| seeding (Bahmani et al. 2012). Each round samples about
+    // oversampling * k candidates in parallel over fixed shards of the data
+    // (shard-seeded, so the result does not depend on the thread count).
+    // Candidates are weighted by the number of samples closest to them and
+    // reduced to k centroids with weighted kmeans++.
+    void init_kmeans_parallel(uint32_t seed, double oversampling, size_t rounds)
+    {
+        std::mt19937_64 rng(seed);
+        std::uniform_int_distribution<size_t> first(0, num_samples - 1);
+        std::vector<uint32_t> cand_ids { uint32_t(first(rng)) };
+        std::vector<float> cand(sample(cand_ids[0]),
+            sample(cand_ids[0]) + num_features);
+        std::vector<float> min_d(
+            num_samples, std::numeric_limits<float>::max());
+        std::vector<uint32_t> nearest(num_samples, 0);
+        const size_t shard = 4096;
+        size_t num_shards = (num_samples + shard - 1) / shard;
+        std::vector<double> shard_sums(num_shards);
+
+        // fold candidates [from, cand_ids.size()) into min_d / nearest
+        auto update = [&](size_t from) {
+            size_t to = cand_ids.size();
+            parallel::parallel_for(0,
+                                   num_samples,
+                                   shard,
+                                   [&](size_t b, size_t e, size_t) {
+                const size_t cblock = 256;
+                for (size_t cb = from; cb < to; cb += cblock) {
+                    size_t ce = std::min(to, cb + cblock);
+                    for (size_t i = b; i < e; i++) {
+                        for (size_t c = cb; c < ce; c++) {
+                            float w = seed_weight(
+                                sample(i), cand.data() + c * num_features);
+                            if (w < min_d[i]) {
+                                min_d[i] = w;
+                                nearest[i] = c;
+                            }
+                        }
+                    }
+                }
+                double s = 0.0;
+                for (size_t i = b; i < e; i++)
+                    s += min_d[i];
+                shard_sums[b / shard] = s;
+            });
+            return std::accumulate(shard_sums.begin(), shard_sums.end(), 0.0);
+        };
+
+        double psi = update(0);
+        double l = oversampling * num_clusters;
+        for (size_t r = 0; psi > 0.0
+             && (r < rounds || cand_ids.size() < num_clusters)
+             && r < rounds + 10;
+             r++) {
+            std::vector<std::vector<uint32_t>> picked(num_shards);
+            parallel::parallel_for(0,
+                                   num_samples,
+                                   shard,
+                                   [&](size_t b, size_t e, size_t) {
+                uint64_t stream = r * num_shards + b / shard + 1;
+                std::mt19937_64 shard_rng(seed + 0x9e3779b97f4a7c15ULL * stream);
+                std::uniform_real_distribution<double> u01(0.0, 1.0);
+                auto& out = picked[b / shard];
+                for (size_t i = b; i < e; i++) {
+                    if (u01(shard_rng) < l * min_d[i] / psi)
+                        out.push_back(i);
+                }
+            });
+            size_t from = cand_ids.size();
+            for (const auto& p : picked) {
+                for (auto i : p) {
+                    cand_ids.push_back(i);
+                    cand.insert(cand.end(), sample(i), sample(i) + num_features);
+                }
+            }
+            psi = update(from);
+            if (verbosity > 1)
+                LOG_DEBUG << "kmeans_cpu: k-means|| round " << r << ": "
+                          << cand_ids.size() << " candidates, cost " << psi;
+        }
+
+        size_t m = cand_ids.size();
+        std::vector<double> weights(m, 0.0);
+        for (size_t i = 0; i < num_samples; i++)
+            weights[nearest[i]] += 1.0;
+        if (verbosity > 0)
+            LOG_INFO << "kmeans_cpu: k-means|| reducing " << m
+                     << " candidates to " << num_clusters << " centroids";
+        if (m <= num_clusters) {
+            // degenerate input: take all candidates and fill up randomly
+            std::copy(cand.begin(), cand.end(), centroids);
+            std::uniform_int_distribution<size_t> pick(0, num_samples - 1);
+            for (size_t c = m; c < num_clusters; c++) {
+                size_t i = pick(rng);
+                std::copy(sample(i), sample(i) + num_features, centroid(c));
+            }
+            return;
+        }
+        weighted_plusplus(cand.data(), weights, m, rng);
+    }
+
+    KMCUDAResult run(float tolerance,
+                     float yinyang_t,
+                     const kmeans_cpu_options& opts = kmeans_cpu_options())
+    {
+        size_t threshold = size_t(tolerance * num_samples);
+        size_t draft_threshold
+            = size_t(KMEANS_CPU_YINYANG_DRAFT_REASSIGNMENTS * num_samples);
+        size_t yy_groups = size_t(yinyang_t * num_clusters);
+        if (yy_groups > 0) {
+            size_t max_groups = KMEANS_CPU_YINYANG_MAX_BOUND_BYTES
+                / (num_samples * sizeof(float));
+            if (yy_groups > max_groups) {
+                LOG_WARNING << "kmeans_cpu: limiting yinyang groups from "
+                            << yy_groups << " to " << max_groups
+                            << " to bound memory usage";
+                yy_groups = max_groups;
+            }
+        }
+        bool use_yinyang = yy_groups >= 1
+            && tolerance < KMEANS_CPU_YINYANG_DRAFT_REASSIGNMENTS;
+        if (verbosity > 0) {
+            LOG_INFO << "kmeans_cpu: reassignments threshold: " << threshold;
+            LOG_INFO << "kmeans_cpu: yinyang groups: "
+                     << (use_yinyang ? yy_groups : 0);
+        }
+
+        if (!opts.keep_assignments)
+            std::fill(assignments, assignments + num_samples,
+                uint32_t(unassigned));
+        size_t iter = opts.first_iteration;
+        kmeans_iteration state;
+        auto elapsed_us = [](watch::time_point since) {
+            return duration<double, std::micro>(watch::now() - since).count();
+        };
+        auto notify = [&](size_t changed, bool yy, bool converged) {
+            if (!opts.on_iteration)
+                return;
+            state.iteration = iter;
+            state.reassignments = changed;
+            state.yinyang = yy;
+            state.converged = converged;
+            if (opts.iteration_stats) {
+                state.inertia = inertia();
+                state.empty_clusters = int64_t(count_empty_clusters());
+            }
+            opts.on_iteration(state);
+            state = kmeans_iteration();
+        };
+        auto out_of_iterations = [&] {
+            return opts.max_iterations > 0
+                && iter - opts.first_iteration >= opts.max_iterations;
+        };
+        // Lloyd until converged or until Yinyang pays off
+        while (true) {
+            auto t = watch::now();
+            size_t changed = assign_lloyd();
+            state.assign_us = elapsed_us(t);
+            if (verbosity > 0)
+                LOG_INFO << "kmeans_cpu: iteration " << iter << ": "
+                         << changed << " reassignments";
+            if (changed <= threshold || out_of_iterations()) {
+                notify(changed, false, changed <= threshold);
+                return kmcudaSuccess;
+            }
+            t = watch::now();
+            update_centroids();
+            state.update_us = elapsed_us(t);
+            iter++;
+            notify(changed, false, false);
+            if (use_yinyang && changed <= draft_threshold)
+                break;
+        }
+
+        auto t = watch::now();
+        setup_yinyang(yy_groups);
+        state.yinyang_us = elapsed_us(t);
+        t = watch::now();
+        size_t changed = assign_yinyang(true);
+        state.assign_us = elapsed_us(t);
+        while (true) {
+            if (verbosity > 0)
+                LOG_INFO << "kmeans_cpu: iteration " << iter << ": "
+                         << changed << " reassignments (yinyang)";
+            if (changed <= threshold || out_of_iterations()) {
+                notify(changed, true, changed <= threshold);
+                break;
+            }
+            t = watch::now();
+            std::vector<float> old_centroids(
+                centroids, centroids + num_clusters * num_features);
+            update_centroids();
+            state.update_us = elapsed_us(t);
+            iter++;
+            notify(changed, true, false);
+            t = watch::now();
+            compute_drifts(old_centroids);
+            state.yinyang_us = elapsed_us(t);
+            t = watch::now();
+            changed = assign_yinyang(false);
+            state.assign_us = elapsed_us(t);
+        }
+        return kmcudaSuccess;
+    }
+
+    size_t count_empty_clusters() const
+    {
+        std::vector<char> used(num_clusters, 0);
+        for (size_t i = 0; i < num_samples; i++) {
+            if (assignments[i] < num_clusters)
+                used[assignments[i]] = 1;
+        }
+        return size_t(std::count(used.begin(), used.end(), 0));
+    }
+
+private:
+    void init_random(std::mt19937_64& rng)
+    {
+        std::vector<uint32_t> ids(num_samples);
+        std::iota(ids.begin(), ids.end(), 0);
+        for (size_t c = 0; c < num_clusters; c++) {
+            std::uniform_int_distribution<size_t> pick(c, num_samples - 1);
+            std::swap(ids[c], ids[pick(rng)]);
+            std::copy(sample(ids[c]), sample(ids[c]) + num_features,
+                centroid(c));
+        }
+    }
+
+    // squared metric distance used as sampling weight by the seeders
+    float seed_weight(const float* a, const float* b) const
+    {
+        float d = dist(a, b);
+        return d * d;
+    }
+
+    void init_plusplus(std::mt19937_64& rng)
+    {
+        std::uniform_int_distribution<size_t> first(0, num_samples - 1);
+        size_t c0 = first(rng);
+        std::copy(sample(c0), sample(c0) + num_features, centroid(0));
+        std::vector<float> min_d(
+            num_samples, std::numeric_limits<float>::max());
+        const size_t grain = 4096;
+        size_t num_blocks = (num_samples + grain - 1) / grain;
+        std::vector<double> block_sums(num_blocks);
+        std::uniform_real_distribution<double> u01(0.0, 1.0);
+        for (size_t c = 1; c < num_clusters; c++) {
+            const float* last = centroid(c - 1);
+            parallel::parallel_for(0,
+                                   num_samples,
+                                   grain,
+                                   [&](size_t b, size_t e, size_t) {
+                double s = 0.0;
+                for (size_t i = b; i < e; i++) {
+                    float w = seed_weight(sample(i), last);
+                    if (w < min_d[i])
+                        min_d[i] = w;
+                    s += min_d[i];
+                }
+                block_sums[b / grain] = s;
+            });
+            double total
+                = std::accumulate(block_sums.begin(), block_sums.end(), 0.0);
+            double target = u01(rng) * total;
+            size_t blk = 0;
+            while (blk + 1 < num_blocks && target >= block_sums[blk]) {
+                target -= block_sums[blk];
+                blk++;
+            }
+            size_t pick = std::min(num_samples, (blk + 1) * grain) - 1;
+            for (size_t i = blk * grain; i < (blk + 1) * grain
+                 && i < num_samples;
+                 i++) {
+                target -= min_d[i];
+                if (target < 0.0) {
+                    pick = i;
+                    break;
+                }
+            }
+            std::copy(sample(pick), sample(pick) + num_features, centroid(c));
+            if (verbosity > 1 && c % std::max<size_t>(1, num_clusters / 100) == 0)
+                LOG_DEBUG << "kmeans_cpu: kmeans++ step " << c;
+        }
+    }
+
+    // kmeans++ over m weighted points, writes num_clusters centroids
+    void weighted_plusplus(const float* pts,
+                           const std::vector<double>& weights,
+                           size_t m,
+                           std::mt19937_64& rng)
+    {
+        std::discrete_distribution<size_t> first(weights.begin(), weights.end());
+        size_t c0 = first(rng);
+        std::copy(pts + c0 * num_features, pts + (c0 + 1) * num_features,
+            centroid(0));
+        std::vector<float> min_d(m, std::numeric_limits<float>::max());
+        const size_t grain = 1024;
+        size_t num_blocks = (m + grain - 1) / grain;
+        std::vector<double> block_sums(num_blocks);
+        std::uniform_real_distribution<double> u01(0.0, 1.0);
+        for (size_t c = 1; c < num_clusters; c++) {
+            const float* last = centroid(c - 1);
+            parallel::parallel_for(0, m, grain, [&](size_t b, size_t e, size_t) {
+                double s = 0.0;
+                for (size_t i = b; i < e; i++) {
+                    float w = seed_weight(pts + i * num_features, last);
+                    if (w < min_d[i])
+                        min_d[i] = w;
+                    s += weights[i] * min_d[i];
+                }
+                block_sums[b / grain] = s;
+            });
+            double total
+                = std::accumulate(block_sums.begin(), block_sums.end(), 0.0);
+            double target = u01(rng) * total;
+            size_t blk = 0;
+            while (blk + 1 < num_blocks && target >= block_sums[blk]) {
+                target -= block_sums[blk];
+                blk++;
+            }
+            size_t pick = std::min(m, (blk + 1) * grain) - 1;
+            for (size_t i = blk * grain; i < (blk + 1) * grain && i < m; i++) {
+                target -= weights[i] * min_d[i];
+                if (target < 0.0) {
+                    pick = i;
+                    break;
+                }
+            }
+            std::copy(pts + pick * num_features,
+                pts + (pick + 1) * num_features, centroid(c));
+        }
+    }
+
+    void init_afkmc2(std::mt19937_64& rng, uint32_t m)
+    {
+        m = std::min<uint32_t>(m, num_samples / 2);
+        std::uniform_int_distribution<size_t> first(0, num_samples - 1);
+        size_t c0 = first(rng);
+        std::copy(sample(c0), sample(c0) + num_features, centroid(0));
+        // proposal distribution q(x) = 1/2 d(x,c0)^2/sum + 1/2n
+        std::vector<double> q(num_samples);
+        parallel::parallel_for(0,
+                               num_samples,
+                               [&](size_t b, size_t e, size_t) {
+            for (size_t i = b; i < e; i++)
+                q[i] = seed_weight(sample(i), centroid(0));
+        });
+        double total = std::accumulate(q.begin(), q.end(), 0.0);
+        for (auto& qi : q)
+            qi = 0.5 * (total > 0.0 ? qi / total : 0.0)
+                + 0.5 / double(num_samples);
+        std::discrete_distribution<size_t> propose(q.begin(), q.end());
+        std::uniform_real_distribution<double> u01(0.0, 1.0);
+        std::vector<size_t> cand(m);
+        std::vector<float> cand_d(m);
+        for (size_t c = 1; c < num_clusters; c++) {
+            for (auto& x : cand)
+                x = propose(rng);
+            parallel::parallel_for(0, m, 1, [&](size_t b, size_t e, size_t) {
+                for (size_t j = b; j < e; j++) {
+                    float best = std::numeric_limits<float>::max();
+                    for (size_t cc = 0; cc < c; cc++)
+                        best = std::min(
+                            best, seed_weight(sample(cand[j]), centroid(cc)));
+                    cand_d[j] = best;
+                }
+            });
+            size_t cur = 0;
+            for (size_t j = 1; j < m; j++) {
+                double num = double(cand_d[j]) * q[cand[cur]];
+                double den = double(cand_d[cur]) * q[cand[j]];
+                if (den == 0.0 || num / den > u01(rng))
+                    cur = j;
+            }
+            std::copy(sample(cand[cur]), sample(cand[cur]) + num_features,
+                centroid(c));
+        }
+    }
+
+    void group_by_cluster()
+    {
+        member_offsets.assign(num_clusters + 1, 0);
+        for (size_t i = 0; i < num_samples; i++)
+            member_offsets[assignments[i] + 1]++;
+        for (size_t c = 0; c < num_clusters; c++)
+            member_offsets[c + 1] += member_offsets[c];
+        members.resize(num_samples);
+        std::vector<size_t> pos(member_offsets.begin(), member_offsets.end() - 1);
+        for (size_t i = 0; i < num_samples; i++)
+            members[pos[assignments[i]]++] = i;
+    }
+
+    // cluster the centroids into groups for the Yinyang group filter
+    void setup_yinyang(size_t groups)
+    {
+        num_groups = groups;
+        group_of.assign(num_clusters, 0);
+        std::vector<float> gcent(groups * num_features);
+        size_t stride = num_clusters / groups;
+        for (size_t g = 0; g < groups; g++)
+            std::copy(centroid(g * stride), centroid(g * stride) + num_features,
+                gcent.begin() + g * num_features);
+        std::vector<double> gsum(groups * num_features);
+        std::vector<size_t> gcnt(groups);
+        for (int it = 0; it < 5; it++) {
+            parallel::parallel_for(0,
+                                   num_clusters,
+                                   [&](size_t b, size_t e, size_t) {
+                for (size_t c = b; c < e; c++) {
+                    float best = std::numeric_limits<float>::max();
+                    for (size_t g = 0; g < groups; g++) {
+                        float d = distance::l2_sq(centroid(c),
+                            gcent.data() + g * num_features, num_features);
+                        if (d < best) {
+                            best = d;
+                            group_of[c] = g;
+                        }
+                    }
+                }
+            });
+            std::fill(gsum.begin(), gsum.end(), 0.0);
+            std::fill(gcnt.begin(), gcnt.end(), 0);
+            for (size_t c = 0; c < num_clusters; c++) {
+                size_t g = group_of[c];
+                gcnt[g]++;
+                for (size_t j = 0; j < num_features; j++)
+                    gsum[g * num_features + j] += centroid(c)[j];
+            }
+            for (size_t g = 0; g < groups; g++) {
+                if (gcnt[g] == 0)
+                    continue;
+                for (size_t j = 0; j < num_features; j++)
+                    gcent[g * num_features + j]
+                        = float(gsum[g * num_features + j] / gcnt[g]);
+            }
+        }
+        group_offsets.assign(groups + 1, 0);
+        for (size_t c = 0; c < num_clusters; c++)
+            group_offsets[group_of[c] + 1]++;
+        for (size_t g = 0; g < groups; g++)
+            group_offsets[g + 1] += group_offsets[g];
+        group_members.resize(num_clusters);
+        std::vector<size_t> pos(group_offsets.begin(), group_offsets.end() - 1);
+        for (size_t c = 0; c < num_clusters; c++)
+            group_members[pos[group_of[c]]++] = c;
+        upper.assign(num_samples, 0.0f);
+        lower.assign(num_samples * groups, 0.0f);
+        drifts.assign(num_clusters, 0.0f);
+        group_drifts.assign(groups, 0.0f);
+        if (verbosity > 1)
+            LOG_DEBUG << "kmeans_cpu: yinyang bounds use "
+                      << (lower.size() * sizeof(float)) / (1024 * 1024)
+                      << " MiB";
+    }
+
+    void compute_drifts(const std::vector<float>& old_centroids)
+    {
+        parallel::parallel_for(0,
+                               num_clusters,
+                               [&](size_t b, size_t e, size_t) {
+            for (size_t c = b; c < e; c++)
+                drifts[c] = dist(
+                    old_centroids.data() + c * num_features, centroid(c));
+        });
+        std::fill(group_drifts.begin(), group_drifts.end(), 0.0f);
+        for (size_t c = 0; c < num_clusters; c++) {
+            auto& gd = group_drifts[group_of[c]];
+            gd = std::max(gd, drifts[c]);
+        }
+    }
+
+    // Yinyang assignment (Ding et al. 2015) with the global and group
+    // filters. full == true evaluates every group and initialises bounds.
+    size_t assign_yinyang(bool full)
+    {
+        const float inf = std::numeric_limits<float>::max();
+        std::vector<size_t> changed(parallel::num_threads(), 0);
+        parallel::parallel_for(0,
+                               num_samples,
+                               [&](size_t b, size_t e, size_t slot) {
+            std::vector<float> m1(num_groups), m2(num_groups);
+            std::vector<uint32_t> arg(num_groups);
+            std::vector<char> examined(num_groups);
+            std::vector<float> scratch(num_features);
+            for (size_t i = b; i < e; i++) {
+                const float* x = row(i, scratch.data());
+                float* lb = lower.data() + i * num_groups;
+                uint32_t a = assignments[i];
+                uint32_t best = a;
+                float best_d = inf;
+                float glb = inf;
+                if (!full) {
+                    float ub = upper[i] + drifts[a];
+                    for (size_t g = 0; g < num_groups; g++) {
+                        lb[g] -= group_drifts[g];
+                        glb = std::min(glb, lb[g]);
+                    }
+                    if (ub <= glb) {
+                        upper[i] = ub;
+                        continue;
+                    }
+                    best_d = dist(x, centroid(a));
+                    if (best_d <= glb) {
+                        upper[i] = best_d;
+                        continue;
+                    }
+                }
+                for (size_t g = 0; g < num_groups; g++) {
+                    examined[g] = 0;
+                    if (!full && lb[g] >= best_d)
+                        continue;
+                    examined[g] = 1;
+                    float d1 = inf, d2 = inf;
+                    uint32_t a1 = unassigned;
+                    for (size_t m = group_offsets[g]; m < group_offsets[g + 1];
+                         m++) {
+                        uint32_t c = group_members[m];
+                        float dc = (!full && c == a) ? best_d
+                                                     : dist(x, centroid(c));
+                        if (dc < d1) {
+                            d2 = d1;
+                            d1 = dc;
+                            a1 = c;
+                        } else if (dc < d2) {
+                            d2 = dc;
+                        }
+                    }
+                    m1[g] = d1;
+                    m2[g] = d2;
+                    arg[g] = a1;
+                    if (d1 < best_d) {
+                        best_d = d1;
+                        best = a1;
+                    }
+                }
+                for (size_t g = 0; g < num_groups; g++) {
+                    if (examined[g])
+                        lb[g] = (arg[g] == best) ? m2[g] : m1[g];
+                }
+                if (!full && best != a && !examined[group_of[a]]) {
+                    // the old centroid is now a competitor within its group
+                    float& lba = lb[group_of[a]];
+                    lba = std::min(lba, dist(x, centroid(a)));
+                }
+                upper[i] = best_d;
+                if (best != a) {
+                    assignments[i] = best;
+                    changed[slot]++;
+                }
+            }
+        });
+        return std::accumulate(changed.begin(), changed.end(), size_t(0));
+    }
+
+    KMCUDADistanceMetric metric;
+    size_t num_samples;
+    size_t num_features;
+    size_t num_clusters;
+    int32_t verbosity;
+    const float* samples;
+    const uint16_t* half_samples = nullptr;
+    uint64_t half_id = 0;
+    float* centroids;
+    uint32_t* assignments;
+
+    std::vector<size_t> member_offsets;
+    std::vector<uint32_t> members;
+
+    size_t num_groups = 0;
+    std::vector<uint32_t> group_of;
+    std::vector<size_t> group_offsets;
+    std::vector<uint32_t> group_members;
+    std::vector<float> upper;
+    std::vector<float> lower;
+    std::vector<float> drifts;
+    std::vector<float> group_drifts;
+};
+
+namespace kmeans_cpu_detail {
+
+// runs fn(engine) on the kmeans_cuda() argument layout. With fp16x2 the
+// samples and centroids hold packed halves and features_size counts half2
+// pairs; the engine then keeps the samples in half precision and works on
+// float centroids that are converted on the way in (import_centroids) and
+// out.
+template <class t_fn>
+void with_engine(KMCUDADistanceMetric metric,
+                 uint32_t samples_size,
+                 uint16_t features_size,
+                 uint32_t clusters_size,
+                 int32_t fp16x2,
+                 int32_t verbosity,
+                 const float* samples,
+                 float* centroids,
+                 uint32_t* assignments,
+                 bool import_centroids,
+                 t_fn fn)
+{
+    if (!fp16x2) {
+        kmeans_cpu_engine engine(metric,
+                                 samples_size,
+                                 features_size,
+                                 clusters_size,
+                                 verbosity,
+                                 samples,
+                                 centroids,
+                                 assignments);
+        fn(engine);
+        return;
+    }
+    size_t d = 2 * size_t(features_size);
+    std::vector<float> wide(size_t(clusters_size) * d);
+    auto packed = reinterpret_cast<uint16_t*>(centroids);
+    if (import_centroids)
+        half::widen(packed, wide.data(), wide.size());
+    kmeans_cpu_engine engine(metric,
+                             samples_size,
+                             d,
+                             clusters_size,
+                             verbosity,
+                             nullptr,
+                             wide.data(),
+                             assignments);
+    engine.set_half_samples(reinterpret_cast<const uint16_t*>(samples));
+    fn(engine);
+    half::narrow(wide.data(), packed, wide.size());
+}
+}
+
+/// CPU counterpart of kmeans_cuda(). Takes the same arguments except for the
+/// device selection; all cores of the pool in parallel.hpp are used.
+/// opts adds a per-iteration callback and resume support.
+inline KMCUDAResult kmeans_cpu(KMCUDAInitMethod init,
+                               const void* init_params,
+                               float tolerance,
+                               float yinyang_t,
+                               KMCUDADistanceMetric metric,
+                               uint32_t samples_size,
+                               uint16_t features_size,
+                               uint32_t clusters_size,
+                               uint32_t seed,
+                               int32_t fp16x2,
+                               int32_t verbosity,
+                               const float* samples,
+                               float* centroids,
+                               uint32_t* assignments,
+                               float* average_distance,
+                               const kmeans_cpu_options& opts
+                               = kmeans_cpu_options())
+{
+    if (clusters_size < 2 || clusters_size == UINT32_MAX)
+        return kmcudaInvalidArguments;
+    if (features_size == 0 || samples_size < clusters_size)
+        return kmcudaInvalidArguments;
+    if (samples == nullptr || centroids == nullptr || assignments == nullptr)
+        return kmcudaInvalidArguments;
+    if (tolerance < 0 || tolerance > 1)
+        return kmcudaInvalidArguments;
+    if (yinyang_t < 0 || yinyang_t > 0.5)
+        return kmcudaInvalidArguments;
+    if (verbosity > 0)
+        LOG_INFO << "kmeans_cpu: " << parallel::num_threads() << " threads"
+                 << (fp16x2 ? ", fp16 samples" : "");
+
+    KMCUDAResult res = kmcudaSuccess;
+    kmeans_cpu_detail::with_engine(metric,
+                                   samples_size,
+                                   features_size,
+                                   clusters_size,
+                                   fp16x2,
+                                   verbosity,
+                                   samples,
+                                   centroids,
+                                   assignments,
+                                   init == kmcudaInitMethodImport,
+                                   [&](kmeans_cpu_engine& engine) {
+        engine.init_centroids(init, init_params, seed);
+        // with fp16x2 the engine updates float copies of the centroids:
+        // narrow them into the caller's buffer before every callback, so
+        // that it sees (and checkpoints) the current ones
+        kmeans_cpu_options run_opts = opts;
+        if (fp16x2 && opts.on_iteration) {
+            run_opts.on_iteration = [&](const kmeans_iteration& it) {
+                half::narrow(engine.centroid(0),
+                             reinterpret_cast<uint16_t*>(centroids),
+                             size_t(clusters_size) * 2 * features_size);
+                opts.on_iteration(it);
+            };
+        }
+        res = engine.run(tolerance, yinyang_t, run_opts);
+        if (res == kmcudaSuccess && average_distance)
+            *average_distance = float(engine.average_distance());
+    });
+    return res;
+}
+
+/// Runs one of the kmcuda init methods on the CPU and writes the centroids,
+/// e.g. to time seeding separately or to hand them to kmeans_cuda() via
+/// kmcudaInitMethodImport. fp16x2 as in kmeans_cuda().
+inline void kmeans_cpu_seed(KMCUDAInitMethod init,
+                            const void* init_params,
+                            KMCUDADistanceMetric metric,
+                            uint32_t samples_size,
+                            uint16_t features_size,
+                            uint32_t clusters_size,
+                            uint32_t seed,
+                            int32_t verbosity,
+                            const float* samples,
+                            float* centroids,
+                            int32_t fp16x2 = 0)
+{
+    kmeans_cpu_detail::with_engine(metric,
+                                   samples_size,
+                                   features_size,
+                                   clusters_size,
+                                   fp16x2,
+                                   verbosity,
+                                   samples,
+                                   centroids,
+                                   nullptr,
+                                   false,
+                                   [&](kmeans_cpu_engine& engine) {
+        engine.init_centroids(init, init_params, seed);
+    });
+}
+
+/// k-means|| seeding, see kmeans_cpu_engine::init_kmeans_parallel().
+inline void kmeans_parallel_seed(KMCUDADistanceMetric metric,
+                                 uint32_t samples_size,
+                                 uint16_t features_size,
+                                 uint32_t clusters_size,
+                                 uint32_t seed,
+                                 double oversampling,
+                                 size_t rounds,
+                                 int32_t verbosity,
+                                 const float* samples,
+                                 float* centroids,
+                                 int32_t fp16x2 = 0)
+{
+    kmeans_cpu_detail::with_engine(metric,
+                                   samples_size,
+                                   features_size,
+                                   clusters_size,
+                                   fp16x2,
+                                   verbosity,
+                                   samples,
+                                   centroids,
+                                   nullptr,
+                                   false,
+                                   [&](kmeans_cpu_engine& engine) {
+        engine.init_kmeans_parallel(seed, oversampling, rounds);
+    });
+}
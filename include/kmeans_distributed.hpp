@@ -0,0 +1,239 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "kmcuda.h"
+
+#include "kmeans_cpu.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+#include "transport.hpp"
+#include "word_table.hpp"
+
+//
+// Data-parallel Lloyd k-means over worker processes that each hold a shard
+// of the samples. Every iteration a worker assigns its shard to the current
+// centroids (all threads of its node) and sums its members per cluster;
+// one all-reduce of the sums, counts and reassignments gives every worker
+// the same new centroids and the same convergence decision. Only k x d
+// doubles cross the transport per iteration, the samples never do.
+//
+
+namespace kmeans_distributed_detail {
+
+// sums (k x d) and member counts (k) of the clusters of a shard
+inline void cluster_sums(size_t n,
+                         size_t d,
+                         size_t k,
+                         const float* samples,
+                         const uint32_t* assignments,
+                         double* sums,
+                         double* counts)
+{
+    std::vector<size_t> offsets(k + 1, 0);
+    for (size_t i = 0; i < n; i++)
+        offsets[assignments[i] + 1]++;
+    for (size_t c = 0; c < k; c++)
+        offsets[c + 1] += offsets[c];
+    std::vector<uint32_t> members(n);
+    {
+        std::vector<size_t> pos(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < n; i++)
+            members[pos[assignments[i]]++] = uint32_t(i);
+    }
+    parallel::parallel_for(0, k, [&](size_t b, size_t e, size_t) {
+        for (size_t c = b; c < e; c++) {
+            double* sum = sums + c * d;
+            for (size_t m = offsets[c]; m < offsets[c + 1]; m++) {
+                const float* x = samples + size_t(members[m]) * d;
+                for (size_t j = 0; j < d; j++)
+                    sum[j] += x[j];
+            }
+            counts[c] = double(offsets[c + 1] - offsets[c]);
+        }
+    });
+}
+}
+
+/// rows of the shard picked for seeding: every worker contributes its
+/// share of sample_rows in proportion to its number of samples. Returns
+/// the pooled rows (in rank order) on rank 0 and an empty vector elsewhere.
+inline std::vector<float> gather_seed_sample(transport& comm,
+                                             size_t n,
+                                             size_t d,
+                                             size_t total_n,
+                                             size_t sample_rows,
+                                             uint32_t seed,
+                                             const float* samples)
+{
+    sample_rows = std::min(sample_rows, total_n);
+    // rows [b, b + n) of all rows in rank order belong to this shard
+    std::vector<double> shard_rows(comm.size(), 0.0);
+    shard_rows[comm.rank()] = double(n);
+    comm.all_reduce_sum(shard_rows.data(), shard_rows.size());
+    size_t b = 0;
+    for (size_t r = 0; r < comm.rank(); r++)
+        b += size_t(shard_rows[r]);
+    size_t take
+        = sample_rows * (b + n) / total_n - sample_rows * b / total_n;
+
+    std::vector<uint32_t> ids(n);
+    std::iota(ids.begin(), ids.end(), 0);
+    std::mt19937_64 rng(seed + comm.rank());
+    for (size_t i = 0; i < take; i++) {
+        std::uniform_int_distribution<size_t> pick(i, n - 1);
+        std::swap(ids[i], ids[pick(rng)]);
+    }
+    std::vector<float> rows(take * d);
+    for (size_t i = 0; i < take; i++)
+        std::copy(samples + size_t(ids[i]) * d,
+            samples + size_t(ids[i] + 1) * d, rows.data() + i * d);
+    auto pooled = comm.gather(rows.data(), rows.size() * sizeof(float));
+    std::vector<float> out(pooled.size() / sizeof(float));
+    if (!pooled.empty())
+        memcpy(out.data(), pooled.data(), pooled.size());
+    return out;
+}
+
+/// Lloyd iterations on the shard (n x d) of this worker. centroids (k x d)
+/// hold the same seeds on every worker and the same result on return;
+/// assignments are those of the shard. Stops when at most tolerance of
+/// all samples changed their cluster. on_iteration of opts is called with
+/// the global reassignments.
+inline KMCUDAResult kmeans_distributed(transport& comm,
+                                       KMCUDADistanceMetric metric,
+                                       size_t n,
+                                       size_t d,
+                                       size_t k,
+                                       float tolerance,
+                                       int32_t verbosity,
+                                       const float* samples,
+                                       float* centroids,
+                                       uint32_t* assignments,
+                                       const kmeans_cpu_options& opts
+                                       = kmeans_cpu_options())
+{
+    double total_n = double(n);
+    comm.all_reduce_sum(&total_n, 1);
+    if (k < 2 || total_n < double(k))
+        return kmcudaInvalidArguments;
+    size_t threshold = size_t(tolerance * total_n);
+    if (verbosity > 0)
+        LOG_INFO << "kmeans_distributed: " << comm.size() << " workers, "
+                 << size_t(total_n) << " samples, reassignments threshold: "
+                 << threshold;
+
+    kmeans_cpu_engine engine(
+        metric, n, d, k, 0, samples, centroids, assignments);
+    std::fill(assignments, assignments + n,
+        uint32_t(kmeans_cpu_engine::unassigned));
+    // sums, counts and reassignments in one buffer: one all-reduce per
+    // iteration
+    std::vector<double> buf(k * d + k + 1);
+    double* sums = buf.data();
+    double* counts = sums + k * d;
+    for (size_t iter = 0;; iter++) {
+        kmeans_iteration state;
+        auto t = watch::now();
+        size_t changed = engine.assign_lloyd();
+        std::fill(buf.begin(), buf.end(), 0.0);
+        kmeans_distributed_detail::cluster_sums(
+            n, d, k, samples, assignments, sums, counts);
+        buf.back() = double(changed);
+        state.assign_us
+            = duration<double, std::micro>(watch::now() - t).count();
+        // update_us: the all-reduce
+        t = watch::now();
+        comm.all_reduce_sum(buf.data(), buf.size());
+        state.update_us
+            = duration<double, std::micro>(watch::now() - t).count();
+        size_t total_changed = size_t(buf.back());
+        if (verbosity > 0)
+            LOG_INFO << "kmeans_distributed: iteration " << iter << ": "
+                     << total_changed << " reassignments";
+        state.iteration = iter;
+        state.reassignments = total_changed;
+        state.converged = total_changed <= threshold;
+        if (opts.on_iteration)
+            opts.on_iteration(state);
+        if (state.converged)
+            break;
+        // empty clusters keep their centroid on every worker
+        parallel::parallel_for(0, k, [&](size_t b, size_t e, size_t) {
+            for (size_t c = b; c < e; c++) {
+                if (counts[c] == 0.0)
+                    continue;
+                float* cent = centroids + c * d;
+                double norm = 0.0;
+                for (size_t j = 0; j < d; j++) {
+                    cent[j] = float(sums[c * d + j] / counts[c]);
+                    norm += double(cent[j]) * double(cent[j]);
+                }
+                if (metric == kmcudaDistanceMetricCosine && norm > 0.0) {
+                    float inv = float(1.0 / std::sqrt(norm));
+                    for (size_t j = 0; j < d; j++)
+                        cent[j] *= inv;
+                }
+            }
+        });
+    }
+    return kmcudaSuccess;
+}
+
+/// report data of all shards on rank 0: assignments, distances and words
+/// in rank order. Other ranks send theirs and get empty results.
+inline void gather_report(transport& comm,
+                          size_t n,
+                          const uint32_t* assignments,
+                          const float* dists,
+                          const word_table& words,
+                          std::vector<uint32_t>& all_assignments,
+                          std::vector<float>& all_dists,
+                          word_table& all_words)
+{
+    // "n, word bytes, assignments, distances, words" per shard
+    size_t word_bytes = 0;
+    for (size_t i = 0; i < n; i++)
+        word_bytes += words.length(i) + 1;
+    std::vector<char> msg(2 * sizeof(uint64_t) + n * 8 + word_bytes);
+    uint64_t head[2] = { n, word_bytes };
+    char* p = msg.data();
+    memcpy(p, head, sizeof(head));
+    p += sizeof(head);
+    memcpy(p, assignments, n * sizeof(uint32_t));
+    p += n * sizeof(uint32_t);
+    memcpy(p, dists, n * sizeof(float));
+    p += n * sizeof(float);
+    for (size_t i = 0; i < n; i++) {
+        memcpy(p, words.c_str(i), words.length(i) + 1);
+        p += words.length(i) + 1;
+    }
+    auto all = comm.gather(msg.data(), msg.size());
+
+    all_assignments.clear();
+    all_dists.clear();
+    all_words.clear();
+    for (const char* q = all.data(); q < all.data() + all.size();) {
+        memcpy(head, q, sizeof(head));
+        q += sizeof(head);
+        size_t m = head[0];
+        size_t at = all_assignments.size();
+        all_assignments.resize(at + m);
+        memcpy(all_assignments.data() + at, q, m * sizeof(uint32_t));
+        q += m * sizeof(uint32_t);
+        all_dists.resize(at + m);
+        memcpy(all_dists.data() + at, q, m * sizeof(float));
+        q += m * sizeof(float);
+        for (size_t i = 0; i < m; i++) {
+            size_t len = strlen(q);
+            all_words.push_back(q, len);
+            q += len + 1;
+        }
+    }
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "kmcuda.h"
+
+#include "checkpoint.hpp"
+#include "cluster_report.hpp"
+#include "distance.hpp"
+#include "half.hpp"
+#include "kmeans_cpu.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+#include "word_table.hpp"
+
+//
+// Carries a finished clustering over to a new version of the vocabulary.
+// The centroids and their ids come from the earlier run. A word of the
+// earlier report keeps its cluster if its vector did not change, which is
+// detected from the distance printed in the report; all other words go to
+// their nearest centroid. Lloyd iterations with kmcudaInitMethodImport on
+// top of the result refine the centroids without renumbering them.
+//
+
+struct incremental_stats {
+    size_t kept = 0; // unchanged words, cluster carried over
+    size_t changed = 0; // in the earlier report, vector changed
+    size_t added = 0; // not in the earlier report
+};
+
+// earlier clustering from a report or from a checkpoint. A checkpoint has
+// no words, so all words are assigned anew.
+inline cluster_result load_previous_clustering(const std::string& file_name)
+{
+    if (!kmeans_checkpoint::probe(file_name))
+        return read_cluster_report(file_name);
+    auto ckpt = kmeans_checkpoint::load(file_name);
+    cluster_result res;
+    res.num_clusters = ckpt.num_clusters;
+    res.num_features = ckpt.num_features;
+    res.centroids = std::move(ckpt.centroids);
+    if (ckpt.fp16) {
+        // packed halves of an --fp16 run
+        res.num_features *= 2;
+        std::vector<float> wide(res.num_clusters * res.num_features);
+        half::widen(reinterpret_cast<const uint16_t*>(res.centroids.data()),
+                    wide.data(),
+                    wide.size());
+        res.centroids = std::move(wide);
+    }
+    return res;
+}
+
+// nearest centroid of the rows [0,count) given by ids. Rows are gathered in
+// blocks and assigned by a kmeans_cpu_engine, so memory stays bounded.
+inline void assign_nearest(KMCUDADistanceMetric metric,
+                           size_t d,
+                           const float* samples,
+                           size_t k,
+                           float* centroids,
+                           const uint32_t* ids,
+                           size_t count,
+                           uint32_t* assignments)
+{
+    const size_t block = 1 << 16;
+    std::vector<float> rows;
+    std::vector<uint32_t> local;
+    for (size_t b = 0; b < count; b += block) {
+        size_t m = std::min(block, count - b);
+        rows.resize(m * d);
+        parallel::parallel_for(0, m, [&](size_t rb, size_t re, size_t) {
+            for (size_t r = rb; r < re; r++) {
+                const float* x = samples + size_t(ids[b + r]) * d;
+                std::copy(x, x + d, rows.data() + r * d);
+            }
+        });
+        local.assign(m, uint32_t(kmeans_cpu_engine::unassigned));
+        kmeans_cpu_engine engine(
+            metric, m, d, k, 0, rows.data(), centroids, local.data());
+        engine.assign_lloyd();
+        for (size_t r = 0; r < m; r++)
+            assignments[ids[b + r]] = local[r];
+    }
+}
+
+// assignments (n) of the words to the centroids of previous. words must
+// have an index (word_table::build_index()).
+inline incremental_stats incremental_assign(KMCUDADistanceMetric metric,
+                                            size_t n,
+                                            size_t d,
+                                            const float* samples,
+                                            const word_table& words,
+                                            cluster_result& previous,
+                                            uint32_t* assignments)
+{
+    size_t k = previous.num_clusters;
+    const float* centroids = previous.centroids.data();
+    bool angular = metric == kmcudaDistanceMetricCosine;
+    std::fill(
+        assignments, assignments + n, uint32_t(kmeans_cpu_engine::unassigned));
+
+    // (1) row of every report word and whether its distance still matches.
+    // The report prints six digits of the distance and of the centroids.
+    size_t num_words = previous.words.size();
+    std::vector<uint32_t> rows(num_words, uint32_t(word_table::npos));
+    std::vector<char> same(num_words, 0);
+    parallel::parallel_for(0, num_words, [&](size_t b, size_t e, size_t) {
+        for (size_t w = b; w < e; w++) {
+            rows[w] = words.find(
+                previous.words.c_str(w), previous.words.length(w));
+            uint32_t c = previous.word_cluster[w];
+            if (rows[w] == word_table::npos || c >= k)
+                continue;
+            const float* x = samples + size_t(rows[w]) * d;
+            float dist = angular
+                ? distance::angular(x, centroids + size_t(c) * d, d)
+                : cluster_report::sequential_l2(
+                      x, centroids + size_t(c) * d, d);
+            float recorded = previous.word_dist[w];
+            same[w] = std::fabs(dist - recorded) <= 1e-4f * (1.0f + recorded);
+        }
+    });
+
+    // (2) unchanged words keep their cluster
+    incremental_stats stats;
+    std::vector<char> known(n, 0);
+    for (size_t w = 0; w < num_words; w++) {
+        uint32_t r = rows[w];
+        if (r == word_table::npos || known[r])
+            continue;
+        known[r] = 1;
+        if (same[w]) {
+            assignments[r] = previous.word_cluster[w];
+            stats.kept++;
+        } else {
+            stats.changed++;
+        }
+    }
+    stats.added = n - stats.kept - stats.changed;
+
+    // (3) nearest centroid for the rest
+    std::vector<uint32_t> todo;
+    todo.reserve(n - stats.kept);
+    for (size_t i = 0; i < n; i++) {
+        if (assignments[i] == kmeans_cpu_engine::unassigned)
+            todo.push_back(uint32_t(i));
+    }
+    assign_nearest(metric,
+                   d,
+                   samples,
+                   k,
+                   previous.centroids.data(),
+                   todo.data(),
+                   todo.size(),
+                   assignments);
+    return stats;
+}
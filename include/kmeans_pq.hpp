@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include "kmcuda.h"
+
+#include "kmeans_cpu.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+#include "product_quantizer.hpp"
+
+//
+// Lloyd k-means on product-quantised samples (see product_quantizer.hpp).
+// Assignments use the asymmetric distance of the codes to the float
+// centroids; a block of rows is scanned against a tile of distance tables
+// that stays cache resident. Centroids are the means of the decoded rows.
+// After convergence the float rows are read once more: the centroids are
+// recomputed from them and every row picks the exactly closest of its best
+// ADC candidates (re-ranking), which fixes most borderline assignments.
+//
+
+namespace kmeans_pq_detail {
+
+// distance tables built per pass over the codes
+const size_t table_budget = size_t(16) << 20;
+// rows scanned per pass, bounds the candidate lists
+const size_t chunk_rows = size_t(1) << 20;
+
+// the top closest centroids by ADC of rows [rb, re), closest first, in
+// best_d / best_c ((re - rb) x top)
+inline void scan(const product_quantizer& pq,
+                 const uint8_t* codes,
+                 size_t rb,
+                 size_t re,
+                 const float* centroids,
+                 size_t k,
+                 size_t top,
+                 std::vector<float>& tables,
+                 float* best_d,
+                 uint32_t* best_c)
+{
+    size_t m = pq.subspaces();
+    size_t d = pq.dimensions();
+    size_t ts = pq.table_size();
+    size_t tile = std::max<size_t>(1, table_budget / (ts * sizeof(float)));
+    tile = std::min(tile, k);
+    tables.resize(tile * ts);
+    std::fill(best_d, best_d + (re - rb) * top,
+        std::numeric_limits<float>::max());
+    std::fill(best_c, best_c + (re - rb) * top, 0);
+    for (size_t cb = 0; cb < k; cb += tile) {
+        size_t ce = std::min(k, cb + tile);
+        parallel::parallel_for(cb, ce, 1, [&](size_t b, size_t e, size_t) {
+            for (size_t c = b; c < e; c++)
+                pq.distance_table(
+                    centroids + c * d, tables.data() + (c - cb) * ts);
+        });
+        parallel::parallel_for(rb, re, 256, [&](size_t b, size_t e, size_t) {
+            for (size_t c = cb; c < ce; c++) {
+                const float* table = tables.data() + (c - cb) * ts;
+                for (size_t i = b; i < e; i++) {
+                    float dist = pq.adc(codes + i * m, table);
+                    float* bd = best_d + (i - rb) * top;
+                    uint32_t* bc = best_c + (i - rb) * top;
+                    if (dist >= bd[top - 1])
+                        continue;
+                    size_t p = top - 1;
+                    for (; p > 0 && bd[p - 1] > dist; p--) {
+                        bd[p] = bd[p - 1];
+                        bc[p] = bc[p - 1];
+                    }
+                    bd[p] = dist;
+                    bc[p] = uint32_t(c);
+                }
+            }
+        });
+    }
+}
+
+// centroids as the means of the decoded members. empty clusters keep their
+// previous centroid.
+inline void update_centroids(const product_quantizer& pq,
+                             const uint8_t* codes,
+                             KMCUDADistanceMetric metric,
+                             size_t n,
+                             size_t k,
+                             const uint32_t* assignments,
+                             float* centroids)
+{
+    size_t m = pq.subspaces();
+    size_t d = pq.dimensions();
+    std::vector<size_t> offsets(k + 1, 0);
+    for (size_t i = 0; i < n; i++)
+        offsets[assignments[i] + 1]++;
+    for (size_t c = 0; c < k; c++)
+        offsets[c + 1] += offsets[c];
+    std::vector<uint32_t> members(n);
+    {
+        std::vector<size_t> pos(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < n; i++)
+            members[pos[assignments[i]]++] = uint32_t(i);
+    }
+    parallel::parallel_for(0, k, [&](size_t b, size_t e, size_t) {
+        std::vector<double> sum(d);
+        std::vector<float> x(d);
+        for (size_t c = b; c < e; c++) {
+            if (offsets[c] == offsets[c + 1])
+                continue;
+            std::fill(sum.begin(), sum.end(), 0.0);
+            for (size_t r = offsets[c]; r < offsets[c + 1]; r++) {
+                pq.decode(codes + size_t(members[r]) * m, x.data());
+                for (size_t j = 0; j < d; j++)
+                    sum[j] += x[j];
+            }
+            float* cent = centroids + c * d;
+            double count = double(offsets[c + 1] - offsets[c]);
+            double norm = 0.0;
+            for (size_t j = 0; j < d; j++) {
+                cent[j] = float(sum[j] / count);
+                norm += double(cent[j]) * double(cent[j]);
+            }
+            if (metric == kmcudaDistanceMetricCosine && norm > 0.0) {
+                float inv = float(1.0 / std::sqrt(norm));
+                for (size_t j = 0; j < d; j++)
+                    cent[j] *= inv;
+            }
+        }
+    });
+}
+}
+
+/// k-means on the codes (n x pq.subspaces()) of the samples, starting from
+/// the centroids passed in (k x d). Both metrics order the distances of
+/// unit rows alike, so cosine uses the euclidean tables as well. If samples
+/// (the float rows) is set, the result is refined once from them and each
+/// row is re-ranked among its rerank best ADC candidates.
+inline KMCUDAResult kmeans_pq(const product_quantizer& pq,
+                              const uint8_t* codes,
+                              KMCUDADistanceMetric metric,
+                              size_t n,
+                              size_t k,
+                              float tolerance,
+                              size_t rerank,
+                              int32_t verbosity,
+                              const float* samples,
+                              float* centroids,
+                              uint32_t* assignments)
+{
+    if (k < 2 || n < k || codes == nullptr)
+        return kmcudaInvalidArguments;
+    size_t d = pq.dimensions();
+    size_t threshold = size_t(tolerance * n);
+    size_t chunk = std::min(n, kmeans_pq_detail::chunk_rows);
+    std::vector<float> tables;
+    std::vector<float> best_d;
+    std::vector<uint32_t> best_c;
+
+    // (1) Lloyd on the codes
+    std::fill(assignments, assignments + n,
+        uint32_t(kmeans_cpu_engine::unassigned));
+    best_d.resize(chunk);
+    best_c.resize(chunk);
+    for (size_t iter = 0;; iter++) {
+        size_t changed = 0;
+        for (size_t rb = 0; rb < n; rb += chunk) {
+            size_t re = std::min(n, rb + chunk);
+            kmeans_pq_detail::scan(pq, codes, rb, re, centroids, k, 1, tables,
+                best_d.data(), best_c.data());
+            for (size_t i = rb; i < re; i++) {
+                if (assignments[i] != best_c[i - rb]) {
+                    assignments[i] = best_c[i - rb];
+                    changed++;
+                }
+            }
+        }
+        if (verbosity > 0)
+            LOG_INFO << "kmeans_pq: iteration " << iter << ": " << changed
+                     << " reassignments";
+        if (changed <= threshold)
+            break;
+        kmeans_pq_detail::update_centroids(
+            pq, codes, metric, n, k, assignments, centroids);
+    }
+    if (samples == nullptr)
+        return kmcudaSuccess;
+
+    // (2) float centroids, then exact re-ranking of the best candidates
+    kmeans_cpu_engine exact(
+        metric, n, d, k, 0, samples, centroids, assignments);
+    exact.update_centroids();
+    size_t top = std::max<size_t>(1, std::min(rerank, k));
+    best_d.resize(chunk * top);
+    best_c.resize(chunk * top);
+    std::vector<size_t> fixed(parallel::num_threads(), 0);
+    for (size_t rb = 0; rb < n; rb += chunk) {
+        size_t re = std::min(n, rb + chunk);
+        kmeans_pq_detail::scan(pq, codes, rb, re, centroids, k, top, tables,
+            best_d.data(), best_c.data());
+        parallel::parallel_for(rb, re, [&](size_t b, size_t e, size_t slot) {
+            for (size_t i = b; i < e; i++) {
+                const uint32_t* cand = best_c.data() + (i - rb) * top;
+                const float* x = samples + i * d;
+                uint32_t best = cand[0];
+                float best_dist = exact.dist_cmp(x, centroids + best * d);
+                for (size_t r = 1; r < top; r++) {
+                    float dist = exact.dist_cmp(x, centroids + cand[r] * d);
+                    if (dist < best_dist) {
+                        best_dist = dist;
+                        best = cand[r];
+                    }
+                }
+                if (best != cand[0])
+                    fixed[slot]++;
+                assignments[i] = best;
+            }
+        });
+    }
+    if (verbosity > 0)
+        LOG_INFO << "kmeans_pq: re-ranking " << top << " candidates moved "
+                 << std::accumulate(fixed.begin(), fixed.end(), size_t(0))
+                 << " samples";
+    return kmcudaSuccess;
+}
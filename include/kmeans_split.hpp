@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <queue>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "kmcuda.h"
+
+#include "distance.hpp"
+#include "kmeans_cpu.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+
+//
+// Warm start for a larger cluster count from a finished clustering. The
+// new_k - old_k extra clusters are handed out one at a time to the cluster
+// with the largest squared error per centroid. Every cluster that receives
+// extras is then split into its share on its own members (kmeans++ and
+// Lloyd, like the leaves of kmeans_hierarchical()); the others are kept as
+// they are. Clusters are split concurrently.
+//
+
+// grows the clustering (old_k centroids, assignments of all n samples) to
+// new_k > old_k clusters. centroids (new_k x d) and assignments receive the
+// warm start. A split cluster keeps its id for one of its parts, the other
+// parts get the ids from old_k upwards.
+inline void split_clusters(KMCUDADistanceMetric metric,
+                           size_t n,
+                           size_t d,
+                           const float* samples,
+                           size_t old_k,
+                           const float* old_centroids,
+                           const uint32_t* old_assignments,
+                           size_t new_k,
+                           uint32_t seed,
+                           float tolerance,
+                           float* centroids,
+                           uint32_t* assignments)
+{
+    // (1) members and squared error of every old cluster
+    std::vector<size_t> offsets(old_k + 1, 0);
+    for (size_t i = 0; i < n; i++)
+        offsets[old_assignments[i] + 1]++;
+    for (size_t c = 0; c < old_k; c++)
+        offsets[c + 1] += offsets[c];
+    std::vector<uint32_t> members(n);
+    {
+        std::vector<size_t> pos(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < n; i++)
+            members[pos[old_assignments[i]]++] = uint32_t(i);
+    }
+    std::vector<double> sse(old_k, 0.0);
+    parallel::parallel_for(0, old_k, [&](size_t b, size_t e, size_t) {
+        for (size_t c = b; c < e; c++) {
+            for (size_t m = offsets[c]; m < offsets[c + 1]; m++)
+                sse[c] += distance::l2_sq(samples + size_t(members[m]) * d,
+                    old_centroids + c * d, d);
+        }
+    });
+
+    // (2) number of parts per cluster
+    std::vector<size_t> parts(old_k, 1);
+    std::priority_queue<std::pair<double, uint32_t>> queue;
+    for (size_t c = 0; c < old_k; c++) {
+        if (offsets[c + 1] - offsets[c] > 1 && sse[c] > 0.0)
+            queue.push({ sse[c], uint32_t(c) });
+    }
+    size_t k = old_k;
+    while (k < new_k && !queue.empty()) {
+        uint32_t c = queue.top().second;
+        queue.pop();
+        parts[c]++;
+        k++;
+        if (parts[c] < offsets[c + 1] - offsets[c])
+            queue.push({ sse[c] / double(parts[c]), c });
+    }
+    std::vector<size_t> first_new(old_k);
+    for (size_t c = 0, next = old_k; c < old_k; c++) {
+        first_new[c] = next;
+        next += parts[c] - 1;
+    }
+
+    // (3) split, largest clusters first
+    std::copy(old_centroids, old_centroids + old_k * d, centroids);
+    std::copy(old_assignments, old_assignments + n, assignments);
+    std::vector<size_t> order(old_k);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return offsets[a + 1] - offsets[a] > offsets[b + 1] - offsets[b];
+    });
+    parallel::parallel_for(0, old_k, 1, [&](size_t b, size_t e, size_t) {
+        std::vector<float> rows;
+        std::vector<float> local_centroids;
+        std::vector<uint32_t> local;
+        for (size_t o = b; o < e; o++) {
+            size_t c = order[o];
+            size_t nc = offsets[c + 1] - offsets[c];
+            size_t kc = parts[c];
+            if (kc < 2)
+                continue;
+            rows.resize(nc * d);
+            for (size_t m = 0; m < nc; m++) {
+                const float* x = samples + size_t(members[offsets[c] + m]) * d;
+                std::copy(x, x + d, rows.data() + m * d);
+            }
+            local.assign(nc, 0);
+            local_centroids.resize(kc * d);
+            if (kc == nc) {
+                local_centroids = rows;
+                std::iota(local.begin(), local.end(), 0);
+            } else {
+                kmeans_cpu_engine engine(metric,
+                                         nc,
+                                         d,
+                                         kc,
+                                         0,
+                                         rows.data(),
+                                         local_centroids.data(),
+                                         local.data());
+                engine.init_centroids(
+                    kmcudaInitMethodPlusPlus, nullptr, seed + uint32_t(c));
+                engine.run(tolerance, 0.0f);
+            }
+            auto id = [&](size_t part) {
+                return part == 0 ? c : first_new[c] + part - 1;
+            };
+            for (size_t p = 0; p < kc; p++)
+                std::copy(local_centroids.data() + p * d,
+                    local_centroids.data() + (p + 1) * d,
+                    centroids + id(p) * d);
+            for (size_t m = 0; m < nc; m++)
+                assignments[members[offsets[c] + m]] = uint32_t(id(local[m]));
+        }
+    });
+
+    if (k < new_k) {
+        // fewer distinct samples than clusters: the rest start empty
+        LOG_WARNING << "split_clusters: only " << k << " of " << new_k
+                    << " clusters could be placed, the rest start as copies"
+                       " of samples";
+        std::mt19937_64 rng(seed);
+        for (; k < new_k; k++) {
+            size_t i = rng() % n;
+            std::copy(samples + i * d, samples + (i + 1) * d,
+                centroids + k * d);
+        }
+    }
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+//
+// Structured telemetry for --metrics-out. Every record is one line, either
+// a JSON object or a CSV row with a fixed set of columns:
+//   phase records:     wall time of a named phase (every cl_timer)
+//   iteration records: per-iteration phase times, reassignments, inertia
+//                      and empty clusters of the CPU engine
+// Times are in microseconds. Nothing is recorded until open() is called.
+//
+
+namespace metrics {
+
+struct iteration_record {
+    std::string algorithm;
+    size_t iteration = 0;
+    bool yinyang = false;
+    bool converged = false;
+    size_t reassignments = 0;
+    double assign_us = 0.0;
+    double update_us = 0.0;
+    double yinyang_us = 0.0;
+    // negative when not computed
+    double inertia = -1.0;
+    int64_t empty_clusters = -1;
+};
+
+class sink {
+public:
+    ~sink() { close(); }
+
+    // format is jsonl, csv or auto (csv for *.csv files)
+    void open(const std::string& file_name, std::string format)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (format == "auto") {
+            std::string suffix = ".csv";
+            bool is_csv = file_name.size() >= suffix.size()
+                && file_name.compare(file_name.size() - suffix.size(),
+                       suffix.size(), suffix)
+                    == 0;
+            format = is_csv ? "csv" : "jsonl";
+        }
+        if (format != "csv" && format != "jsonl")
+            throw std::runtime_error("unknown metrics format " + format);
+        f = fopen(file_name.c_str(), "w");
+        if (f == nullptr)
+            throw std::runtime_error("cannot create " + file_name);
+        csv = format == "csv";
+        if (csv)
+            fputs("record,name,iteration,yinyang,converged,reassignments,"
+                  "assign_us,update_us,yinyang_us,inertia,empty_clusters,"
+                  "elapsed_us\n",
+                f);
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (f)
+            fclose(f);
+        f = nullptr;
+    }
+
+    bool enabled() const { return f != nullptr; }
+
+    void phase(const std::string& name, double elapsed_us)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (f == nullptr)
+            return;
+        if (csv) {
+            fprintf(f, "phase,%s,,,,,,,,,,%.1f\n", csv_field(name).c_str(),
+                elapsed_us);
+        } else {
+            fprintf(f, "{\"record\":\"phase\",\"name\":\"%s\","
+                       "\"elapsed_us\":%.1f}\n",
+                json_string(name).c_str(), elapsed_us);
+        }
+        fflush(f);
+    }
+
+    void iteration(const iteration_record& r)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (f == nullptr)
+            return;
+        std::string inertia = r.inertia < 0.0 ? "" : number(r.inertia);
+        std::string empty = r.empty_clusters < 0
+            ? ""
+            : std::to_string(r.empty_clusters);
+        if (csv) {
+            fprintf(f, "iteration,%s,%zu,%d,%d,%zu,%.1f,%.1f,%.1f,%s,%s,\n",
+                csv_field(r.algorithm).c_str(), r.iteration, int(r.yinyang),
+                int(r.converged), r.reassignments, r.assign_us, r.update_us,
+                r.yinyang_us, inertia.c_str(), empty.c_str());
+        } else {
+            fprintf(f, "{\"record\":\"iteration\",\"name\":\"%s\","
+                       "\"iteration\":%zu,\"yinyang\":%s,\"converged\":%s,"
+                       "\"reassignments\":%zu,\"assign_us\":%.1f,"
+                       "\"update_us\":%.1f,\"yinyang_us\":%.1f",
+                json_string(r.algorithm).c_str(), r.iteration,
+                r.yinyang ? "true" : "false", r.converged ? "true" : "false",
+                r.reassignments, r.assign_us, r.update_us, r.yinyang_us);
+            if (!inertia.empty())
+                fprintf(f, ",\"inertia\":%s", inertia.c_str());
+            if (!empty.empty())
+                fprintf(f, ",\"empty_clusters\":%s", empty.c_str());
+            fputs("}\n", f);
+        }
+        fflush(f);
+    }
+
+private:
+    static std::string number(double v)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.9g", v);
+        return buf;
+    }
+    static std::string json_string(const std::string& s)
+    {
+        std::string out;
+        for (char c : s) {
+            if (c == '"' || c == '\\')
+                out += '\\';
+            out += c;
+        }
+        return out;
+    }
+    static std::string csv_field(const std::string& s)
+    {
+        if (s.find_first_of(",\"") == std::string::npos)
+            return s;
+        std::string out = "\"";
+        for (char c : s) {
+            if (c == '"')
+                out += '"';
+            out += c;
+        }
+        return out + "\"";
+    }
+
+    std::mutex mtx;
+    FILE* f = nullptr;
+    bool csv = false;
+};
+
+inline sink& global()
+{
+    static sink s;
+    return s;
+}
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "kmcuda.h"
+
+#include "kmeans_cpu.hpp"
+#include "parallel.hpp"
+
+//
+// Mini-batch k-means (Sculley 2010) over batches of a vector_stream.
+// Memory use is bounded by the batch size plus the centroids. Every
+// centroid keeps a sample count and moves towards each new member with
+// learning rate 1/count.
+//
+
+class minibatch_kmeans {
+public:
+    minibatch_kmeans(KMCUDADistanceMetric m, size_t d, size_t k)
+        : metric(m)
+        , num_features(d)
+        , num_clusters(k)
+        , centroids(k * d)
+        , counts(k, 0.0)
+    {
+    }
+
+    // nearest centroid (and its distance) for every row of the batch
+    void assign(const float* rows,
+                size_t n,
+                std::vector<uint32_t>& assignments,
+                std::vector<float>& dists)
+    {
+        assignments.assign(n, uint32_t(kmeans_cpu_engine::unassigned));
+        dists.resize(n);
+        kmeans_cpu_engine engine(metric,
+                                 n,
+                                 num_features,
+                                 num_clusters,
+                                 0,
+                                 rows,
+                                 centroids.data(),
+                                 assignments.data());
+        engine.assign_lloyd();
+        parallel::parallel_for(0, n, [&](size_t b, size_t e, size_t) {
+            for (size_t i = b; i < e; i++)
+                dists[i] = engine.dist(rows + i * num_features,
+                    centroids.data() + assignments[i] * num_features);
+        });
+    }
+
+    // one mini-batch step. returns the mean distance of the batch rows to
+    // their centroid before the update.
+    double step(const float* rows, size_t n)
+    {
+        assign(rows, n, batch_assignments, batch_dists);
+        // group rows by centroid so centroids can be updated in parallel;
+        // within a centroid rows are applied in batch order
+        std::vector<size_t> offsets(num_clusters + 1, 0);
+        for (size_t i = 0; i < n; i++)
+            offsets[batch_assignments[i] + 1]++;
+        for (size_t c = 0; c < num_clusters; c++)
+            offsets[c + 1] += offsets[c];
+        std::vector<uint32_t> members(n);
+        std::vector<size_t> pos(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < n; i++)
+            members[pos[batch_assignments[i]]++] = i;
+        parallel::parallel_for(
+            0, num_clusters, [&](size_t b, size_t e, size_t) {
+                for (size_t c = b; c < e; c++) {
+                    if (offsets[c] == offsets[c + 1])
+                        continue;
+                    float* cent = centroids.data() + c * num_features;
+                    for (size_t m = offsets[c]; m < offsets[c + 1]; m++) {
+                        const float* x = rows + members[m] * num_features;
+                        counts[c] += 1.0;
+                        float eta = float(1.0 / counts[c]);
+                        for (size_t j = 0; j < num_features; j++)
+                            cent[j] += eta * (x[j] - cent[j]);
+                    }
+                    if (metric == kmcudaDistanceMetricCosine)
+                        normalize(cent);
+                }
+            });
+        double sum = 0.0;
+        for (size_t i = 0; i < n; i++)
+            sum += batch_dists[i];
+        return n ? sum / double(n) : 0.0;
+    }
+
+    KMCUDADistanceMetric metric;
+    size_t num_features;
+    size_t num_clusters;
+    std::vector<float> centroids;
+    std::vector<double> counts;
+
+private:
+    void normalize(float* v) const
+    {
+        double norm = 0.0;
+        for (size_t j = 0; j < num_features; j++)
+            norm += double(v[j]) * double(v[j]);
+        if (norm <= 0.0)
+            return;
+        float inv = float(1.0 / std::sqrt(norm));
+        for (size_t j = 0; j < num_features; j++)
+            v[j] *= inv;
+    }
+
+    std::vector<uint32_t> batch_assignments;
+    std::vector<float> batch_dists;
+};
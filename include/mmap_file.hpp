@@ -0,0 +1,93 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+//
+// RAII wrapper around a read-only (or private copy-on-write) file mapping.
+//
+
+class mmap_file {
+public:
+    mmap_file() = default;
+    explicit mmap_file(const std::string& file_name, bool copy_on_write = false)
+    {
+        int fd = open(file_name.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error(
+                "cannot open " + file_name + ": " + strerror(errno));
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error(
+                "cannot stat " + file_name + ": " + strerror(errno));
+        }
+        len = st.st_size;
+        if (len != 0) {
+            int prot = PROT_READ | (copy_on_write ? PROT_WRITE : 0);
+            void* p = mmap(nullptr, len, prot, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error(
+                    "cannot mmap " + file_name + ": " + strerror(errno));
+            }
+            ptr = static_cast<char*>(p);
+        }
+        close(fd);
+    }
+    mmap_file(const mmap_file&) = delete;
+    mmap_file& operator=(const mmap_file&) = delete;
+    mmap_file(mmap_file&& other) noexcept { swap(other); }
+    mmap_file& operator=(mmap_file&& other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+    ~mmap_file()
+    {
+        if (ptr)
+            munmap(ptr, len);
+    }
+
+    char* data() const { return ptr; }
+    size_t size() const { return len; }
+
+    void advise_sequential() const
+    {
+        if (ptr)
+            madvise(ptr, len, MADV_SEQUENTIAL);
+    }
+    void advise_willneed() const
+    {
+        if (ptr)
+            madvise(ptr, len, MADV_WILLNEED);
+    }
+    // drops the pages fully inside [offset,offset+bytes): they are read from
+    // the file again (private copies are lost) if touched later
+    void discard(size_t offset, size_t bytes) const
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t b = (offset + page - 1) / page * page;
+        size_t e = std::min(offset + bytes, len) / page * page;
+        if (ptr && b < e)
+            madvise(ptr + b, e - b, MADV_DONTNEED);
+    }
+
+private:
+    void swap(mmap_file& other)
+    {
+        std::swap(ptr, other.ptr);
+        std::swap(len, other.len);
+    }
+    char* ptr = nullptr;
+    size_t len = 0;
+};
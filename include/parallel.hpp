@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// Small persistent thread pool shared by the CPU side of the pipeline
+// (loader, CPU k-means engine, post-processing).
+//
+// parallel_for() splits [begin,end) into blocks that are pulled dynamically
+// by the calling thread and the pool workers. Every participant gets a
+// distinct slot id in [0,num_threads()) which callers use to index
+// per-thread scratch space. The calling thread always takes part and only
+// waits for blocks that are already running, so nested parallel_for()
+// calls from inside a worker cannot deadlock.
+//
+
+namespace parallel {
+
+class thread_pool {
+public:
+    explicit thread_pool(size_t n)
+    {
+        for (size_t i = 1; i < n; i++) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto& w : workers)
+            w.join();
+    }
+    // number of threads including the caller
+    size_t size() const { return workers.size() + 1; }
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+private:
+    void work()
+    {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [this] { return stop || !tasks.empty(); });
+                if (stop && tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stop = false;
+};
+
+inline size_t& requested_threads()
+{
+    static size_t n = std::max(1U, std::thread::hardware_concurrency());
+    return n;
+}
+
+inline std::unique_ptr<thread_pool>& pool_instance()
+{
+    static std::unique_ptr<thread_pool> p;
+    return p;
+}
+
+// must be called before the first parallel_for() to take effect
+inline void set_num_threads(size_t n)
+{
+    if (n == 0)
+        n = std::max(1U, std::thread::hardware_concurrency());
+    requested_threads() = n;
+    pool_instance().reset();
+}
+
+inline thread_pool& pool()
+{
+    auto& p = pool_instance();
+    if (!p)
+        p.reset(new thread_pool(requested_threads()));
+    return *p;
+}
+
+inline size_t num_threads() { return pool().size(); }
+
+struct for_state {
+    size_t begin;
+    size_t end;
+    size_t grain;
+    size_t num_blocks;
+    std::atomic<size_t> next_block { 0 };
+    std::atomic<size_t> done_blocks { 0 };
+    std::atomic<size_t> next_slot { 0 };
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+// f(block_begin, block_end, slot)
+template <class t_func>
+void parallel_for(size_t begin, size_t end, size_t grain, t_func f)
+{
+    if (end <= begin)
+        return;
+    grain = std::max<size_t>(grain, 1);
+    auto& tp = pool();
+    size_t num_blocks = (end - begin + grain - 1) / grain;
+    if (num_blocks == 1 || tp.size() == 1) {
+        for (size_t s = begin; s < end; s += grain)
+            f(s, std::min(end, s + grain), 0);
+        return;
+    }
+    auto state = std::make_shared<for_state>();
+    state->begin = begin;
+    state->end = end;
+    state->grain = grain;
+    state->num_blocks = num_blocks;
+    // f outlives all helpers that can still touch a block: the caller does
+    // not return before every block is finished.
+    auto run = [state, &f]() {
+        size_t slot = state->next_slot++;
+        size_t finished = 0;
+        while (true) {
+            size_t b = state->next_block++;
+            if (b >= state->num_blocks)
+                break;
+            size_t s = state->begin + b * state->grain;
+            size_t e = std::min(state->end, s + state->grain);
+            f(s, e, slot);
+            finished++;
+        }
+        if (finished
+            && state->done_blocks.fetch_add(finished) + finished
+                == state->num_blocks) {
+            std::lock_guard<std::mutex> lock(state->mtx);
+            state->cv.notify_all();
+        }
+    };
+    size_t helpers = std::min(tp.size(), num_blocks) - 1;
+    for (size_t i = 0; i < helpers; i++) {
+        // late helpers find no blocks left and return without touching f
+        tp.submit([state, run]() {
+            if (state->next_block.load() < state->num_blocks)
+                run();
+        });
+    }
+    run();
+    std::unique_lock<std::mutex> lock(state->mtx);
+    state->cv.wait(
+        lock, [&state] { return state->done_blocks == state->num_blocks; });
+}
+
+// convenience overload choosing a grain that gives each thread a few blocks
+template <class t_func> void parallel_for(size_t begin, size_t end, t_func f)
+{
+    size_t n = end > begin ? end - begin : 0;
+    size_t grain = std::max<size_t>(1, n / (num_threads() * 8));
+    parallel_for(begin, end, grain, f);
+}
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "kmcuda.h"
+
+#include "distance.hpp"
+#include "kmeans_cpu.hpp"
+#include "parallel.hpp"
+
+//
+// Product quantisation: the features are split into m contiguous subspaces
+// and every subspace of a row is replaced by the id of the closest of 256
+// codewords, so a row of d floats becomes m bytes. The squared distance of
+// a coded row to a full vector c is a sum of m lookups into a table of c
+// (asymmetric distance, see distance_table()).
+//
+
+class product_quantizer {
+public:
+    static const size_t codebook_size = 256;
+    // Lloyd iterations per codebook
+    static const size_t train_iterations = 25;
+
+    size_t dimensions() const { return num_features; }
+    size_t subspaces() const { return num_subspaces; }
+    size_t table_size() const { return num_subspaces * codebook_size; }
+
+    // trains the codebooks of m subspaces with k-means on up to train_size
+    // rows sampled from samples (n x d). Subspaces are trained in parallel.
+    void train(const float* samples,
+               size_t n,
+               size_t d,
+               size_t m,
+               size_t train_size,
+               uint32_t seed)
+    {
+        if (m == 0 || m > d)
+            throw std::runtime_error("pq: 1 to num_features subspaces");
+        train_size = std::min(n, train_size);
+        if (train_size < codebook_size)
+            throw std::runtime_error("pq: at least 256 training rows needed");
+        num_features = d;
+        num_subspaces = m;
+        offsets.resize(m + 1);
+        for (size_t s = 0; s <= m; s++)
+            offsets[s] = s * d / m;
+        codebooks.assign(codebook_size * d, 0.0f);
+
+        std::vector<uint32_t> ids(n);
+        std::iota(ids.begin(), ids.end(), 0);
+        std::mt19937_64 rng(seed);
+        for (size_t i = 0; i < train_size; i++) {
+            std::uniform_int_distribution<size_t> pick(i, n - 1);
+            std::swap(ids[i], ids[pick(rng)]);
+        }
+        parallel::parallel_for(0, m, 1, [&](size_t b, size_t e, size_t) {
+            std::vector<float> rows;
+            std::vector<uint32_t> assignments(train_size);
+            for (size_t s = b; s < e; s++) {
+                size_t w = width(s);
+                rows.resize(train_size * w);
+                for (size_t i = 0; i < train_size; i++) {
+                    const float* x = samples + size_t(ids[i]) * d + offsets[s];
+                    std::copy(x, x + w, rows.data() + i * w);
+                }
+                kmeans_cpu_engine engine(kmcudaDistanceMetricL2,
+                                         train_size,
+                                         w,
+                                         codebook_size,
+                                         0,
+                                         rows.data(),
+                                         codebook(s),
+                                         assignments.data());
+                engine.init_centroids(
+                    kmcudaInitMethodPlusPlus, nullptr, seed + uint32_t(s));
+                kmeans_cpu_options opts;
+                opts.max_iterations = train_iterations;
+                engine.run(0.01f, 0.0f, opts);
+            }
+        });
+    }
+
+    // m byte code of the row x
+    void encode(const float* x, uint8_t* code) const
+    {
+        for (size_t s = 0; s < num_subspaces; s++) {
+            size_t w = width(s);
+            const float* cb = codebook(s);
+            float best = std::numeric_limits<float>::max();
+            for (size_t j = 0; j < codebook_size; j++) {
+                float dj = distance::l2_sq(x + offsets[s], cb + j * w, w);
+                if (dj < best) {
+                    best = dj;
+                    code[s] = uint8_t(j);
+                }
+            }
+        }
+    }
+
+    // codes of all rows, n x m bytes
+    std::vector<uint8_t> encode_all(const float* samples, size_t n) const
+    {
+        std::vector<uint8_t> codes(n * num_subspaces);
+        parallel::parallel_for(0, n, [&](size_t b, size_t e, size_t) {
+            for (size_t i = b; i < e; i++)
+                encode(samples + i * num_features,
+                    codes.data() + i * num_subspaces);
+        });
+        return codes;
+    }
+
+    void decode(const uint8_t* code, float* x) const
+    {
+        for (size_t s = 0; s < num_subspaces; s++) {
+            size_t w = width(s);
+            const float* cw = codebook(s) + size_t(code[s]) * w;
+            std::copy(cw, cw + w, x + offsets[s]);
+        }
+    }
+
+    // table[s * 256 + j]: squared distance of codeword j of subspace s to
+    // the same subspace of c
+    void distance_table(const float* c, float* table) const
+    {
+        for (size_t s = 0; s < num_subspaces; s++) {
+            size_t w = width(s);
+            const float* cb = codebook(s);
+            for (size_t j = 0; j < codebook_size; j++)
+                table[s * codebook_size + j]
+                    = distance::l2_sq(c + offsets[s], cb + j * w, w);
+        }
+    }
+
+    // squared distance of a coded row to the vector of table. Four partial
+    // sums keep the lookups independent of the add latency.
+    float adc(const uint8_t* code, const float* table) const
+    {
+        float d0 = 0.0f, d1 = 0.0f, d2 = 0.0f, d3 = 0.0f;
+        size_t s = 0;
+        for (; s + 4 <= num_subspaces; s += 4) {
+            const float* t = table + s * codebook_size;
+            d0 += t[code[s]];
+            d1 += t[codebook_size + code[s + 1]];
+            d2 += t[2 * codebook_size + code[s + 2]];
+            d3 += t[3 * codebook_size + code[s + 3]];
+        }
+        for (; s < num_subspaces; s++)
+            d0 += table[s * codebook_size + code[s]];
+        return (d0 + d1) + (d2 + d3);
+    }
+
+    // mean squared error of the codes of the rows (n x d)
+    double quantization_error(
+        const float* samples, size_t n, const uint8_t* codes) const
+    {
+        std::vector<double> sums(parallel::num_threads(), 0.0);
+        parallel::parallel_for(0, n, [&](size_t b, size_t e, size_t slot) {
+            std::vector<float> x(num_features);
+            double sum = 0.0;
+            for (size_t i = b; i < e; i++) {
+                decode(codes + i * num_subspaces, x.data());
+                sum += distance::l2_sq(
+                    samples + i * num_features, x.data(), num_features);
+            }
+            sums[slot] += sum;
+        });
+        return n ? std::accumulate(sums.begin(), sums.end(), 0.0) / n : 0.0;
+    }
+
+private:
+    size_t width(size_t s) const { return offsets[s + 1] - offsets[s]; }
+    // codewords of subspace s, 256 rows of width(s) floats
+    float* codebook(size_t s)
+    {
+        return codebooks.data() + codebook_size * offsets[s];
+    }
+    const float* codebook(size_t s) const
+    {
+        return codebooks.data() + codebook_size * offsets[s];
+    }
+
+    size_t num_features = 0;
+    size_t num_subspaces = 0;
+    std::vector<size_t> offsets;
+    std::vector<float> codebooks;
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+//
+// Deterministic synthetic word vectors in the text format ("rows cols"
+// header, then "<word> <f_1> ... <f_d>" per line) for benchmarks. Rows are
+// drawn around num_clusters gaussian centres, so clustering has structure
+// to find. Word lengths follow a geometric distribution around
+// word_len_mean, and a fraction of the words is longer than the default
+// --max-word-len cut so the loaders also skip rows. The same options and
+// seed always produce the same bytes.
+//
+
+struct synthetic_options {
+    size_t rows = 50000;
+    size_t dims = 100;
+    size_t num_clusters = 100;
+    // standard deviation of the rows around their centre (the centres
+    // have unit variance per dimension)
+    float spread = 0.25f;
+    float word_len_mean = 8.0f;
+    size_t word_len_max = 24;
+    // ratio of words of 33 to 48 chars, longer than the default cut of 32
+    float long_words = 0.01f;
+    uint32_t seed = 1234;
+};
+
+namespace synthetic_detail {
+
+// unique word for row i of len chars (at least the id): random letters,
+// then "_" and the row id in base 26
+inline void make_word(size_t i, size_t len, std::mt19937_64& rng,
+    std::string& word)
+{
+    std::string id;
+    do {
+        id += char('a' + i % 26);
+        i /= 26;
+    } while (i > 0);
+    word.clear();
+    std::uniform_int_distribution<int> letter('a', 'z');
+    while (word.size() + id.size() + 1 < len)
+        word += char(letter(rng));
+    word += '_';
+    word += id;
+}
+}
+
+// writes the synthetic vectors to f, returns the number of bytes written
+inline size_t write_synthetic_text(FILE* f, const synthetic_options& opts)
+{
+    if (opts.num_clusters == 0 || opts.dims == 0)
+        throw std::runtime_error("synthetic data needs clusters and dims");
+    std::mt19937_64 rng(opts.seed);
+    std::normal_distribution<float> unit(0.0f, 1.0f);
+    std::vector<float> centres(opts.num_clusters * opts.dims);
+    for (auto& c : centres)
+        c = unit(rng);
+
+    std::uniform_int_distribution<size_t> pick_cluster(
+        0, opts.num_clusters - 1);
+    std::geometric_distribution<size_t> word_len(
+        1.0 / std::max(1.0, double(opts.word_len_mean)));
+    std::uniform_int_distribution<size_t> long_len(33, 48);
+    std::bernoulli_distribution is_long(opts.long_words);
+    std::string word;
+    std::string line;
+    char num[32];
+    size_t bytes = size_t(fprintf(f, "%zu %zu\n", opts.rows, opts.dims));
+    for (size_t i = 0; i < opts.rows; i++) {
+        size_t len = is_long(rng)
+            ? long_len(rng)
+            : std::min(opts.word_len_max, 1 + word_len(rng));
+        synthetic_detail::make_word(i, len, rng, word);
+        const float* centre = centres.data() + pick_cluster(rng) * opts.dims;
+        line = word;
+        for (size_t j = 0; j < opts.dims; j++) {
+            int n = snprintf(num, sizeof(num), " %.6f",
+                double(centre[j] + opts.spread * unit(rng)));
+            line.append(num, n);
+        }
+        line += '\n';
+        if (fwrite(line.data(), 1, line.size(), f) != line.size())
+            throw std::runtime_error("error writing synthetic data");
+        bytes += line.size();
+    }
+    return bytes;
+}
+
+inline size_t write_synthetic_text(
+    const std::string& file_name, const synthetic_options& opts)
+{
+    FILE* f = fopen(file_name.c_str(), "w");
+    if (f == nullptr)
+        throw std::runtime_error("cannot create " + file_name);
+    size_t bytes = write_synthetic_text(f, opts);
+    if (fclose(f) != 0)
+        throw std::runtime_error("error writing " + file_name);
+    return bytes;
+}
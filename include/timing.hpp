@@ -1,9 +1,10 @@
-#pragma ONCE
+#pragma once
 
 #include <chrono>
 #include <string>
 
 #include "logging.hpp"
+#include "metrics.hpp"
 
 using namespace std::chrono;
 using watch = std::chrono::high_resolution_clock;
@@ -26,7 +27,11 @@ template <class t_dur = std::chrono::seconds> struct cl_timer {
         auto time_spent = stop - start;
         if (output)
             LOG_INFO << "STOP(" << name << ") - "
-                     << duration_cast<t_dur>(time_spent).count() << " sec";
+                     << duration<double, typename t_dur::period>(time_spent)
+                            .count()
+                     << " sec";
+        metrics::global().phase(
+            name, duration<double, std::micro>(time_spent).count());
     }
     watch::duration elapsed() const { return watch::now() - start; }
 };
@@ -36,9 +41,9 @@ template <class t_dur = std::chrono::seconds> struct cl_read_timer {
     std::string name;
     size_t bytes;
     bool output;
-    cl_read_timer(const std::string& _n,size_t rb, bool o = true)
+    cl_read_timer(const std::string& _n, size_t rb, bool o = true)
         : name(_n)
-	, bytes(rb)
+        , bytes(rb)
         , output(o)
     {
         if (output)
@@ -49,11 +54,17 @@ template <class t_dur = std::chrono::seconds> struct cl_read_timer {
     {
         auto stop = watch::now();
         auto time_spent = stop - start;
+        double secs = duration<double>(time_spent).count();
         if (output)
             LOG_INFO << "STOP(" << name << ") - "
-                     << duration_cast<t_dur>(time_spent).count() << " sec ("
-		     << float(bytes/(1024*1024))/float(duration_cast<t_dur>(time_spent).count()) << " MiB/s)"; 
-			
+                     << duration<double, typename t_dur::period>(time_spent)
+                            .count()
+                     << " sec ("
+                     << (secs > 0.0 ? double(bytes) / (1024 * 1024) / secs
+                                    : 0.0)
+                     << " MiB/s)";
+        metrics::global().phase(
+            name, duration<double, std::micro>(time_spent).count());
     }
     watch::duration elapsed() const { return watch::now() - start; }
 };
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "logging.hpp"
+
+//
+// Collective operations between the worker processes of a distributed run.
+// transport is the interface the clustering code talks to; make_transport()
+// picks an implementation from an address string. socket_transport connects
+// the workers in a star around rank 0 over a unix socket (all workers on
+// one machine) or TCP (one worker per node): rank 0 combines the buffers
+// of all workers and sends the result back.
+//
+
+class transport {
+public:
+    virtual ~transport() = default;
+    virtual size_t rank() const = 0;
+    virtual size_t size() const = 0;
+    // element-wise sum over all workers, the result on every worker
+    virtual void all_reduce_sum(double* data, size_t count) = 0;
+    // bytes of rank 0 to every worker
+    virtual void broadcast(void* data, size_t bytes) = 0;
+    // buffers of all workers concatenated in rank order, on rank 0 (empty
+    // elsewhere)
+    virtual std::vector<char> gather(const void* data, size_t bytes) = 0;
+};
+
+namespace transport_detail {
+
+inline void write_all(int fd, const void* data, size_t bytes)
+{
+    const char* p = static_cast<const char*>(data);
+    while (bytes > 0) {
+        ssize_t w = ::write(fd, p, bytes);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            throw std::runtime_error("transport: write failed: "
+                + std::string(strerror(errno)));
+        p += w;
+        bytes -= size_t(w);
+    }
+}
+
+inline void read_all(int fd, void* data, size_t bytes)
+{
+    char* p = static_cast<char*>(data);
+    while (bytes > 0) {
+        ssize_t r = ::read(fd, p, bytes);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            throw std::runtime_error("transport: peer closed the connection");
+        p += r;
+        bytes -= size_t(r);
+    }
+}
+
+// "unix:<path>" or "tcp:<host>:<port>"
+struct address {
+    bool tcp = false;
+    std::string path;
+    std::string host;
+    std::string port;
+
+    explicit address(const std::string& a)
+    {
+        if (a.compare(0, 5, "unix:") == 0) {
+            path = a.substr(5);
+        } else if (a.compare(0, 4, "tcp:") == 0
+            && a.rfind(':') > size_t(3)) {
+            tcp = true;
+            host = a.substr(4, a.rfind(':') - 4);
+            port = a.substr(a.rfind(':') + 1);
+        } else {
+            throw std::runtime_error("transport: unknown address " + a
+                + " (unix:<path> or tcp:<host>:<port>)");
+        }
+    }
+};
+}
+
+class socket_transport : public transport {
+public:
+    // rank 0 listens on addr and waits for the other size - 1 workers,
+    // which retry connecting for up to timeout
+    socket_transport(const std::string& addr,
+                     size_t rank,
+                     size_t size,
+                     std::chrono::seconds timeout = std::chrono::seconds(300))
+        : my_rank(rank)
+        , world_size(size)
+    {
+        if (rank >= size)
+            throw std::runtime_error("transport: rank must be < world size");
+        transport_detail::address a(addr);
+        if (rank == 0)
+            accept_workers(a);
+        else
+            connect_root(a, timeout);
+        LOG_INFO << "transport: rank " << rank << " of " << size
+                 << " connected via " << addr;
+    }
+
+    ~socket_transport()
+    {
+        for (int fd : peers) {
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+
+    size_t rank() const { return my_rank; }
+    size_t size() const { return world_size; }
+
+    void all_reduce_sum(double* data, size_t count)
+    {
+        size_t bytes = count * sizeof(double);
+        if (my_rank != 0) {
+            transport_detail::write_all(peers[0], data, bytes);
+            transport_detail::read_all(peers[0], data, bytes);
+            return;
+        }
+        std::vector<double> buf(count);
+        for (size_t r = 1; r < world_size; r++) {
+            transport_detail::read_all(peers[r], buf.data(), bytes);
+            for (size_t i = 0; i < count; i++)
+                data[i] += buf[i];
+        }
+        for (size_t r = 1; r < world_size; r++)
+            transport_detail::write_all(peers[r], data, bytes);
+    }
+
+    void broadcast(void* data, size_t bytes)
+    {
+        if (my_rank != 0) {
+            transport_detail::read_all(peers[0], data, bytes);
+            return;
+        }
+        for (size_t r = 1; r < world_size; r++)
+            transport_detail::write_all(peers[r], data, bytes);
+    }
+
+    std::vector<char> gather(const void* data, size_t bytes)
+    {
+        uint64_t len = bytes;
+        if (my_rank != 0) {
+            transport_detail::write_all(peers[0], &len, sizeof(len));
+            transport_detail::write_all(peers[0], data, bytes);
+            return {};
+        }
+        const char* p = static_cast<const char*>(data);
+        std::vector<char> out(p, p + bytes);
+        for (size_t r = 1; r < world_size; r++) {
+            transport_detail::read_all(peers[r], &len, sizeof(len));
+            size_t at = out.size();
+            out.resize(at + len);
+            transport_detail::read_all(peers[r], out.data() + at, len);
+        }
+        return out;
+    }
+
+private:
+    static int open_socket(const transport_detail::address& a,
+                           bool listening)
+    {
+        if (!a.tcp) {
+            sockaddr_un sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sun_family = AF_UNIX;
+            if (a.path.size() >= sizeof(sa.sun_path))
+                throw std::runtime_error("transport: socket path too long");
+            strcpy(sa.sun_path, a.path.c_str());
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0)
+                return -1;
+            if (listening)
+                unlink(a.path.c_str());
+            int ok = listening
+                ? bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa))
+                : connect(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa));
+            if (ok == 0)
+                return fd;
+            close(fd);
+            return -1;
+        }
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+        addrinfo* res = nullptr;
+        if (getaddrinfo(listening ? nullptr : a.host.c_str(), a.port.c_str(),
+                &hints, &res)
+            != 0)
+            return -1;
+        int fd = -1;
+        for (addrinfo* ai = res; ai != nullptr && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (listening)
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            int ok = listening ? bind(fd, ai->ai_addr, ai->ai_addrlen)
+                               : connect(fd, ai->ai_addr, ai->ai_addrlen);
+            if (ok != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(res);
+        return fd;
+    }
+
+    void accept_workers(const transport_detail::address& a)
+    {
+        peers.assign(world_size, -1);
+        if (world_size == 1)
+            return;
+        int lfd = open_socket(a, true);
+        if (lfd < 0 || listen(lfd, int(world_size)) != 0)
+            throw std::runtime_error("transport: cannot listen: "
+                + std::string(strerror(errno)));
+        for (size_t connected = 1; connected < world_size;) {
+            int fd = accept(lfd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR)
+                    continue;
+                close(lfd);
+                throw std::runtime_error("transport: accept failed: "
+                    + std::string(strerror(errno)));
+            }
+            uint64_t r;
+            transport_detail::read_all(fd, &r, sizeof(r));
+            if (r == 0 || r >= world_size || peers[r] >= 0) {
+                close(fd);
+                close(lfd);
+                throw std::runtime_error("transport: bad or duplicate rank "
+                    + std::to_string(r));
+            }
+            peers[r] = fd;
+            connected++;
+        }
+        close(lfd);
+        if (!a.tcp)
+            unlink(a.path.c_str());
+    }
+
+    void connect_root(
+        const transport_detail::address& a, std::chrono::seconds timeout)
+    {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        int fd;
+        while ((fd = open_socket(a, false)) < 0) {
+            if (std::chrono::steady_clock::now() > deadline)
+                throw std::runtime_error(
+                    "transport: cannot reach rank 0: timeout");
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        uint64_t r = my_rank;
+        transport_detail::write_all(fd, &r, sizeof(r));
+        peers.assign(1, fd);
+    }
+
+    size_t my_rank;
+    size_t world_size;
+    // rank 0: a connection per rank (peers[0] unused); others: the root
+    std::vector<int> peers;
+};
+
+inline std::unique_ptr<transport> make_transport(
+    const std::string& addr, size_t rank, size_t size)
+{
+    return std::unique_ptr<transport>(
+        new socket_transport(addr, rank, size));
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "logging.hpp"
+#include "mmap_file.hpp"
+#include "timing.hpp"
+#include "vector_data.hpp"
+
+//
+// Native on-disk vector format that can be mapped straight into the
+// input_samples pointer:
+//
+//   [header][pad to 4 KiB][num_samples x num_features floats][pad to 8]
+//   [word table]
+//
+// The matrix starts on a page boundary so rows are aligned for SIMD loads.
+// The word table is a serialised word_table including its hash index, so
+// readers map it instead of rebuilding it. Version 1 files store the words
+// in row order, each terminated by '\0', and are still read.
+//
+
+namespace vector_cache {
+
+const char magic[8] = { 'C', 'W', 'V', 'C', 'A', 'C', 'H', 'E' };
+const uint32_t version = 2;
+const size_t alignment = 4096;
+
+struct header {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_word_len;
+    uint64_t num_samples;
+    uint64_t num_features;
+    uint64_t data_offset;
+    uint64_t words_offset;
+    uint64_t words_bytes;
+};
+
+inline bool is_cache_file(const std::string& file_name)
+{
+    char buf[sizeof(magic)] = { 0 };
+    FILE* f = fopen(file_name.c_str(), "rb");
+    if (f == nullptr)
+        return false;
+    size_t read = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    return read == sizeof(buf) && memcmp(buf, magic, sizeof(magic)) == 0;
+}
+
+inline void write(const vector_data& vd,
+                  const std::string& file_name,
+                  size_t max_word_len)
+{
+    cl_timer<> write_start("write vector cache");
+    header h;
+    memcpy(h.magic, magic, sizeof(magic));
+    h.version = version;
+    h.max_word_len = max_word_len;
+    h.num_samples = vd.num_samples;
+    h.num_features = vd.num_features;
+    h.data_offset = alignment;
+    h.words_offset = (h.data_offset + vd.size_bytes() + 7) & ~uint64_t(7);
+    h.words_bytes = vd.word_str.serialized_bytes();
+
+    FILE* f = fopen(file_name.c_str(), "wb");
+    if (f == nullptr)
+        throw std::runtime_error("cannot create " + file_name);
+    std::vector<char> pad(h.data_offset - sizeof(h), 0);
+    size_t words_pad = h.words_offset - h.data_offset - vd.size_bytes();
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+        && fwrite(pad.data(), 1, pad.size(), f) == pad.size()
+        && fwrite(vd.data(), 1, vd.size_bytes(), f) == vd.size_bytes()
+        && fwrite(pad.data(), 1, words_pad, f) == words_pad
+        && vd.word_str.write(f);
+    if (fclose(f) != 0 || !ok)
+        throw std::runtime_error("error writing " + file_name);
+    LOG_INFO << "wrote vector cache " << file_name << " ("
+             << (h.words_offset + h.words_bytes) / (1024 * 1024) << " MiB)";
+}
+
+// maps the matrix copy-on-write, so in-place transformations of the
+// samples never touch the file
+inline vector_data read(const std::string& file_name, size_t max_word_len)
+{
+    cl_timer<> read_start("read vector cache");
+    LOG_INFO << "Mapping vector cache " << file_name;
+    vector_data vd;
+    vd.mapping = mmap_file(file_name, true);
+    if (vd.mapping.size() < sizeof(header))
+        throw std::runtime_error("truncated vector cache " + file_name);
+    header h;
+    memcpy(&h, vd.mapping.data(), sizeof(h));
+    if (memcmp(h.magic, magic, sizeof(magic)) != 0 || h.version < 1
+        || h.version > version)
+        throw std::runtime_error("unsupported vector cache " + file_name);
+    if (h.words_offset + h.words_bytes > vd.mapping.size())
+        throw std::runtime_error("truncated vector cache " + file_name);
+    if (h.max_word_len != max_word_len)
+        LOG_WARNING << "vector cache was written with max_word_len = "
+                    << h.max_word_len << " (requested " << max_word_len
+                    << ")";
+    vd.num_samples = h.num_samples;
+    vd.num_features = h.num_features;
+    vd.mapped = reinterpret_cast<float*>(vd.mapping.data() + h.data_offset);
+    const char* w = vd.mapping.data() + h.words_offset;
+    if (h.version >= 2) {
+        vd.word_str.attach(w, h.words_bytes);
+    } else {
+        vd.word_str.reserve(vd.num_samples, h.words_bytes);
+        const char* words_end = w + h.words_bytes;
+        while (w < words_end && vd.word_str.size() < vd.num_samples) {
+            size_t len = strnlen(w, words_end - w);
+            vd.word_str.push_back(w, len);
+            w += len + 1;
+        }
+    }
+    if (vd.word_str.size() != vd.num_samples)
+        throw std::runtime_error("corrupt word table in " + file_name);
+    return vd;
+}
+}
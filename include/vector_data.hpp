@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "mmap_file.hpp"
+#include "word_table.hpp"
+
+// word vectors in row-major order. Rows live either in dat (text and
+// word2vec loaders) or directly in a private mapping of a vector cache file;
+// the words of a cache file are a view of the same mapping.
+struct vector_data {
+    std::vector<float> dat;
+    mmap_file mapping;
+    float* mapped = nullptr;
+    size_t num_samples = 0;
+    size_t num_features = 0;
+    word_table word_str;
+
+    float* data() { return mapped ? mapped : dat.data(); }
+    const float* data() const { return mapped ? mapped : dat.data(); }
+    size_t size_bytes() const
+    {
+        return num_samples * num_features * sizeof(float);
+    }
+    // lets the kernel reclaim the pages of rows mapped from a cache; they
+    // are read from the file again when touched. Rows changed in place
+    // (normalised) would lose the change. No-op for rows in dat.
+    void drop_row_pages() const
+    {
+        if (mapped)
+            mapping.discard(
+                reinterpret_cast<const char*>(mapped) - mapping.data(),
+                size_bytes());
+    }
+    // frees the float rows once they have been converted elsewhere
+    void release_rows()
+    {
+        std::vector<float>().swap(dat);
+        if (mapped && word_str.is_view())
+            mapping.discard(reinterpret_cast<char*>(mapped) - mapping.data(),
+                size_bytes());
+        else
+            mapping = mmap_file();
+        mapped = nullptr;
+    }
+};
@@ -0,0 +1,611 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "block_reader.hpp"
+#include "compressed_input.hpp"
+#include "distance.hpp"
+#include "logging.hpp"
+#include "mmap_file.hpp"
+#include "parallel.hpp"
+#include "timing.hpp"
+#include "util.hpp"
+#include "vector_cache.hpp"
+#include "vector_data.hpp"
+#include "word_table.hpp"
+
+// parses "<word> <f_1> ... <f_cols>\n". Words longer than max_word_len are
+// truncated to max_word_len+1 chars in word_buf and their floats are
+// skipped, so word_buf needs room for max_word_len+2 chars. The word scan
+// stops at the end of the line: a line without a space has no vector, its
+// floats are not parsed (callers skip it, see vector_io::word_length).
+const char* parse_line(const char* cur_line,
+                       char* word_buf,
+                       float* float_data,
+                       size_t max_word_len,
+                       size_t cols)
+{
+    const char* tmp = cur_line;
+    /* extract word token */
+    size_t word_len = 0;
+    while (*tmp != ' ' && *tmp != '\n') {
+        if (word_len <= max_word_len)
+            word_buf[word_len] = *tmp;
+        word_len++;
+        tmp++;
+    }
+    word_buf[std::min(word_len, max_word_len + 1)] = 0;
+    if (*tmp == '\n')
+        return ++tmp;
+    tmp++;
+    if (word_len > max_word_len) {
+        while (*tmp != '\n')
+            ++tmp;
+    } else {
+        for (size_t i = 0; i < cols; i++) {
+            *float_data++ = (float)fast_atof(tmp);
+        }
+    }
+    while (*tmp != '\n')
+        tmp++;
+    return ++tmp;
+}
+
+namespace vector_io {
+
+// contiguous run of complete lines of the mapped text file
+struct text_chunk {
+    const char* begin;
+    const char* end;
+    size_t lines = 0;
+    size_t kept = 0;
+    size_t zero = 0;
+    size_t row_offset = 0;
+    // words of the chunk, '\0'-terminated, and their end offsets
+    std::string words;
+    std::vector<size_t> word_ends;
+};
+
+// splits [begin,end) into ~n pieces that start and end on line boundaries
+inline std::vector<text_chunk> split_lines(
+    const char* begin, const char* end, size_t n)
+{
+    std::vector<text_chunk> chunks;
+    size_t target = std::max<size_t>((end - begin) / std::max<size_t>(n, 1),
+        1 << 20);
+    const char* cur = begin;
+    while (cur < end) {
+        const char* stop = cur + std::min<size_t>(target, end - cur);
+        if (stop < end) {
+            auto nl = (const char*)memchr(stop, '\n', end - stop);
+            stop = nl ? nl + 1 : end;
+        }
+        text_chunk c;
+        c.begin = cur;
+        c.end = stop;
+        chunks.push_back(c);
+        cur = stop;
+    }
+    return chunks;
+}
+
+// word length of the line [p,end). A line without a space has no vector
+// and is skipped like an over-long word: SIZE_MAX.
+inline size_t word_length(const char* p, const char* end)
+{
+    auto sp = (const char*)memchr(p, ' ', end - p);
+    return sp ? sp - p : size_t(-1);
+}
+
+// rows with a smaller L2 norm have no usable direction for the cosine
+// metric and are dropped after normalisation
+const float min_norm = 1e-6f;
+
+// scales x to unit L2 norm. Near-zero rows are set to all zeros and false
+// is returned.
+inline bool normalize_row(float* x, size_t d)
+{
+    float norm = std::sqrt(distance::dot(x, x, d));
+    if (!(norm >= min_norm)) {
+        std::fill(x, x + d, 0.0f);
+        return false;
+    }
+    float inv = 1.0f / norm;
+    for (size_t j = 0; j < d; j++)
+        x[j] *= inv;
+    return true;
+}
+
+// normalises n rows on all threads, returns the number of near-zero rows
+inline size_t normalize_rows(float* dat, size_t n, size_t d)
+{
+    std::vector<size_t> zero(parallel::num_threads(), 0);
+    parallel::parallel_for(0, n, [&](size_t b, size_t e, size_t slot) {
+        for (size_t i = b; i < e; i++) {
+            if (!normalize_row(dat + i * d, d))
+                zero[slot]++;
+        }
+    });
+    size_t total = 0;
+    for (auto z : zero)
+        total += z;
+    return total;
+}
+
+// removes the all-zero rows left by normalize_row() and their words,
+// keeping the order of the others. Returns the new row count.
+inline size_t drop_zero_rows(float* dat, word_table& words, size_t d)
+{
+    size_t n = words.size();
+    std::vector<char> keep(n);
+    parallel::parallel_for(0, n, [&](size_t b, size_t e, size_t) {
+        for (size_t i = b; i < e; i++)
+            keep[i] = distance::dot(dat + i * d, dat + i * d, d) > 0.0f;
+    });
+    size_t out = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!keep[i])
+            continue;
+        if (out != i)
+            memmove(dat + out * d, dat + i * d, d * sizeof(float));
+        out++;
+    }
+    words.compact(keep);
+    return out;
+}
+
+inline void drop_zero_rows(vector_data& vd, size_t zero_rows)
+{
+    if (zero_rows == 0)
+        return;
+    LOG_WARNING << "dropping " << zero_rows
+                << " near-zero vectors (L2 norm < " << min_norm << ")";
+    vd.num_samples = drop_zero_rows(vd.data(), vd.word_str, vd.num_features);
+    if (!vd.mapped)
+        vd.dat.resize(vd.num_samples * vd.num_features);
+}
+}
+
+namespace vector_io {
+
+// parses the complete lines in [begin,end) on all threads and appends the
+// rows of words up to max_word_len chars to dat / words. Returns the
+// number of lines seen, including skipped ones. With zero_rows set every
+// row is L2-normalised right after it is parsed, and near-zero rows are
+// added to *zero_rows.
+inline size_t parse_text_lines(const char* begin,
+                               const char* end,
+                               size_t max_word_len,
+                               size_t cols,
+                               std::vector<float>& dat,
+                               word_table& words,
+                               size_t* zero_rows = nullptr)
+{
+    auto chunks = split_lines(begin, end, parallel::num_threads() * 4);
+
+    // (1) count lines and kept words per chunk to find the output offsets
+    parallel::parallel_for(
+        0, chunks.size(), 1, [&](size_t b, size_t e, size_t) {
+            for (size_t ci = b; ci < e; ci++) {
+                auto& c = chunks[ci];
+                const char* cur = c.begin;
+                while (cur < c.end) {
+                    auto nl = (const char*)memchr(cur, '\n', c.end - cur);
+                    const char* line_end = nl ? nl : c.end;
+                    if (word_length(cur, line_end) <= max_word_len)
+                        c.kept++;
+                    c.lines++;
+                    cur = line_end + 1;
+                }
+            }
+        });
+    size_t first_row = words.size();
+    size_t num_rows = first_row;
+    size_t total_lines = 0;
+    for (auto& c : chunks) {
+        c.row_offset = num_rows;
+        num_rows += c.kept;
+        total_lines += c.lines;
+    }
+    dat.resize(num_rows * cols);
+
+    // (2) parse each chunk straight into its final rows of the matrix
+    parallel::parallel_for(
+        0, chunks.size(), 1, [&](size_t b, size_t e, size_t) {
+            std::vector<char> word_buf(max_word_len + 2);
+            std::string tail;
+            for (size_t ci = b; ci < e; ci++) {
+                auto& c = chunks[ci];
+                size_t row = c.row_offset;
+                const char* cur = c.begin;
+                while (cur < c.end) {
+                    auto nl = (const char*)memchr(cur, '\n', c.end - cur);
+                    const char* line_end = nl ? nl : c.end;
+                    // the rule of the count pass decides which rows exist
+                    if (word_length(cur, line_end) > max_word_len) {
+                        cur = line_end + 1;
+                        continue;
+                    }
+                    float* out = dat.data() + row * cols;
+                    if (nl == nullptr) {
+                        // unterminated last line: parse a terminated copy
+                        tail.assign(cur, c.end);
+                        tail.push_back('\n');
+                        parse_line(tail.c_str(), word_buf.data(), out,
+                            max_word_len, cols);
+                    } else {
+                        parse_line(
+                            cur, word_buf.data(), out, max_word_len, cols);
+                    }
+                    cur = line_end + 1;
+                    if (zero_rows && !normalize_row(out, cols))
+                        c.zero++;
+                    c.words += word_buf.data();
+                    c.words += '\0';
+                    c.word_ends.push_back(c.words.size());
+                    row++;
+                }
+            }
+        });
+
+    // (3) append the words of all chunks to the arena
+    size_t first_byte = words.bytes();
+    std::vector<size_t> byte_offsets(chunks.size() + 1, first_byte);
+    for (size_t ci = 0; ci < chunks.size(); ci++)
+        byte_offsets[ci + 1] = byte_offsets[ci] + chunks[ci].words.size();
+    words.resize(num_rows, byte_offsets.back());
+    char* arena = words.arena_data();
+    uint64_t* offsets = words.offset_data();
+    parallel::parallel_for(
+        0, chunks.size(), 1, [&](size_t b, size_t e, size_t) {
+            for (size_t ci = b; ci < e; ci++) {
+                auto& c = chunks[ci];
+                memcpy(arena + byte_offsets[ci], c.words.data(),
+                    c.words.size());
+                for (size_t j = 0; j < c.word_ends.size(); j++)
+                    offsets[c.row_offset + j + 1]
+                        = byte_offsets[ci] + c.word_ends[j];
+            }
+        });
+    if (zero_rows) {
+        for (auto& c : chunks)
+            *zero_rows += c.zero;
+    }
+    return total_lines;
+}
+
+// parses the "rows cols" header line, returns the start of the first row
+inline const char* parse_header(const char* begin,
+                                const char* end,
+                                const std::string& file_name,
+                                int& rows,
+                                int& cols)
+{
+    auto header_end = (const char*)memchr(begin, '\n', end - begin);
+    if (header_end == nullptr)
+        throw std::runtime_error("missing header line in " + file_name);
+    std::string header(begin, header_end);
+    rows = 0;
+    cols = 0;
+    sscanf(header.c_str(), "%d %d", &rows, &cols);
+    return header_end + 1;
+}
+}
+
+// normalize: L2-normalise the rows while parsing (cosine metric). With
+// num_shards > 1 only the lines of byte range shard of num_shards equal
+// ranges of the body are read; a line belongs to the range it starts in.
+vector_data read_vector_data(std::string file_name,
+                             size_t max_word_len,
+                             bool normalize = false,
+                             size_t shard = 0,
+                             size_t num_shards = 1)
+{
+    cl_timer<> cluster_start("read_vector_data");
+    LOG_INFO << "Loading word vector data from " << file_name;
+    auto load_start = watch::now();
+    vector_data vd;
+    mmap_file f(file_name);
+    f.advise_sequential();
+    const char* file_end = f.data() + f.size();
+    int rows;
+    int cols;
+    const char* body
+        = vector_io::parse_header(f.data(), file_end, file_name, rows, cols);
+    std::cout << "rows = " << rows << " cols = " << cols << std::endl;
+    const char* body_end = file_end;
+    if (num_shards > 1) {
+        size_t body_bytes = file_end - body;
+        auto line_start = [&](size_t s) {
+            const char* p = body + body_bytes * s / num_shards;
+            if (p == body || p == file_end || p[-1] == '\n')
+                return p;
+            auto nl = (const char*)memchr(p, '\n', file_end - p);
+            return nl ? nl + 1 : file_end;
+        };
+        body_end = line_start(shard + 1);
+        body = line_start(shard);
+        LOG_INFO << "shard " << shard << " of " << num_shards << ": bytes "
+                 << body - f.data() << " to " << body_end - f.data();
+    }
+
+    size_t total_lines;
+    size_t zero_rows = 0;
+    {
+        cl_timer<> parse_timer("parse_text_lines", false);
+        total_lines = vector_io::parse_text_lines(body,
+                                                  body_end,
+                                                  max_word_len,
+                                                  cols,
+                                                  vd.dat,
+                                                  vd.word_str,
+                                                  normalize ? &zero_rows
+                                                            : nullptr);
+    }
+    vd.num_samples = vd.word_str.size();
+    vd.num_features = cols;
+
+    size_t skipped_words = total_lines - vd.num_samples;
+    // the header counts the rows of the whole file
+    float total = num_shards > 1 ? float(total_lines) : float(rows);
+    LOG_INFO << "skipped words = " << skipped_words << " ("
+             << float(skipped_words) / total * 100.0 << "%)";
+    double secs = duration_cast<duration<double>>(watch::now() - load_start)
+                      .count();
+    LOG_INFO << "load throughput = "
+             << (double(f.size()) / (1024 * 1024)) / secs << " MiB/s ("
+             << parallel::num_threads() << " threads)";
+    vector_io::drop_zero_rows(vd, zero_rows);
+    return vd;
+}
+
+// text vectors from a sequential, typically gzip or zstd compressed, file.
+// A reader thread decompresses into a ring of blocks of complete lines (see
+// line_block_reader) while the thread pool parses the previous block
+// straight into the matrix, which is reserved from the header. The load
+// takes about as long as the slower of decompression and parsing.
+vector_data read_compressed_vector_data(std::string file_name,
+                                        size_t max_word_len,
+                                        bool normalize = false)
+{
+    cl_timer<> cluster_start("read_compressed_vector_data");
+    LOG_INFO << "Streaming word vector data from " << file_name << " ("
+             << compressed_input::name(compressed_input::detect(file_name))
+             << ")";
+    auto load_start = watch::now();
+    vector_data vd;
+    line_block_reader reader(compressed_input::open(file_name));
+    const char* begin;
+    const char* end;
+    if (!reader.next(begin, end))
+        throw std::runtime_error("missing header line in " + file_name);
+    int rows;
+    int cols;
+    begin = vector_io::parse_header(begin, end, file_name, rows, cols);
+    std::cout << "rows = " << rows << " cols = " << cols << std::endl;
+    vd.dat.reserve(size_t(std::max(rows, 0)) * size_t(std::max(cols, 0)));
+
+    size_t total_lines = 0;
+    size_t zero_rows = 0;
+    do {
+        total_lines += vector_io::parse_text_lines(begin,
+                                                   end,
+                                                   max_word_len,
+                                                   cols,
+                                                   vd.dat,
+                                                   vd.word_str,
+                                                   normalize ? &zero_rows
+                                                             : nullptr);
+    } while (reader.next(begin, end));
+    vd.num_samples = vd.word_str.size();
+    vd.num_features = cols;
+
+    size_t skipped_words = total_lines - vd.num_samples;
+    LOG_INFO << "skipped words = " << skipped_words << " ("
+             << float(skipped_words) / float(rows) * 100.0 << "%)";
+    double secs = duration_cast<duration<double>>(watch::now() - load_start)
+                      .count();
+    LOG_INFO << "load throughput = "
+             << (double(reader.bytes()) / (1024 * 1024)) / secs
+             << " MiB/s uncompressed (" << parallel::num_threads()
+             << " threads)";
+    LOG_INFO << "waits: parser " << reader.consumer_wait_secs()
+             << " sec for input, reader " << reader.reader_wait_secs()
+             << " sec for free blocks";
+    vector_io::drop_zero_rows(vd, zero_rows);
+    return vd;
+}
+
+// reads the binary word2vec format: "rows cols\n" followed by rows records
+// of "<word> " and cols raw little-endian floats, optionally followed by
+// '\n'. Record boundaries are found in one sequential pass, the rows are
+// then copied in parallel.
+vector_data read_word2vec_bin(
+    std::string file_name, size_t max_word_len, bool normalize = false)
+{
+    cl_timer<> cluster_start("read_word2vec_bin");
+    LOG_INFO << "Loading word2vec binary data from " << file_name;
+    auto load_start = watch::now();
+    vector_data vd;
+    mmap_file f(file_name);
+    f.advise_sequential();
+    const char* file_end = f.data() + f.size();
+    int rows;
+    int cols;
+    const char* cur
+        = vector_io::parse_header(f.data(), file_end, file_name, rows, cols);
+    std::cout << "rows = " << rows << " cols = " << cols << std::endl;
+
+    struct record {
+        const char* word;
+        size_t word_len;
+        size_t word_end;
+        const char* floats;
+    };
+    std::vector<record> kept;
+    kept.reserve(rows);
+    size_t row_bytes = size_t(cols) * sizeof(float);
+    size_t skipped_words = 0;
+    size_t word_bytes = 0;
+    for (int r = 0; r < rows; r++) {
+        while (cur < file_end && (*cur == '\n' || *cur == '\r'))
+            cur++;
+        auto sp = (const char*)memchr(cur, ' ', file_end - cur);
+        if (sp == nullptr || size_t(file_end - (sp + 1)) < row_bytes)
+            throw std::runtime_error("truncated word2vec file " + file_name);
+        size_t word_len = sp - cur;
+        if (word_len > max_word_len) {
+            skipped_words++;
+        } else {
+            word_bytes += word_len + 1;
+            kept.push_back({ cur, word_len, word_bytes, sp + 1 });
+        }
+        cur = sp + 1 + row_bytes;
+    }
+    vd.num_samples = kept.size();
+    vd.num_features = cols;
+    vd.dat.resize(vd.num_samples * vd.num_features);
+    vd.word_str.resize(vd.num_samples, word_bytes);
+    char* arena = vd.word_str.arena_data();
+    uint64_t* offsets = vd.word_str.offset_data();
+    std::vector<size_t> zero(parallel::num_threads(), 0);
+    parallel::parallel_for(
+        0, kept.size(), [&](size_t b, size_t e, size_t slot) {
+            for (size_t i = b; i < e; i++) {
+                float* row = vd.dat.data() + i * vd.num_features;
+                memcpy(row, kept[i].floats, row_bytes);
+                if (normalize
+                    && !vector_io::normalize_row(row, vd.num_features))
+                    zero[slot]++;
+                char* w = arena + kept[i].word_end - kept[i].word_len - 1;
+                memcpy(w, kept[i].word, kept[i].word_len);
+                w[kept[i].word_len] = '\0';
+                offsets[i + 1] = kept[i].word_end;
+            }
+        });
+
+    LOG_INFO << "skipped words = " << skipped_words << " ("
+             << float(skipped_words) / float(rows) * 100.0 << "%)";
+    double secs = duration_cast<duration<double>>(watch::now() - load_start)
+                      .count();
+    LOG_INFO << "load throughput = "
+             << (double(f.size()) / (1024 * 1024)) / secs << " MiB/s ("
+             << parallel::num_threads() << " threads)";
+    vector_io::drop_zero_rows(
+        vd, std::accumulate(zero.begin(), zero.end(), size_t(0)));
+    return vd;
+}
+
+namespace vector_io {
+
+// resolves format "auto": cache for files with the cache magic, bin for
+// *.bin files and text otherwise
+inline std::string detect_format(const std::string& file_name,
+                                 const std::string& format)
+{
+    if (format != "auto")
+        return format;
+    auto ends_with = [](const std::string& s, const std::string& suffix) {
+        return s.size() >= suffix.size()
+            && s.compare(s.size() - suffix.size(), suffix.size(), suffix)
+            == 0;
+    };
+    if (vector_cache::is_cache_file(file_name))
+        return "cache";
+    std::string plain_name = file_name;
+    for (std::string ext : { ".gz", ".zst" }) {
+        if (ends_with(plain_name, ext))
+            plain_name.resize(plain_name.size() - ext.size());
+    }
+    if (ends_with(plain_name, ".bin"))
+        return "bin";
+    return "text";
+}
+}
+
+// format is one of text, bin, cache or auto (see vector_io::detect_format).
+// normalize L2-normalises every row (fused into parsing for text and bin)
+// and drops near-zero rows.
+vector_data load_vector_data(std::string file_name,
+                             std::string format,
+                             size_t max_word_len,
+                             bool normalize = false)
+{
+    if (format == "auto") {
+        format = vector_io::detect_format(file_name, format);
+        LOG_INFO << "input format = " << format;
+    }
+    if (format == "cache") {
+        auto vd = vector_cache::read(file_name, max_word_len);
+        if (normalize) {
+            size_t zero_rows;
+            {
+                cl_timer<> norm_timer("normalize rows");
+                zero_rows = vector_io::normalize_rows(
+                    vd.data(), vd.num_samples, vd.num_features);
+            }
+            vector_io::drop_zero_rows(vd, zero_rows);
+        }
+        return vd;
+    }
+    // text may be compressed, the other formats are mapped
+    bool compressed = compressed_input::detect(file_name)
+        != compressed_input::compression::none;
+    if (compressed && format != "text")
+        throw std::runtime_error(
+            "only text vector files can be read compressed: " + file_name);
+    if (format == "bin")
+        return read_word2vec_bin(file_name, max_word_len, normalize);
+    if (format == "text" && compressed)
+        return read_compressed_vector_data(
+            file_name, max_word_len, normalize);
+    if (format == "text")
+        return read_vector_data(file_name, max_word_len, normalize);
+    throw std::runtime_error("unknown input format " + format);
+}
+
+// shard of num_shards of the rows for a distributed run: text files are
+// split by byte range (see read_vector_data()), caches by row range, so a
+// worker only reads or maps in its own part of the file.
+vector_data load_vector_shard(std::string file_name,
+                              std::string format,
+                              size_t max_word_len,
+                              size_t shard,
+                              size_t num_shards,
+                              bool normalize = false)
+{
+    format = vector_io::detect_format(file_name, format);
+    LOG_INFO << "input format = " << format;
+    if (compressed_input::detect(file_name)
+        != compressed_input::compression::none)
+        throw std::runtime_error("distributed runs split the input by byte "
+                                 "range and need it uncompressed: "
+            + file_name);
+    if (format == "text")
+        return read_vector_data(
+            file_name, max_word_len, normalize, shard, num_shards);
+    if (format != "cache")
+        throw std::runtime_error(
+            "distributed runs read text or cache files, not " + format);
+    auto vd = vector_cache::read(file_name, max_word_len);
+    size_t b = vd.num_samples * shard / num_shards;
+    size_t e = vd.num_samples * (shard + 1) / num_shards;
+    LOG_INFO << "shard " << shard << " of " << num_shards << ": rows " << b
+             << " to " << e;
+    vd.word_str = vd.word_str.slice(b, e);
+    vd.mapped += b * vd.num_features;
+    vd.num_samples = e - b;
+    if (normalize) {
+        size_t zero_rows = vector_io::normalize_rows(
+            vd.data(), vd.num_samples, vd.num_features);
+        vector_io::drop_zero_rows(vd, zero_rows);
+    }
+    return vd;
+}
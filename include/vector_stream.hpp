@@ -0,0 +1,274 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "compressed_input.hpp"
+#include "logging.hpp"
+#include "mmap_file.hpp"
+#include "vector_cache.hpp"
+#include "vector_io.hpp"
+#include "word_table.hpp"
+
+//
+// Sequential batch readers over the supported vector formats. Unlike
+// load_vector_data() they never hold more than one read block plus the
+// requested batch in memory, so they work for files larger than RAM.
+//
+
+class vector_stream {
+public:
+    virtual ~vector_stream() = default;
+    size_t num_features() const { return cols; }
+    // row count announced by the file header
+    size_t header_rows() const { return rows; }
+    // replaces rows/words with up to max_rows rows. returns 0 at the end.
+    virtual size_t next_batch(size_t max_rows,
+                              std::vector<float>& batch_rows,
+                              word_table& batch_words)
+        = 0;
+    virtual void rewind() = 0;
+
+protected:
+    size_t rows = 0;
+    size_t cols = 0;
+};
+
+// text format, plain or compressed, read in large blocks that are parsed on
+// all threads
+class text_vector_stream : public vector_stream {
+public:
+    text_vector_stream(const std::string& file_name,
+                       size_t max_word_len,
+                       size_t block_bytes = size_t(64) << 20)
+        : name(file_name)
+        , max_len(max_word_len)
+        , block(block_bytes)
+    {
+        rewind();
+    }
+
+    void rewind() override
+    {
+        src = compressed_input::open(name);
+        std::string header;
+        char ch;
+        while (src->read(&ch, 1) == 1 && ch != '\n')
+            header.push_back(ch);
+        header.push_back('\n');
+        int r, c;
+        vector_io::parse_header(
+            header.data(), header.data() + header.size(), name, r, c);
+        rows = r;
+        cols = c;
+        carry.clear();
+        pending_rows.clear();
+        pending_words.clear();
+        pending_pos = 0;
+        eof = false;
+    }
+
+    size_t next_batch(size_t max_rows,
+                      std::vector<float>& batch_rows,
+                      word_table& batch_words) override
+    {
+        while (pending_words.size() - pending_pos < max_rows && !eof)
+            fill();
+        size_t n = std::min(max_rows, pending_words.size() - pending_pos);
+        batch_rows.assign(pending_rows.begin() + pending_pos * cols,
+            pending_rows.begin() + (pending_pos + n) * cols);
+        batch_words = pending_words.slice(pending_pos, pending_pos + n);
+        pending_pos += n;
+        return n;
+    }
+
+private:
+    void fill()
+    {
+        // drop consumed rows before parsing the next block
+        pending_rows.erase(
+            pending_rows.begin(), pending_rows.begin() + pending_pos * cols);
+        pending_words
+            = pending_words.slice(pending_pos, pending_words.size());
+        pending_pos = 0;
+
+        std::vector<char> buf(std::move(carry));
+        size_t have = buf.size();
+        buf.resize(have + block);
+        size_t got = src->read(buf.data() + have, block);
+        buf.resize(have + got);
+        eof = got < block;
+        const char* begin = buf.data();
+        const char* end = buf.data() + buf.size();
+        const char* last = end;
+        if (!eof) {
+            while (last > begin && last[-1] != '\n')
+                last--;
+        }
+        vector_io::parse_text_lines(
+            begin, last, max_len, cols, pending_rows, pending_words);
+        carry.assign(last, end);
+    }
+
+    std::string name;
+    size_t max_len;
+    size_t block;
+    std::unique_ptr<compressed_input::byte_source> src;
+    bool eof = false;
+    std::vector<char> carry;
+    std::vector<float> pending_rows;
+    word_table pending_words;
+    size_t pending_pos = 0;
+};
+
+// word2vec binary format, read record by record through stdio buffering
+class bin_vector_stream : public vector_stream {
+public:
+    bin_vector_stream(const std::string& file_name, size_t max_word_len)
+        : name(file_name)
+        , max_len(max_word_len)
+    {
+        rewind();
+    }
+    ~bin_vector_stream()
+    {
+        if (f)
+            fclose(f);
+    }
+
+    void rewind() override
+    {
+        if (f)
+            fclose(f);
+        f = fopen(name.c_str(), "rb");
+        if (f == nullptr)
+            throw std::runtime_error("cannot open " + name);
+        setvbuf(f, nullptr, _IOFBF, 1 << 22);
+        int r = 0, c = 0;
+        if (fscanf(f, "%d %d", &r, &c) != 2)
+            throw std::runtime_error("missing header line in " + name);
+        rows = r;
+        cols = c;
+        remaining = rows;
+        row_buf.resize(cols);
+    }
+
+    size_t next_batch(size_t max_rows,
+                      std::vector<float>& batch_rows,
+                      word_table& batch_words) override
+    {
+        batch_rows.clear();
+        batch_words.clear();
+        std::string word;
+        while (batch_words.size() < max_rows && remaining > 0) {
+            int ch;
+            while ((ch = getc_unlocked(f)) == '\n' || ch == '\r' || ch == ' ')
+                ;
+            word.clear();
+            while (ch != ' ' && ch != EOF) {
+                word.push_back(char(ch));
+                ch = getc_unlocked(f);
+            }
+            if (ch == EOF
+                || fread(row_buf.data(), sizeof(float), cols, f) != cols)
+                throw std::runtime_error("truncated word2vec file " + name);
+            remaining--;
+            if (word.size() > max_len)
+                continue;
+            batch_words.push_back(word);
+            batch_rows.insert(batch_rows.end(), row_buf.begin(), row_buf.end());
+        }
+        return batch_words.size();
+    }
+
+private:
+    std::string name;
+    size_t max_len;
+    FILE* f = nullptr;
+    size_t remaining = 0;
+    std::vector<float> row_buf;
+};
+
+// vector cache, walked through the mapping
+class cache_vector_stream : public vector_stream {
+public:
+    explicit cache_vector_stream(const std::string& file_name)
+        : map(file_name)
+    {
+        if (map.size() < sizeof(vector_cache::header))
+            throw std::runtime_error("truncated vector cache " + file_name);
+        memcpy(&h, map.data(), sizeof(h));
+        if (memcmp(h.magic, vector_cache::magic, sizeof(h.magic)) != 0
+            || h.version < 1 || h.version > vector_cache::version)
+            throw std::runtime_error("unsupported vector cache " + file_name);
+        if (h.words_offset + h.words_bytes > map.size())
+            throw std::runtime_error("truncated vector cache " + file_name);
+        rows = h.num_samples;
+        cols = h.num_features;
+        if (h.version >= 2)
+            words.attach(map.data() + h.words_offset, h.words_bytes);
+        map.advise_sequential();
+        rewind();
+    }
+
+    void rewind() override
+    {
+        next_row = 0;
+        next_word = map.data() + h.words_offset;
+    }
+
+    size_t next_batch(size_t max_rows,
+                      std::vector<float>& batch_rows,
+                      word_table& batch_words) override
+    {
+        size_t n = std::min<size_t>(max_rows, rows - next_row);
+        auto data = reinterpret_cast<const float*>(map.data() + h.data_offset);
+        batch_rows.assign(
+            data + next_row * cols, data + (next_row + n) * cols);
+        if (h.version >= 2) {
+            batch_words = words.slice(next_row, next_row + n);
+        } else {
+            batch_words.clear();
+            for (size_t i = 0; i < n; i++) {
+                size_t len = strlen(next_word);
+                batch_words.push_back(next_word, len);
+                next_word += len + 1;
+            }
+        }
+        next_row += n;
+        return n;
+    }
+
+private:
+    mmap_file map;
+    vector_cache::header h;
+    word_table words;
+    size_t next_row = 0;
+    const char* next_word = nullptr;
+};
+
+inline std::unique_ptr<vector_stream> open_vector_stream(
+    const std::string& file_name, std::string format, size_t max_word_len)
+{
+    format = vector_io::detect_format(file_name, format);
+    LOG_INFO << "streaming " << file_name << " (format = " << format << ")";
+    if (format != "text"
+        && compressed_input::detect(file_name)
+            != compressed_input::compression::none)
+        throw std::runtime_error(
+            "only text vector files can be read compressed: " + file_name);
+    if (format == "cache")
+        return std::unique_ptr<vector_stream>(
+            new cache_vector_stream(file_name));
+    if (format == "bin")
+        return std::unique_ptr<vector_stream>(
+            new bin_vector_stream(file_name, max_word_len));
+    if (format == "text")
+        return std::unique_ptr<vector_stream>(
+            new text_vector_stream(file_name, max_word_len));
+    throw std::runtime_error("unknown input format " + format);
+}
@@ -0,0 +1,435 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "parallel.hpp"
+
+//
+// Words of a vector file in row order, kept in one arena: word i is the
+// '\0'-terminated string at arena + offsets[i], offsets[i + 1] - offsets[i]
+// - 1 chars long. This replaces one heap allocation per word.
+//
+// build_index() adds a perfect hash from word to row (hash and displace as
+// in PTHash: the words are hashed into buckets of ~4 and every bucket gets
+// a pilot value that moves all its words to free slots of a table slightly
+// larger than the word count). A lookup is two table reads and one string
+// comparison; the index costs ~5 bytes per word. Duplicate words resolve
+// to their first row.
+//
+// A table either owns its storage or views a serialised table (write(),
+// attach()) inside a mapped file, e.g. a vector cache.
+//
+
+namespace word_hash {
+
+// splitmix64 finaliser
+inline uint64_t mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// seeded FNV-1a
+inline uint64_t hash(const char* s, size_t len, uint64_t seed)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ mix(seed);
+    for (size_t i = 0; i < len; i++) {
+        h ^= uint8_t(s[i]);
+        h *= 0x100000001b3ULL;
+    }
+    return mix(h);
+}
+}
+
+class word_table {
+public:
+    static const uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+    word_table()
+        : offset_store(1, 0)
+    {
+    }
+
+    size_t size() const { return num_words; }
+    bool empty() const { return num_words == 0; }
+    const char* c_str(size_t i) const { return arena() + offsets()[i]; }
+    size_t length(size_t i) const
+    {
+        return offsets()[i + 1] - offsets()[i] - 1;
+    }
+    std::string str(size_t i) const { return std::string(c_str(i), length(i)); }
+    // arena size including the terminators
+    size_t bytes() const { return offsets()[num_words]; }
+    bool is_view() const { return arena_view != nullptr; }
+
+    void clear() { *this = word_table(); }
+    void reserve(size_t words, size_t arena_bytes)
+    {
+        make_owned();
+        offset_store.reserve(words + 1);
+        arena_store.reserve(arena_bytes);
+    }
+    void push_back(const char* w, size_t len)
+    {
+        make_owned();
+        arena_store.insert(arena_store.end(), w, w + len);
+        arena_store.push_back('\0');
+        offset_store.push_back(arena_store.size());
+        num_words++;
+        drop_index();
+    }
+    void push_back(const std::string& w) { push_back(w.data(), w.size()); }
+
+    // grows the table to n words and arena_bytes; the caller fills in the
+    // new words through arena_data() and offset_data() (offset_data()[i + 1]
+    // is the end of word i including its terminator)
+    void resize(size_t n, size_t arena_bytes)
+    {
+        make_owned();
+        offset_store.resize(n + 1);
+        arena_store.resize(arena_bytes);
+        num_words = n;
+        drop_index();
+    }
+    char* arena_data()
+    {
+        make_owned();
+        return arena_store.data();
+    }
+    uint64_t* offset_data()
+    {
+        make_owned();
+        return offset_store.data();
+    }
+
+    // owned copy of words [b,e)
+    word_table slice(size_t b, size_t e) const
+    {
+        word_table out;
+        uint64_t base = offsets()[b];
+        out.resize(e - b, offsets()[e] - base);
+        memcpy(out.arena_store.data(), arena() + base, offsets()[e] - base);
+        for (size_t i = b; i < e; i++)
+            out.offset_store[i - b + 1] = offsets()[i + 1] - base;
+        return out;
+    }
+
+    // keeps the words with keep[i] != 0, in order
+    void compact(const std::vector<char>& keep)
+    {
+        word_table out;
+        out.reserve(num_words, bytes());
+        for (size_t i = 0; i < num_words; i++) {
+            if (keep[i])
+                out.push_back(c_str(i), length(i));
+        }
+        *this = std::move(out);
+    }
+
+    bool has_index() const { return idx.built; }
+
+    void build_index() { idx = make_index(); }
+
+    // row of word w, or npos. build_index() must have been called.
+    uint32_t find(const char* w, size_t len) const
+    {
+        if (idx.num_slots == 0)
+            return npos;
+        uint64_t h = word_hash::hash(w, len, idx.seed);
+        uint32_t id = idx.slots()[slot(h, idx.pilots()[bucket(h, idx)], idx)];
+        if (id != npos && length(id) == len && memcmp(c_str(id), w, len) == 0)
+            return id;
+        return npos;
+    }
+    uint32_t find(const std::string& w) const
+    {
+        return find(w.data(), w.size());
+    }
+
+    // serialised form, 8-byte aligned sections:
+    //   [header][offsets: (n + 1) x u64][pilots: u32][slots: u32][pad]
+    //   [arena]
+    // The index is built on the fly if the table has none.
+    struct header {
+        uint64_t num_words;
+        uint64_t arena_bytes;
+        uint64_t seed;
+        uint64_t num_buckets;
+        uint64_t num_slots;
+    };
+
+    size_t serialized_bytes() const
+    {
+        const hash_index& ix = index_for_write();
+        return layout(num_words, ix.num_buckets, ix.num_slots, bytes()).total;
+    }
+
+    bool write(FILE* f) const
+    {
+        const hash_index& ix = index_for_write();
+        header h = { num_words, bytes(), ix.seed, ix.num_buckets,
+            ix.num_slots };
+        auto l = layout(num_words, ix.num_buckets, ix.num_slots, bytes());
+        const char pad[8] = { 0 };
+        size_t pad_bytes = l.arena - l.index_end;
+        bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+            && fwrite(offsets(), sizeof(uint64_t), num_words + 1, f)
+                == num_words + 1
+            && fwrite(ix.pilots(), sizeof(uint32_t), ix.num_buckets, f)
+                == ix.num_buckets
+            && fwrite(ix.slots(), sizeof(uint32_t), ix.num_slots, f)
+                == ix.num_slots
+            && fwrite(pad, 1, pad_bytes, f) == pad_bytes
+            && (bytes() == 0 || fwrite(arena(), 1, bytes(), f) == bytes());
+        tmp_idx = hash_index();
+        return ok;
+    }
+
+    // views the table serialised at p (8-byte aligned, len bytes). p must
+    // outlive the table.
+    void attach(const char* p, size_t len)
+    {
+        header h;
+        if (len < sizeof(h))
+            throw std::runtime_error("truncated word table");
+        memcpy(&h, p, sizeof(h));
+        auto l = layout(h.num_words, h.num_buckets, h.num_slots, h.arena_bytes);
+        if (l.total > len)
+            throw std::runtime_error("truncated word table");
+        *this = word_table();
+        num_words = h.num_words;
+        offset_view = reinterpret_cast<const uint64_t*>(p + l.offsets);
+        arena_view = p + l.arena;
+        if (offset_view[num_words] != h.arena_bytes)
+            throw std::runtime_error("corrupt word table");
+        idx.seed = h.seed;
+        idx.num_buckets = h.num_buckets;
+        idx.num_slots = h.num_slots;
+        idx.pilot_view = reinterpret_cast<const uint32_t*>(p + l.pilots);
+        idx.slot_view = reinterpret_cast<const uint32_t*>(p + l.slots);
+        idx.built = true;
+    }
+
+private:
+    struct hash_index {
+        bool built = false;
+        uint64_t seed = 0;
+        uint64_t num_buckets = 0;
+        uint64_t num_slots = 0;
+        std::vector<uint32_t> pilot_store;
+        std::vector<uint32_t> slot_store;
+        const uint32_t* pilot_view = nullptr;
+        const uint32_t* slot_view = nullptr;
+        const uint32_t* pilots() const
+        {
+            return pilot_view ? pilot_view : pilot_store.data();
+        }
+        const uint32_t* slots() const
+        {
+            return slot_view ? slot_view : slot_store.data();
+        }
+    };
+
+    struct section_layout {
+        size_t offsets;
+        size_t pilots;
+        size_t slots;
+        size_t index_end;
+        size_t arena;
+        size_t total;
+    };
+
+    static size_t align8(size_t x) { return (x + 7) & ~size_t(7); }
+
+    static section_layout layout(
+        size_t n, size_t num_buckets, size_t num_slots, size_t arena_bytes)
+    {
+        section_layout l;
+        l.offsets = sizeof(header);
+        l.pilots = l.offsets + (n + 1) * sizeof(uint64_t);
+        l.slots = l.pilots + num_buckets * sizeof(uint32_t);
+        l.index_end = l.slots + num_slots * sizeof(uint32_t);
+        l.arena = align8(l.index_end);
+        l.total = l.arena + arena_bytes;
+        return l;
+    }
+
+    // average words per bucket
+    static const size_t bucket_size = 4;
+    static const size_t max_pilot = size_t(1) << 24;
+
+    static size_t bucket(uint64_t h, const hash_index& ix)
+    {
+        return size_t(((h >> 32) * ix.num_buckets) >> 32);
+    }
+    static size_t slot(uint64_t h, uint32_t pilot, const hash_index& ix)
+    {
+        return size_t(word_hash::mix(h ^ word_hash::mix(pilot)) % ix.num_slots);
+    }
+
+    const char* arena() const
+    {
+        return arena_view ? arena_view : arena_store.data();
+    }
+    const uint64_t* offsets() const
+    {
+        return offset_view ? offset_view : offset_store.data();
+    }
+
+    void drop_index()
+    {
+        if (idx.built)
+            idx = hash_index();
+    }
+
+    const hash_index& index_for_write() const
+    {
+        if (idx.built)
+            return idx;
+        if (!tmp_idx.built)
+            tmp_idx = make_index();
+        return tmp_idx;
+    }
+
+    void make_owned()
+    {
+        if (!is_view())
+            return;
+        arena_store.assign(arena_view, arena_view + offset_view[num_words]);
+        offset_store.assign(offset_view, offset_view + num_words + 1);
+        arena_view = nullptr;
+        offset_view = nullptr;
+        hash_index ix;
+        ix.built = idx.built;
+        ix.seed = idx.seed;
+        ix.num_buckets = idx.num_buckets;
+        ix.num_slots = idx.num_slots;
+        if (idx.built) {
+            ix.pilot_store.assign(idx.pilots(), idx.pilots() + idx.num_buckets);
+            ix.slot_store.assign(idx.slots(), idx.slots() + idx.num_slots);
+        }
+        idx = std::move(ix);
+    }
+
+    hash_index make_index() const
+    {
+        hash_index ix;
+        for (uint64_t seed = 0;; seed++) {
+            if (try_index(seed, ix))
+                return ix;
+        }
+    }
+
+    // false if a pilot search fails or two distinct words collide on all
+    // 64 hash bits; the caller retries with the next seed
+    bool try_index(uint64_t seed, hash_index& ix) const
+    {
+        size_t n = num_words;
+        ix = hash_index();
+        ix.built = true;
+        ix.seed = seed;
+        ix.num_buckets = n / bucket_size + 1;
+        ix.num_slots = n + n / 32 + 1;
+        std::vector<uint64_t> hashes(n);
+        parallel::parallel_for(0, n, [&](size_t b, size_t e, size_t) {
+            for (size_t i = b; i < e; i++)
+                hashes[i] = word_hash::hash(c_str(i), length(i), seed);
+        });
+
+        // words by bucket (ascending rows), buckets by descending size
+        std::vector<size_t> bucket_offsets(ix.num_buckets + 1, 0);
+        for (size_t i = 0; i < n; i++)
+            bucket_offsets[bucket(hashes[i], ix) + 1]++;
+        size_t largest = 0;
+        for (size_t b = 0; b < ix.num_buckets; b++) {
+            largest = std::max<size_t>(largest, bucket_offsets[b + 1]);
+            bucket_offsets[b + 1] += bucket_offsets[b];
+        }
+        std::vector<uint32_t> members(n);
+        {
+            std::vector<size_t> pos(
+                bucket_offsets.begin(), bucket_offsets.end() - 1);
+            for (size_t i = 0; i < n; i++)
+                members[pos[bucket(hashes[i], ix)]++] = uint32_t(i);
+        }
+        std::vector<std::vector<uint32_t>> by_size(largest + 1);
+        for (size_t b = 0; b < ix.num_buckets; b++)
+            by_size[bucket_offsets[b + 1] - bucket_offsets[b]].push_back(
+                uint32_t(b));
+
+        ix.pilot_store.assign(ix.num_buckets, 0);
+        ix.slot_store.assign(ix.num_slots, uint32_t(npos));
+        std::vector<uint32_t> keys;
+        std::vector<size_t> slots;
+        for (size_t s = largest; s > 0; s--) {
+            for (uint32_t b : by_size[s]) {
+                keys.clear();
+                for (size_t m = bucket_offsets[b]; m < bucket_offsets[b + 1];
+                     m++) {
+                    uint32_t id = members[m];
+                    bool duplicate = false;
+                    for (uint32_t k : keys) {
+                        if (hashes[k] != hashes[id])
+                            continue;
+                        if (length(k) != length(id)
+                            || memcmp(c_str(k), c_str(id), length(k)) != 0)
+                            return false;
+                        duplicate = true;
+                    }
+                    if (!duplicate)
+                        keys.push_back(id);
+                }
+                if (!place(keys, hashes, b, ix, slots))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // finds the first pilot that maps all keys of bucket b to free,
+    // distinct slots
+    static bool place(const std::vector<uint32_t>& keys,
+                      const std::vector<uint64_t>& hashes,
+                      size_t b,
+                      hash_index& ix,
+                      std::vector<size_t>& slots)
+    {
+        slots.resize(keys.size());
+        for (size_t pilot = 0; pilot < max_pilot; pilot++) {
+            bool ok = true;
+            for (size_t j = 0; ok && j < keys.size(); j++) {
+                slots[j] = slot(hashes[keys[j]], uint32_t(pilot), ix);
+                ok = ix.slot_store[slots[j]] == npos
+                    && std::find(slots.begin(), slots.begin() + j, slots[j])
+                        == slots.begin() + j;
+            }
+            if (!ok)
+                continue;
+            for (size_t j = 0; j < keys.size(); j++)
+                ix.slot_store[slots[j]] = keys[j];
+            ix.pilot_store[b] = uint32_t(pilot);
+            return true;
+        }
+        return false;
+    }
+
+    std::vector<char> arena_store;
+    std::vector<uint64_t> offset_store;
+    const char* arena_view = nullptr;
+    const uint64_t* offset_view = nullptr;
+    size_t num_words = 0;
+    hash_index idx;
+    // index of a table without one, built for serialized_bytes() / write()
+    mutable hash_index tmp_idx;
+};
@@ -0,0 +1,20 @@
+#!/bin/bash
+# runs a distributed clustering job as <workers> processes on this machine,
+# connected through a unix socket. The report of rank 0 goes to stdout, the
+# other workers log to worker.<rank>.log. Split the cores with -t.
+#
+#   run_distributed_local.sh <workers> <cluster-word-vecs.x> -b cpu -v ... -c ...
+
+WORKERS=$1
+BIN=$2
+shift 2
+SOCKET=${TMPDIR:-/tmp}/cluster-word-vecs.$$.sock
+
+for ((r = 1; r < WORKERS; r++)); do
+    $BIN "$@" --distributed unix:$SOCKET --rank $r --world-size $WORKERS \
+        &> worker.$r.log &
+done
+$BIN "$@" --distributed unix:$SOCKET --rank 0 --world-size $WORKERS
+STATUS=$?
+wait
+exit $STATUS
@@ -0,0 +1,441 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "cluster_report.hpp"
+#include "distance.hpp"
+#include "kmeans_cpu.hpp"
+#include "logging.hpp"
+#include "mmap_file.hpp"
+#include "parallel.hpp"
+#include "synthetic_data.hpp"
+#include "timing.hpp"
+#include "util.hpp"
+#include "vector_cache.hpp"
+#include "vector_io.hpp"
+
+//
+// Micro-benchmarks of the pipeline stages on synthetic word vectors (see
+// synthetic_data.hpp): parsing, loading, the distance kernels, the CPU
+// k-means kernels and the report. Every benchmark runs --repeat times and
+// the fastest run is written as one JSON line with its throughput.
+//
+
+namespace po = boost::program_options;
+
+po::variables_map parse_cmdargs(int argc, char const* argv[])
+{
+
+    po::variables_map vm;
+    po::options_description desc("Allowed options");
+    // clang-format off
+    desc.add_options()
+        ("help,h", "produce help message")
+        ("generate,g",po::value<std::string>(), "only write synthetic vectors in the text format to this file")
+        ("vec-file,v",po::value<std::string>(), "benchmark this text vector file instead of generated data")
+        ("work-dir",po::value<std::string>()->default_value("."), "directory for the generated vectors and caches")
+        ("out,o",po::value<std::string>()->default_value("bench.jsonl"), "results, one JSON line per benchmark (- = stdout, logs then go to stderr)")
+        ("filter",po::value<std::string>()->default_value(""), "run only benchmarks whose name contains this")
+        ("repeat,r",po::value<uint32_t>()->default_value(3), "runs per benchmark, the fastest is reported")
+        ("threads,t",po::value<uint32_t>()->default_value(0), "CPU threads (0 = all cores)")
+        ("rows",po::value<uint32_t>()->default_value(50000), "synthetic data: number of words")
+        ("dims",po::value<uint32_t>()->default_value(100), "synthetic data: vector dimension")
+        ("data-clusters",po::value<uint32_t>()->default_value(100), "synthetic data: number of gaussian centres")
+        ("spread",po::value<float>()->default_value(0.25f), "synthetic data: standard deviation around the centres")
+        ("word-len-mean",po::value<float>()->default_value(8.0f), "synthetic data: mean word length")
+        ("word-len-max",po::value<uint32_t>()->default_value(24), "synthetic data: longest regular word")
+        ("long-words",po::value<float>()->default_value(0.01f), "synthetic data: ratio of words longer than max-word-len")
+        ("seed",po::value<uint32_t>()->default_value(1234), "synthetic data and centroid seed")
+        ("max-word-len,w",po::value<uint32_t>()->default_value(32), "maximum word len")
+        ("clusters,c",po::value<uint32_t>()->default_value(256), "clusters of the k-means benchmarks")
+        ("tolerance",po::value<float>()->default_value(0.01f), "k-means runs: stop below this ratio of reassignments")
+        ("yinyang",po::value<float>()->default_value(0.1f), "k-means runs: yinyang groups as a ratio of clusters");
+    // clang-format on
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        if (vm.count("help")) {
+            std::cout << desc << "\n";
+            exit(EXIT_SUCCESS);
+        }
+        po::notify(vm);
+    } catch (const po::required_option& e) {
+        std::cout << desc;
+        std::cerr << "Missing required option: " << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    } catch (po::error& e) {
+        std::cout << desc;
+        std::cerr << "Error parsing options: " << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return vm;
+}
+
+synthetic_options synthetic_opts(const po::variables_map& cmdargs)
+{
+    synthetic_options opts;
+    opts.rows = cmdargs["rows"].as<uint32_t>();
+    opts.dims = cmdargs["dims"].as<uint32_t>();
+    opts.num_clusters = cmdargs["data-clusters"].as<uint32_t>();
+    opts.spread = cmdargs["spread"].as<float>();
+    opts.word_len_mean = cmdargs["word-len-mean"].as<float>();
+    opts.word_len_max = cmdargs["word-len-max"].as<uint32_t>();
+    opts.long_words = cmdargs["long-words"].as<float>();
+    opts.seed = cmdargs["seed"].as<uint32_t>();
+    return opts;
+}
+
+// discards the report but counts its bytes
+struct counting_buf : std::streambuf {
+    size_t bytes = 0;
+    std::streamsize xsputn(const char*, std::streamsize n)
+    {
+        bytes += size_t(n);
+        return n;
+    }
+    int_type overflow(int_type c)
+    {
+        bytes++;
+        return c;
+    }
+};
+
+// work of one run of a benchmark; fields that are 0 are not reported
+struct bench_work {
+    size_t rows = 0;
+    size_t bytes = 0;
+    double flops = 0.0;
+    size_t iterations = 0;
+};
+
+class bench_runner {
+public:
+    bench_runner(FILE* o, const std::string& f, size_t r)
+        : out(o)
+        , filter(f)
+        , repeat(std::max<size_t>(1, r))
+    {
+    }
+
+    // times f (returning the work done) repeat times and reports the
+    // fastest run
+    template <class t_func> void run(const std::string& name, t_func f)
+    {
+        if (name.find(filter) == std::string::npos)
+            return;
+        double best = 0.0;
+        bench_work work;
+        for (size_t r = 0; r < repeat; r++) {
+            auto start = watch::now();
+            work = f();
+            double secs = duration<double>(watch::now() - start).count();
+            if (r == 0 || secs < best)
+                best = secs;
+        }
+        report(name, work, best);
+    }
+
+private:
+    void report(const std::string& name, const bench_work& w, double secs)
+    {
+        secs = std::max(secs, 1e-9);
+        std::string line = "{\"bench\":\"" + name + "\"";
+        line += ",\"threads\":" + std::to_string(parallel::num_threads());
+        line += ",\"kernels\":\"";
+        line += distance::kernel_name();
+        line += "\"";
+        line += ",\"repeat\":" + std::to_string(repeat);
+        line += ",\"seconds\":" + std::to_string(secs);
+        if (w.iterations)
+            line += ",\"iterations\":" + std::to_string(w.iterations);
+        if (w.rows) {
+            line += ",\"rows\":" + std::to_string(w.rows);
+            line += ",\"rows_per_sec\":" + std::to_string(w.rows / secs);
+        }
+        if (w.bytes) {
+            line += ",\"bytes\":" + std::to_string(w.bytes);
+            line += ",\"mib_per_sec\":"
+                + std::to_string(w.bytes / secs / (1 << 20));
+        }
+        if (w.flops > 0.0)
+            line += ",\"gflops\":" + std::to_string(w.flops / secs / 1e9);
+        line += "}\n";
+        fputs(line.c_str(), out);
+        fflush(out);
+        LOG_INFO << "bench " << line.substr(0, line.size() - 1);
+    }
+
+    FILE* out;
+    std::string filter;
+    size_t repeat;
+};
+
+// the k-means benchmarks start from the same random rows as centroids
+std::vector<float> seed_centroids(
+    const vector_data& vd, size_t k, uint32_t seed)
+{
+    size_t d = vd.num_features;
+    std::vector<float> centroids(k * d);
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<size_t> pick(0, vd.num_samples - 1);
+    for (size_t c = 0; c < k; c++) {
+        const float* x = vd.data() + pick(rng) * d;
+        std::copy(x, x + d, centroids.data() + c * d);
+    }
+    return centroids;
+}
+
+void bench_parsing(bench_runner& bench, const std::string& vec_file,
+    size_t max_word_len)
+{
+    mmap_file text(vec_file);
+    const char* begin = text.data();
+    const char* end = begin + text.size();
+    int rows = 0, cols = 0;
+    const char* body = vector_io::parse_header(begin, end, vec_file, rows, cols);
+    size_t body_bytes = size_t(end - body);
+    size_t d = size_t(cols);
+
+    // (1) fast_atof alone: every float of every line, words skipped
+    bench.run("fast_atof", [&] {
+        bench_work w;
+        volatile double sink = 0.0;
+        double sum = 0.0;
+        for (const char* p = body; p < end; w.rows++) {
+            while (*p != ' ')
+                p++;
+            for (size_t j = 0; j < d; j++) {
+                p++;
+                sum += fast_atof(p);
+            }
+            while (*p != '\n')
+                p++;
+            p++;
+        }
+        sink = sum;
+        (void)sink;
+        w.bytes = body_bytes;
+        return w;
+    });
+
+    // (2) parse_line: words and floats, long words skipped
+    bench.run("parse_line", [&] {
+        bench_work w;
+        std::vector<char> word(max_word_len + 2);
+        std::vector<float> row(d);
+        for (const char* p = body; p < end; w.rows++)
+            p = parse_line(p, word.data(), row.data(), max_word_len, d);
+        w.bytes = body_bytes;
+        return w;
+    });
+}
+
+void bench_loading(bench_runner& bench, const std::string& vec_file,
+    const std::string& cache_file, size_t max_word_len, size_t file_bytes)
+{
+    // (1) the text loader on all threads (from the page cache after the
+    // first run)
+    bench.run("read_vector_data", [&] {
+        bench_work w;
+        auto vd = read_vector_data(vec_file, max_word_len);
+        w.rows = vd.num_samples;
+        w.bytes = file_bytes;
+        return w;
+    });
+
+    // (2) the native cache: writing it, then mapping it and touching every
+    // row
+    auto vd = read_vector_data(vec_file, max_word_len);
+    bench.run("cache_write", [&] {
+        bench_work w;
+        vector_cache::write(vd, cache_file, max_word_len);
+        w.rows = vd.num_samples;
+        w.bytes = vd.size_bytes();
+        return w;
+    });
+    bench.run("cache_read", [&] {
+        bench_work w;
+        auto cached = vector_cache::read(cache_file, max_word_len);
+        std::vector<double> sums(parallel::num_threads(), 0.0);
+        size_t d = cached.num_features;
+        parallel::parallel_for(0, cached.num_samples,
+            [&](size_t b, size_t e, size_t slot) {
+                for (size_t i = b; i < e; i++)
+                    sums[slot] += cached.data()[i * d];
+            });
+        w.rows = cached.num_samples;
+        w.bytes = cached.size_bytes();
+        return w;
+    });
+}
+
+void bench_distances(bench_runner& bench, const vector_data& vd, size_t k,
+    uint32_t seed)
+{
+    size_t d = vd.num_features;
+    size_t n = std::min<size_t>(vd.num_samples, 4096);
+    auto centroids = seed_centroids(vd, k, seed);
+    const float* x = vd.data();
+
+    // all pairs of n rows and k centroids on one thread; flops count the
+    // subtract, multiply and add (2 for dot) per dimension
+    auto all_pairs = [&](double flops_per_dim, float (*f)(const float*,
+                                                   const float*, size_t)) {
+        bench_work w;
+        volatile float sink = 0.0f;
+        float sum = 0.0f;
+        for (size_t i = 0; i < n; i++)
+            for (size_t c = 0; c < k; c++)
+                sum += f(x + i * d, centroids.data() + c * d, d);
+        sink = sum;
+        (void)sink;
+        w.rows = n * k;
+        w.bytes = n * k * d * sizeof(float);
+        w.flops = flops_per_dim * n * k * d;
+        return w;
+    };
+    bench.run("distance_l2_sq", [&] { return all_pairs(3.0, distance::l2_sq); });
+    bench.run("distance_dot", [&] { return all_pairs(2.0, distance::dot); });
+    bench.run("distance_sequential_l2",
+        [&] { return all_pairs(3.0, cluster_report::sequential_l2); });
+}
+
+void bench_kmeans(bench_runner& bench, const vector_data& vd, size_t k,
+    float tolerance, float yinyang, uint32_t seed)
+{
+    size_t n = vd.num_samples;
+    size_t d = vd.num_features;
+    auto seeds = seed_centroids(vd, k, seed);
+    std::vector<float> centroids(seeds);
+    std::vector<uint32_t> assignments(n);
+    kmeans_cpu_engine engine(kmcudaDistanceMetricL2, n, d, k, 0, vd.data(),
+        centroids.data(), assignments.data());
+
+    // (1) one assignment pass from scratch and one centroid update
+    bench.run("assign_lloyd", [&] {
+        bench_work w;
+        std::fill(assignments.begin(), assignments.end(),
+            uint32_t(kmeans_cpu_engine::unassigned));
+        engine.assign_lloyd();
+        w.rows = n;
+        w.bytes = vd.size_bytes();
+        w.flops = 3.0 * n * k * d;
+        return w;
+    });
+    bench.run("update_centroids", [&] {
+        bench_work w;
+        std::copy(seeds.begin(), seeds.end(), centroids.begin());
+        engine.update_centroids();
+        w.rows = n;
+        w.bytes = vd.size_bytes();
+        w.flops = double(n) * d;
+        return w;
+    });
+
+    // (2) complete runs from the same seeds; rows count every pass
+    auto full_run = [&](float yy) {
+        bench_work w;
+        std::copy(seeds.begin(), seeds.end(), centroids.begin());
+        kmeans_cpu_options opts;
+        opts.on_iteration = [&](const kmeans_iteration&) { w.iterations++; };
+        engine.run(tolerance, yy, opts);
+        w.rows = n * w.iterations;
+        w.bytes = vd.size_bytes() * w.iterations;
+        return w;
+    };
+    bench.run("kmeans_lloyd", [&] { return full_run(0.0f); });
+    if (yinyang > 0.0f)
+        bench.run("kmeans_yinyang", [&] { return full_run(yinyang); });
+
+    // (3) the report of the last run
+    bench.run("write_cluster_report", [&] {
+        bench_work w;
+        counting_buf buf;
+        std::ostream os(&buf);
+        write_cluster_report(os, n, d, k, vd.data(), centroids.data(),
+            assignments.data(), vd.word_str);
+        w.rows = n;
+        w.bytes = buf.bytes;
+        return w;
+    });
+}
+
+int main(int argc, char const* argv[])
+{
+    logging::init();
+
+    auto cmdargs = parse_cmdargs(argc, argv);
+    parallel::set_num_threads(cmdargs["threads"].as<uint32_t>());
+    auto gen_opts = synthetic_opts(cmdargs);
+    uint32_t seed = cmdargs["seed"].as<uint32_t>();
+    size_t max_word_len = cmdargs["max-word-len"].as<uint32_t>();
+
+    // (0) the results. With --out - they keep stdout to themselves: the
+    // logs, timers and loader messages that print there go to stderr.
+    auto out_name = cmdargs["out"].as<std::string>();
+    FILE* out = nullptr;
+    if (out_name == "-") {
+        std::cout.flush();
+        fflush(stdout);
+        int fd = dup(STDOUT_FILENO);
+        if (fd >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) >= 0)
+            out = fdopen(fd, "w");
+    } else if (!cmdargs.count("generate")) {
+        out = fopen(out_name.c_str(), "w");
+    }
+    if (out == nullptr && !cmdargs.count("generate")) {
+        std::cerr << "cannot create " << out_name << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (cmdargs.count("generate")) {
+        auto file_name = cmdargs["generate"].as<std::string>();
+        cl_timer<> gen_timer("generate " + file_name);
+        size_t bytes = write_synthetic_text(file_name, gen_opts);
+        LOG_INFO << "wrote " << gen_opts.rows << " x " << gen_opts.dims
+                 << " vectors, " << bytes << " bytes";
+        return EXIT_SUCCESS;
+    }
+
+    // (1) input data
+    auto work_dir = cmdargs["work-dir"].as<std::string>();
+    std::string vec_file = work_dir + "/bench_vectors.txt";
+    bool generated = !cmdargs.count("vec-file");
+    if (generated) {
+        cl_timer<> gen_timer("generate " + vec_file);
+        write_synthetic_text(vec_file, gen_opts);
+    } else {
+        vec_file = cmdargs["vec-file"].as<std::string>();
+    }
+    std::string cache_file = work_dir + "/bench_vectors.cache";
+    size_t file_bytes = mmap_file(vec_file).size();
+
+    bench_runner bench(out, cmdargs["filter"].as<std::string>(),
+        cmdargs["repeat"].as<uint32_t>());
+
+    // (2) stages in pipeline order
+    bench_parsing(bench, vec_file, max_word_len);
+    bench_loading(bench, vec_file, cache_file, max_word_len, file_bytes);
+    auto vd = read_vector_data(vec_file, max_word_len);
+    size_t k = std::min<size_t>(cmdargs["clusters"].as<uint32_t>(),
+        vd.num_samples / 2);
+    bench_distances(bench, vd, k, seed);
+    bench_kmeans(bench, vd, k, cmdargs["tolerance"].as<float>(),
+        cmdargs["yinyang"].as<float>(), seed);
+
+    fclose(out);
+    unlink(cache_file.c_str());
+    if (generated)
+        unlink(vec_file.c_str());
+    return EXIT_SUCCESS;
+}
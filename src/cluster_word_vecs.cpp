@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdint>
 #include <experimental/string_view>
 #include <fstream>
@@ -9,104 +10,30 @@
 #include <vector>
 
 #include "kmcuda.h"
+#include "kmeans_cpu.hpp"
+#include "checkpoint.hpp"
 
 #include <boost/program_options/parsers.hpp>
 #include <boost/program_options/variables_map.hpp>
-#include <boost/progress.hpp>
 
 #include "logging.hpp"
 #include "timing.hpp"
 #include "util.hpp"
+#include "vector_io.hpp"
+#include "vector_stream.hpp"
+#include "minibatch_kmeans.hpp"
+#include "hierarchical_kmeans.hpp"
+#include "kmeans_split.hpp"
+#include "kmeans_incremental.hpp"
+#include "kmeans_pq.hpp"
+#include "kmeans_distributed.hpp"
+#include "cluster_report.hpp"
+#include "cluster_file.hpp"
+#include "cluster_quality.hpp"
+#include "half.hpp"
 
 namespace po = boost::program_options;
 
-struct vector_data {
-    std::vector<float> dat;
-    size_t num_samples = 0;
-    size_t num_features = 0;
-    std::vector<std::string> word_str;
-};
-
-const char* parse_line(const char* cur_line,
-                       char* word_buf,
-                       float* float_data,
-                       size_t max_word_len,
-                       size_t cols)
-{
-    const char* tmp = cur_line;
-    /* extract word token */
-    size_t word_len = 0;
-    while (*tmp != ' ') {
-        word_buf[word_len++] = *tmp++;
-    }
-    word_buf[word_len] = 0;
-    tmp++;
-    if (word_len > max_word_len) {
-        while (*tmp != '\n')
-            ++tmp;
-    } else {
-        for (size_t i = 0; i < cols; i++) {
-            *float_data++ = (float)fast_atof(tmp);
-        }
-    }
-    while (*tmp != '\n')
-        tmp++;
-    return ++tmp;
-}
-
-vector_data read_vector_data(std::string file_name, size_t max_word_len)
-{
-    cl_timer<> cluster_start("read_vector_data");
-    LOG_INFO << "Loading word vector data from " << file_name;
-    vector_data vd;
-    FILE* f = fopen(file_name.c_str(), "r");
-    // Determine file size
-    fseek(f, 0, SEEK_END);
-    size_t size = ftell(f);
-    char* file_data = new char[size + 1];
-    rewind(f);
-    {
-        cl_read_timer<> cluster_start("fread vector data file", size);
-        fread(file_data, sizeof(char), size, f);
-    }
-    file_data[size] = 0;
-    fclose(f);
-
-    const char* cur_line = file_data;
-    int rows;
-    int cols;
-    sscanf(cur_line, "%d %d\n", &rows, &cols);
-    float* float_data = new float[cols + 1];
-    char word_buf[1024] = { 0 };
-    while (*cur_line != '\n')
-        cur_line++;
-    cur_line++;
-    boost::progress_display pd(rows);
-    size_t skipped_words = 0;
-    vd.dat.reserve(rows * cols);
-    std::cout << "rows = " << rows << " cols = " << cols << std::endl;
-    auto prev_line = (const char*)file_data;
-    while (*cur_line != 0) {
-        prev_line = cur_line;
-        cur_line
-            = parse_line(cur_line, word_buf, float_data, max_word_len, cols);
-        if (strlen(word_buf) > max_word_len) {
-            skipped_words++;
-            ++pd;
-            continue;
-        }
-        vd.word_str.emplace_back(word_buf);
-        vd.dat.insert(vd.dat.end(), float_data, float_data + cols);
-        ++pd;
-        vd.num_samples++;
-    }
-    LOG_INFO << "skipped words = " << skipped_words << " ("
-             << float(skipped_words) / float(rows) * 100.0 << "%)";
-    vd.num_features = cols;
-    delete[] float_data;
-    return vd;
-}
-
 po::variables_map parse_cmdargs(int argc, char const* argv[])
 {
 
@@ -116,9 +43,51 @@ po::variables_map parse_cmdargs(int argc, char const* argv[])
     desc.add_options()
         ("help,h", "produce help message")
         ("vec-file,v",po::value<std::string>()->required(), "word vector file")
-        ("clusters,c",po::value<uint32_t>()->required(), "desired number of clusters")
+        ("clusters,c",po::value<std::string>(), "desired number of clusters, or a sweep: a list (1000,4000) and/or ranges (1000:8000:1000, 1000:32000:x2)")
+        ("sweep-prefix",po::value<std::string>(), "multi-k sweep: write <prefix>.k<k>.txt reports and <prefix>.k<k>.json quality metrics")
         ("max-word-len,w",po::value<uint32_t>()->default_value(32), "maximum word len")
-        ("device-list,d",po::value<std::string>()->required(), "GPU list: 0,1,2 ");
+        ("input-format,f",po::value<std::string>()->default_value("auto"), "vector file format: auto|text|bin|cache")
+        ("write-cache",po::value<std::string>(), "write the loaded vectors to this cache file")
+        ("backend,b",po::value<std::string>()->default_value("cuda"), "clustering backend: cpu|cuda")
+        ("threads,t",po::value<uint32_t>()->default_value(0), "CPU threads (0 = all cores)")
+        ("init,i",po::value<std::string>()->default_value("kmeans++"), "centroid init: kmeans++|kmeans|||afkmc2|random")
+        ("init-oversampling",po::value<double>()->default_value(1.0), "kmeans||: candidates per round as a multiple of k")
+        ("init-rounds",po::value<uint32_t>()->default_value(5), "kmeans||: sampling rounds")
+        ("afkmc2-m",po::value<uint32_t>()->default_value(200), "afkmc2: markov chain length")
+        ("device-list,d",po::value<std::string>(), "GPU list: 0,1,2 (cuda backend)")
+        ("checkpoint",po::value<std::string>(), "checkpoint file for centroids/assignments")
+        ("checkpoint-interval",po::value<uint32_t>()->default_value(30), "minutes between checkpoints (cpu backend)")
+        ("resume", "resume from the checkpoint file")
+        ("fp16", "cluster half precision (half2) copies of the vectors")
+        ("fp16-baseline", "fp16: also cluster the float rows from the same seeds and report the inertia change")
+        ("metrics-out",po::value<std::string>(), "write phase timings and per-iteration metrics to this file")
+        ("metrics-format",po::value<std::string>()->default_value("auto"), "metrics file format: auto|jsonl|csv")
+        ("metric",po::value<std::string>()->default_value("euclidean"), "distance metric: euclidean|cosine (rows are L2-normalised while loading)")
+        ("tolerance",po::value<float>()->default_value(0.002f), "stop below this ratio of reassignments")
+        ("yinyang",po::value<float>()->default_value(0.0f), "yinyang groups as a ratio of clusters (0 = off, max 0.5)")
+        ("mode,m",po::value<std::string>()->default_value("flat"), "clustering mode: flat|minibatch|hierarchical|incremental")
+        ("minibatch-size",po::value<uint32_t>()->default_value(8192), "minibatch: rows per batch")
+        ("minibatch-epochs",po::value<uint32_t>()->default_value(3), "minibatch: passes over the vector file")
+        ("minibatch-init-size",po::value<uint32_t>()->default_value(0), "minibatch: rows used for seeding (0 = max(3k, batch))")
+        ("coarse-clusters",po::value<uint32_t>()->default_value(0), "hierarchical: number of coarse groups (0 = sqrt(k))")
+        ("refine-iterations",po::value<uint32_t>()->default_value(1), "hierarchical: global refinement passes")
+        ("refine-probes",po::value<uint32_t>()->default_value(2), "hierarchical: coarse groups searched per sample when refining")
+        ("pq-subspaces",po::value<uint32_t>()->default_value(0), "flat cpu mode: cluster product-quantised codes of this many bytes per row (0 = off)")
+        ("pq-train-size",po::value<uint32_t>()->default_value(16384), "pq: rows sampled to train the codebooks")
+        ("pq-rerank",po::value<uint32_t>()->default_value(4), "pq: closest centroids by code re-ranked exactly at the end")
+        ("pq-baseline", "pq: also cluster the float rows and report the inertia loss")
+        ("distributed",po::value<std::string>(), "run as one worker of a distributed job; rank 0 listens on unix:<socket path> or tcp:<host>:<port>")
+        ("rank",po::value<uint32_t>()->default_value(0), "distributed: id of this worker (0 seeds and writes the report)")
+        ("world-size",po::value<uint32_t>()->default_value(1), "distributed: number of workers")
+        ("seed-rows",po::value<uint32_t>()->default_value(0), "distributed: rows pooled on rank 0 for seeding (0 = max(4k, 65536))")
+        ("from-clusters",po::value<std::string>(), "incremental: report or checkpoint of an earlier run; unchanged words keep their cluster")
+        ("update-iterations",po::value<uint32_t>()->default_value(0), "incremental: warm-start Lloyd iterations after assigning new and changed words")
+        ("tree-file",po::value<std::string>(), "hierarchical: write the COARSE/PARENT tree lines to this file instead of after the report")
+        ("result-file",po::value<std::string>(), "also write the clustering to this binary cluster file (CSR index, mappable, see cluster_file.hpp)")
+        ("evaluate", "compute cluster quality (simplified silhouette, Davies-Bouldin, inertia, cluster sizes) after clustering")
+        ("evaluate-out",po::value<std::string>(), "evaluate: append the quality measures as JSON lines to this file")
+        ("evaluate-rows",po::value<uint32_t>()->default_value(65536), "evaluate: rows sampled for the silhouette (0 = all)")
+        ("evaluate-clusters",po::value<uint32_t>()->default_value(4096), "evaluate: clusters sampled for Davies-Bouldin (0 = all)");
     // clang-format on
     try {
         po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -152,13 +121,872 @@ uint32_t generate_device_mask(std::string dev_list)
     return mask;
 }
 
-float compute_euq_distance(const float* a, const float* b, size_t n)
+// seeds centroids on the host with init method init_name and logs the time
+void seed_centroids(const std::string& init_name,
+                    const po::variables_map& cmdargs,
+                    KMCUDADistanceMetric metric,
+                    size_t num_samples,
+                    size_t num_features,
+                    size_t num_clusters,
+                    uint32_t rand_seed,
+                    int32_t verbosity,
+                    const float* samples,
+                    float* centroids,
+                    int32_t fp16x2 = 0)
+{
+    auto seed_start = watch::now();
+    {
+        cl_timer<> seed_timer("seeding (" + init_name + ")");
+        if (init_name == "kmeans||" || init_name == "k-means||") {
+            kmeans_parallel_seed(metric,
+                                 num_samples,
+                                 num_features,
+                                 num_clusters,
+                                 rand_seed,
+                                 cmdargs["init-oversampling"].as<double>(),
+                                 cmdargs["init-rounds"].as<uint32_t>(),
+                                 verbosity,
+                                 samples,
+                                 centroids,
+                                 fp16x2);
+        } else {
+            uint32_t afkmc2_m = cmdargs["afkmc2-m"].as<uint32_t>();
+            kmeans_cpu_seed(kmcuda::init_methods.find(init_name)->second,
+                            &afkmc2_m,
+                            metric,
+                            num_samples,
+                            num_features,
+                            num_clusters,
+                            rand_seed,
+                            verbosity,
+                            samples,
+                            centroids,
+                            fp16x2);
+        }
+    }
+    LOG_INFO << "seeding time = "
+             << duration_cast<duration<double>>(watch::now() - seed_start)
+                    .count()
+             << " sec (init = " << init_name << ")";
+}
+
+// parses the --clusters list: comma separated counts or ranges
+// "from:to:step" (step "xN" multiplies). Returns them sorted and unique.
+std::vector<uint32_t> parse_cluster_list(const std::string& list)
+{
+    std::vector<uint32_t> ks;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty())
+            continue;
+        unsigned long from, to = 0, step = 0;
+        char step_buf[32] = { 0 };
+        int fields = sscanf(item.c_str(), "%lu:%lu:%31s", &from, &to, step_buf);
+        bool geometric = step_buf[0] == 'x';
+        if (fields == 3)
+            step = strtoul(step_buf + geometric, nullptr, 10);
+        if (fields == 1 && item.find(':') == std::string::npos) {
+            ks.push_back(uint32_t(from));
+        } else if (fields == 3 && step > geometric && from > 0) {
+            for (unsigned long k = from; k <= to;
+                 k = geometric ? k * step : k + step)
+                ks.push_back(uint32_t(k));
+        } else {
+            std::cerr << "invalid cluster count or range: " << item
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    std::sort(ks.begin(), ks.end());
+    ks.erase(std::unique(ks.begin(), ks.end()), ks.end());
+    if (ks.empty()) {
+        std::cerr << "no cluster count in " << list << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return ks;
+}
+
+// --evaluate: quality of the clustering held by eval, logged and appended
+// to --evaluate-out
+cluster_quality run_evaluation(const po::variables_map& cmdargs,
+                               const kmeans_cpu_engine& eval,
+                               size_t n,
+                               size_t d,
+                               size_t k,
+                               const uint32_t* assignments,
+                               uint32_t rand_seed)
+{
+    cluster_quality_options opts;
+    opts.sample_rows = cmdargs["evaluate-rows"].as<uint32_t>();
+    opts.sample_clusters = cmdargs["evaluate-clusters"].as<uint32_t>();
+    opts.seed = rand_seed;
+    auto q = evaluate_clusters(eval, n, d, k, assignments, opts);
+    log_cluster_quality(q);
+    if (cmdargs.count("evaluate-out")) {
+        auto file_name = cmdargs["evaluate-out"].as<std::string>();
+        std::ofstream out(file_name, std::ios::app);
+        out << "{";
+        write_quality_fields(out, q);
+        out << "}\n";
+        if (!out)
+            throw std::runtime_error("error writing " + file_name);
+    }
+    return q;
+}
+
+// flat k-means for every k of the sweep on the loaded data, smallest
+// first. The first k is seeded with the init method, every larger k starts
+// from the previous solution with its highest-error clusters split (see
+// split_clusters()). Reports and quality metrics go to per-k files.
+void run_sweep(const po::variables_map& cmdargs,
+               const std::vector<uint32_t>& cluster_list,
+               const vector_data& vec_data,
+               const std::string& init_name,
+               KMCUDADistanceMetric metric,
+               const std::string& backend,
+               uint32_t device_mask,
+               uint32_t rand_seed,
+               int32_t verbosity)
+{
+    auto prefix = cmdargs["sweep-prefix"].as<std::string>();
+    auto tolerance = cmdargs["tolerance"].as<float>();
+    auto yinyang = cmdargs["yinyang"].as<float>();
+    uint32_t afkmc2_m = cmdargs["afkmc2-m"].as<uint32_t>();
+    bool init_parallel = init_name == "kmeans||" || init_name == "k-means||";
+    size_t n = vec_data.num_samples;
+    size_t d = vec_data.num_features;
+    const float* samples = vec_data.data();
+    bool telemetry = metrics::global().enabled();
+
+    std::vector<float> prev_centroids;
+    std::vector<uint32_t> prev_assignments;
+    size_t prev_k = 0;
+    for (uint32_t k : cluster_list) {
+        LOG_INFO << "sweep: k = " << k;
+        auto k_start = watch::now();
+        std::vector<float> centroids(size_t(k) * d);
+        std::vector<uint32_t> assignments(n);
+        auto init = init_parallel
+            ? kmcudaInitMethodImport
+            : kmcuda::init_methods.find(init_name)->second;
+        kmeans_cpu_options opts;
+        opts.iteration_stats = telemetry;
+        if (telemetry) {
+            opts.on_iteration = [&](const kmeans_iteration& it) {
+                metrics::iteration_record r;
+                r.algorithm = "kmeans_cpu k=" + std::to_string(k);
+                r.iteration = it.iteration;
+                r.yinyang = it.yinyang;
+                r.converged = it.converged;
+                r.reassignments = it.reassignments;
+                r.assign_us = it.assign_us;
+                r.update_us = it.update_us;
+                r.yinyang_us = it.yinyang_us;
+                r.inertia = it.inertia;
+                r.empty_clusters = it.empty_clusters;
+                metrics::global().iteration(r);
+            };
+        }
+        std::string warm_start = init_name;
+        if (prev_k == 0) {
+            if (init_parallel || backend == "cpu") {
+                seed_centroids(init_name,
+                               cmdargs,
+                               metric,
+                               n,
+                               d,
+                               k,
+                               rand_seed,
+                               verbosity,
+                               samples,
+                               centroids.data());
+                init = kmcudaInitMethodImport;
+            }
+        } else {
+            cl_timer<> split_timer("split " + std::to_string(prev_k) + " -> "
+                + std::to_string(k) + " clusters");
+            split_clusters(metric,
+                           n,
+                           d,
+                           samples,
+                           prev_k,
+                           prev_centroids.data(),
+                           prev_assignments.data(),
+                           k,
+                           rand_seed,
+                           tolerance,
+                           centroids.data(),
+                           assignments.data());
+            init = kmcudaInitMethodImport;
+            opts.keep_assignments = true;
+            warm_start = "split k=" + std::to_string(prev_k);
+        }
+
+        KMCUDAResult res;
+        float avg_distance = 0.0;
+        {
+            cl_timer<> cluster_timer("kmeans_" + backend + " k = "
+                + std::to_string(k));
+            if (backend == "cpu") {
+                res = kmeans_cpu(init,
+                                 &afkmc2_m,
+                                 tolerance,
+                                 yinyang,
+                                 metric,
+                                 n,
+                                 d,
+                                 k,
+                                 rand_seed,
+                                 0,
+                                 verbosity,
+                                 samples,
+                                 centroids.data(),
+                                 assignments.data(),
+                                 &avg_distance,
+                                 opts);
+            } else {
+                res = kmeans_cuda(init,
+                                  &afkmc2_m,
+                                  tolerance,
+                                  yinyang,
+                                  metric,
+                                  n,
+                                  d,
+                                  k,
+                                  rand_seed,
+                                  device_mask,
+                                  -1,
+                                  0,
+                                  verbosity,
+                                  samples,
+                                  centroids.data(),
+                                  assignments.data(),
+                                  &avg_distance);
+            }
+        }
+        double secs = duration<double>(watch::now() - k_start).count();
+        LOG_INFO << "sweep: k = " << k
+                 << " status: " << kmcuda::statuses.find(res)->second;
+        if (res != kmcudaSuccess)
+            exit(EXIT_FAILURE);
+
+        kmeans_cpu_engine eval(metric,
+                               n,
+                               d,
+                               k,
+                               0,
+                               samples,
+                               centroids.data(),
+                               assignments.data());
+        double inertia = eval.inertia();
+        size_t empty = eval.count_empty_clusters();
+        LOG_INFO << "sweep: k = " << k << " inertia = " << inertia
+                 << " empty clusters = " << empty << " (" << secs << " sec)";
+        bool evaluate = cmdargs.count("evaluate") != 0;
+        cluster_quality q;
+        if (evaluate)
+            q = run_evaluation(
+                cmdargs, eval, n, d, k, assignments.data(), rand_seed);
+
+        auto base = prefix + ".k" + std::to_string(k);
+        {
+            cl_timer<> report_timer("write report k = " + std::to_string(k));
+            std::ofstream out(base + ".txt");
+            write_cluster_report(out,
+                                 n,
+                                 d,
+                                 k,
+                                 samples,
+                                 centroids.data(),
+                                 assignments.data(),
+                                 vec_data.word_str,
+                                 nullptr,
+                                 metric == kmcudaDistanceMetricCosine);
+            if (!out)
+                throw std::runtime_error("error writing " + base + ".txt");
+        }
+        std::ofstream quality(base + ".json");
+        quality << "{\"k\":" << k << ",\"num_samples\":" << n
+                << ",\"inertia\":" << inertia
+                << ",\"average_distance\":" << avg_distance
+                << ",\"empty_clusters\":" << empty
+                << ",\"seconds\":" << secs << ",\"warm_start\":\""
+                << warm_start << "\"";
+        if (evaluate) {
+            quality << ",\"quality\":{";
+            write_quality_fields(quality, q);
+            quality << "}";
+        }
+        quality << "}\n";
+        if (!quality)
+            throw std::runtime_error("error writing " + base + ".json");
+
+        prev_centroids.swap(centroids);
+        prev_assignments.swap(assignments);
+        prev_k = k;
+    }
+}
+
+// --mode incremental: the clustering of --from-clusters carried over to the
+// loaded vocabulary (see incremental_assign()), optionally refined by
+// --update-iterations Lloyd iterations that start from its centroids. Cluster
+// ids are those of the earlier run. Writes the usual report to stdout.
+void run_incremental(const po::variables_map& cmdargs,
+                     uint32_t num_clusters,
+                     vector_data& vec_data,
+                     KMCUDADistanceMetric metric,
+                     const std::string& backend,
+                     uint32_t device_mask,
+                     uint32_t rand_seed,
+                     int32_t verbosity)
+{
+    auto from_file = cmdargs["from-clusters"].as<std::string>();
+    auto iterations = cmdargs["update-iterations"].as<uint32_t>();
+    size_t n = vec_data.num_samples;
+    size_t d = vec_data.num_features;
+    const float* samples = vec_data.data();
+
+    auto previous = load_previous_clustering(from_file);
+    size_t k = previous.num_clusters;
+    LOG_INFO << "num clusters = " << k << " (from " << from_file << ")";
+    if (k == 0 || previous.num_features != d
+        || (num_clusters != 0 && num_clusters != k)) {
+        std::cerr << from_file << " does not match the vector file"
+                  << (num_clusters != 0 ? " and --clusters" : "")
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!vec_data.word_str.has_index()) {
+        cl_timer<> index_timer("build word index");
+        vec_data.word_str.build_index();
+    }
+
+    std::vector<uint32_t> assignments(n);
+    {
+        cl_timer<> assign_timer("incremental assign");
+        auto stats = incremental_assign(metric,
+                                        n,
+                                        d,
+                                        samples,
+                                        vec_data.word_str,
+                                        previous,
+                                        assignments.data());
+        LOG_INFO << "unchanged words = " << stats.kept;
+        LOG_INFO << "changed words = " << stats.changed;
+        LOG_INFO << "new words = " << stats.added;
+    }
+    std::vector<float> centroids = std::move(previous.centroids);
+
+    if (iterations > 0) {
+        cl_timer<> update_timer("kmeans_" + backend + " update");
+        auto tolerance = cmdargs["tolerance"].as<float>();
+        auto yinyang = cmdargs["yinyang"].as<float>();
+        // every word already sits at its nearest centroid, so Lloyd would
+        // stop at once: move the centroids to the means of their members
+        kmeans_cpu_engine(
+            metric, n, d, k, 0, samples, centroids.data(), assignments.data())
+            .update_centroids();
+        KMCUDAResult res;
+        if (backend == "cpu") {
+            kmeans_cpu_options opts;
+            opts.keep_assignments = true;
+            opts.max_iterations = iterations;
+            res = kmeans_cpu(kmcudaInitMethodImport,
+                             nullptr,
+                             tolerance,
+                             yinyang,
+                             metric,
+                             n,
+                             d,
+                             k,
+                             rand_seed,
+                             0,
+                             verbosity,
+                             samples,
+                             centroids.data(),
+                             assignments.data(),
+                             nullptr,
+                             opts);
+        } else {
+            LOG_WARNING << "kmeans_cuda() has no iteration limit: the update "
+                           "runs until --tolerance is reached";
+            res = kmeans_cuda(kmcudaInitMethodImport,
+                              nullptr,
+                              tolerance,
+                              yinyang,
+                              metric,
+                              n,
+                              d,
+                              k,
+                              rand_seed,
+                              device_mask,
+                              -1,
+                              0,
+                              verbosity,
+                              samples,
+                              centroids.data(),
+                              assignments.data(),
+                              nullptr);
+        }
+        LOG_INFO << "update status: " << kmcuda::statuses.find(res)->second;
+        if (res != kmcudaSuccess)
+            exit(EXIT_FAILURE);
+    }
+
+    kmeans_cpu_engine eval(
+        metric, n, d, k, 0, samples, centroids.data(), assignments.data());
+    LOG_INFO << "inertia = " << eval.inertia()
+             << " (update iterations = " << iterations << ")";
+    if (cmdargs.count("evaluate"))
+        run_evaluation(cmdargs, eval, n, d, k, assignments.data(), rand_seed);
+    bool cosine = metric == kmcudaDistanceMetricCosine;
+    auto dists = cluster_report::sample_distances(
+        n, d, samples, centroids.data(), assignments.data(), nullptr, cosine);
+    {
+        cl_timer<> report_timer("write report");
+        write_cluster_report_dists(std::cout,
+                                   n,
+                                   d,
+                                   k,
+                                   centroids.data(),
+                                   assignments.data(),
+                                   dists.data(),
+                                   vec_data.word_str);
+    }
+    if (cmdargs.count("result-file"))
+        cluster_file::write(cmdargs["result-file"].as<std::string>(),
+                            n,
+                            d,
+                            k,
+                            centroids.data(),
+                            assignments.data(),
+                            dists.data(),
+                            vec_data.word_str,
+                            cosine);
+}
+
+// --pq-subspaces: flat k-means on product-quantised codes of the rows (see
+// kmeans_pq.hpp), starting from the seeded centroids. With --pq-baseline
+// the float rows are clustered from the same seeds as well and the inertia
+// loss of the codes is logged.
+KMCUDAResult run_pq(const po::variables_map& cmdargs,
+                    vector_data& vec_data,
+                    KMCUDADistanceMetric metric,
+                    size_t num_clusters,
+                    uint32_t rand_seed,
+                    int32_t verbosity,
+                    float* centroids,
+                    uint32_t* assignments,
+                    float* average_distance)
+{
+    size_t n = vec_data.num_samples;
+    size_t d = vec_data.num_features;
+    size_t m = cmdargs["pq-subspaces"].as<uint32_t>();
+    auto tolerance = cmdargs["tolerance"].as<float>();
+    bool baseline = cmdargs.count("pq-baseline") != 0;
+    const float* samples = vec_data.data();
+    std::vector<float> seeds;
+    if (baseline)
+        seeds.assign(centroids, centroids + num_clusters * d);
+
+    product_quantizer pq;
+    {
+        cl_timer<> train_timer("pq train");
+        pq.train(samples,
+                 n,
+                 d,
+                 m,
+                 cmdargs["pq-train-size"].as<uint32_t>(),
+                 rand_seed);
+    }
+    std::vector<uint8_t> codes;
+    {
+        cl_timer<> encode_timer("pq encode");
+        codes = pq.encode_all(samples, n);
+    }
+    LOG_INFO << "pq: " << m << " subspaces, codes in MiB = "
+             << float(codes.size()) / float(1024 * 1024) << " ("
+             << float(vec_data.size_bytes()) / float(codes.size())
+             << "x smaller)";
+    LOG_INFO << "pq: mean squared quantization error = "
+             << pq.quantization_error(samples, n, codes.data());
+    // the float rows are only read again for the final re-ranking: a cache
+    // gives its pages back until then (normalised rows stay resident)
+    if (metric != kmcudaDistanceMetricCosine)
+        vec_data.drop_row_pages();
+
+    KMCUDAResult res;
+    {
+        cl_timer<> pq_timer("kmeans_pq");
+        res = kmeans_pq(pq,
+                        codes.data(),
+                        metric,
+                        n,
+                        num_clusters,
+                        tolerance,
+                        cmdargs["pq-rerank"].as<uint32_t>(),
+                        verbosity,
+                        samples,
+                        centroids,
+                        assignments);
+    }
+    if (res != kmcudaSuccess)
+        return res;
+    kmeans_cpu_engine eval(
+        metric, n, d, num_clusters, 0, samples, centroids, assignments);
+    *average_distance = float(eval.average_distance());
+    if (!baseline)
+        return res;
+
+    std::vector<uint32_t> base_assignments(n);
+    {
+        cl_timer<> base_timer("kmeans_cpu fp32 baseline");
+        res = kmeans_cpu(kmcudaInitMethodImport,
+                         nullptr,
+                         tolerance,
+                         cmdargs["yinyang"].as<float>(),
+                         metric,
+                         n,
+                         d,
+                         num_clusters,
+                         rand_seed,
+                         0,
+                         verbosity,
+                         samples,
+                         seeds.data(),
+                         base_assignments.data(),
+                         nullptr);
+    }
+    if (res != kmcudaSuccess)
+        return res;
+    double pq_inertia = eval.inertia();
+    double fp32_inertia = kmeans_cpu_engine(metric,
+                                            n,
+                                            d,
+                                            num_clusters,
+                                            0,
+                                            samples,
+                                            seeds.data(),
+                                            base_assignments.data())
+                              .inertia();
+    LOG_INFO << "pq: inertia = " << pq_inertia
+             << " fp32 inertia = " << fp32_inertia << " loss = "
+             << 100.0 * (pq_inertia - fp32_inertia) / fp32_inertia << "%";
+    return res;
+}
+
+// --fp16-baseline: clusters the float rows on the cpu from the seeds of the
+// --fp16 run and logs the inertia of both clusterings, measured on the
+// float rows, and the relative change
+void run_fp16_baseline(const po::variables_map& cmdargs,
+                       const vector_data& vec_data,
+                       KMCUDADistanceMetric metric,
+                       size_t num_clusters,
+                       uint32_t rand_seed,
+                       int32_t verbosity,
+                       std::vector<float> seeds,
+                       float* fp16_centroids,
+                       uint32_t* fp16_assignments)
 {
-    float dist = 0.0f;
-    for (size_t i = 0; i < n; i++) {
-        dist += (a[i] - b[i]) * (a[i] - b[i]);
+    size_t n = vec_data.num_samples;
+    size_t d = vec_data.num_features;
+    const float* samples = vec_data.data();
+    std::vector<uint32_t> base_assignments(n);
+    KMCUDAResult res;
+    {
+        cl_timer<> base_timer("kmeans_cpu fp32 baseline");
+        res = kmeans_cpu(kmcudaInitMethodImport,
+                         nullptr,
+                         cmdargs["tolerance"].as<float>(),
+                         cmdargs["yinyang"].as<float>(),
+                         metric,
+                         n,
+                         d,
+                         num_clusters,
+                         rand_seed,
+                         0,
+                         verbosity,
+                         samples,
+                         seeds.data(),
+                         base_assignments.data(),
+                         nullptr);
+    }
+    if (res != kmcudaSuccess) {
+        LOG_WARNING << "fp32 baseline failed: "
+                    << kmcuda::statuses.find(res)->second;
+        return;
+    }
+    double fp16_inertia = kmeans_cpu_engine(metric,
+                                            n,
+                                            d,
+                                            num_clusters,
+                                            0,
+                                            samples,
+                                            fp16_centroids,
+                                            fp16_assignments)
+                              .inertia();
+    double fp32_inertia = kmeans_cpu_engine(metric,
+                                            n,
+                                            d,
+                                            num_clusters,
+                                            0,
+                                            samples,
+                                            seeds.data(),
+                                            base_assignments.data())
+                              .inertia();
+    LOG_INFO << "fp16: inertia = " << fp16_inertia
+             << " fp32 inertia = " << fp32_inertia << " change = "
+             << 100.0 * (fp16_inertia - fp32_inertia) / fp32_inertia << "%";
+}
+
+// --distributed: this process is worker --rank of --world-size. Every
+// worker loads its shard of the vector file, rank 0 seeds the centroids on
+// rows pooled from all shards, and all run kmeans_distributed() on their
+// shard. Rank 0 gathers the assignments and writes the usual report.
+void run_distributed(const po::variables_map& cmdargs,
+                     const std::string& init_name,
+                     KMCUDADistanceMetric metric,
+                     size_t num_clusters,
+                     uint32_t rand_seed,
+                     int32_t verbosity)
+{
+    size_t rank = cmdargs["rank"].as<uint32_t>();
+    size_t world_size = cmdargs["world-size"].as<uint32_t>();
+    bool cosine = metric == kmcudaDistanceMetricCosine;
+    auto comm = make_transport(
+        cmdargs["distributed"].as<std::string>(), rank, world_size);
+    auto vec_data = load_vector_shard(cmdargs["vec-file"].as<std::string>(),
+                                      cmdargs["input-format"].as<std::string>(),
+                                      cmdargs["max-word-len"].as<uint32_t>(),
+                                      rank,
+                                      world_size,
+                                      cosine);
+    size_t n = vec_data.num_samples;
+    size_t d = vec_data.num_features;
+    const float* samples = vec_data.data();
+    double total_n = double(n);
+    comm->all_reduce_sum(&total_n, 1);
+    LOG_INFO << "rand_seed = " << rand_seed;
+    LOG_INFO << "num_features = " << d;
+    LOG_INFO << "num_samples = " << n << " of " << size_t(total_n);
+
+    std::vector<float> centroids(num_clusters * d);
+    {
+        size_t seed_rows = cmdargs["seed-rows"].as<uint32_t>();
+        if (seed_rows == 0)
+            seed_rows = std::max<size_t>(4 * num_clusters, 65536);
+        auto pooled = gather_seed_sample(
+            *comm, n, d, size_t(total_n), seed_rows, rand_seed, samples);
+        if (rank == 0) {
+            LOG_INFO << "seeding on " << pooled.size() / d << " pooled rows";
+            if (pooled.size() / d < num_clusters)
+                throw std::runtime_error("fewer rows than clusters");
+            seed_centroids(init_name,
+                           cmdargs,
+                           metric,
+                           pooled.size() / d,
+                           d,
+                           num_clusters,
+                           rand_seed,
+                           verbosity,
+                           pooled.data(),
+                           centroids.data());
+        }
+        comm->broadcast(centroids.data(), centroids.size() * sizeof(float));
+    }
+
+    std::vector<uint32_t> assignments(n);
+    KMCUDAResult res;
+    {
+        cl_timer<> cluster_timer("kmeans_distributed");
+        res = kmeans_distributed(*comm,
+                                 metric,
+                                 n,
+                                 d,
+                                 num_clusters,
+                                 cmdargs["tolerance"].as<float>(),
+                                 verbosity,
+                                 samples,
+                                 centroids.data(),
+                                 assignments.data());
+    }
+    if (rank == 0)
+        std::cout << "Status: " << kmcuda::statuses.find(res)->second
+                  << std::endl;
+    if (res != kmcudaSuccess)
+        exit(EXIT_FAILURE);
+
+    double inertia = kmeans_cpu_engine(metric,
+                                       n,
+                                       d,
+                                       num_clusters,
+                                       0,
+                                       samples,
+                                       centroids.data(),
+                                       assignments.data())
+                         .inertia();
+    comm->all_reduce_sum(&inertia, 1);
+    LOG_INFO << "inertia = " << inertia << " (init = " << init_name
+             << ", " << world_size << " workers)";
+
+    auto dists = cluster_report::sample_distances(n,
+                                                  d,
+                                                  samples,
+                                                  centroids.data(),
+                                                  assignments.data(),
+                                                  nullptr,
+                                                  cosine);
+    std::vector<uint32_t> all_assignments;
+    std::vector<float> all_dists;
+    word_table all_words;
+    gather_report(*comm,
+                  n,
+                  assignments.data(),
+                  dists.data(),
+                  vec_data.word_str,
+                  all_assignments,
+                  all_dists,
+                  all_words);
+    if (rank == 0) {
+        {
+            cl_timer<> report_timer("write report");
+            write_cluster_report_dists(std::cout,
+                                       all_assignments.size(),
+                                       d,
+                                       num_clusters,
+                                       centroids.data(),
+                                       all_assignments.data(),
+                                       all_dists.data(),
+                                       all_words);
+        }
+        if (cmdargs.count("result-file"))
+            cluster_file::write(cmdargs["result-file"].as<std::string>(),
+                                all_assignments.size(),
+                                d,
+                                num_clusters,
+                                centroids.data(),
+                                all_assignments.data(),
+                                all_dists.data(),
+                                all_words,
+                                cosine);
     }
-    return sqrt(dist);
+}
+
+// mini-batch k-means over a stream of the vector file: memory is bounded by
+// the batch size and the centroids. Writes "<cluster>: <word> <dist>" lines
+// in input order followed by the CENTROID lines.
+void run_minibatch(const po::variables_map& cmdargs,
+                   const std::string& init_name,
+                   KMCUDADistanceMetric metric,
+                   size_t num_clusters,
+                   uint32_t rand_seed,
+                   int32_t verbosity)
+{
+    auto stream = open_vector_stream(cmdargs["vec-file"].as<std::string>(),
+                                     cmdargs["input-format"].as<std::string>(),
+                                     cmdargs["max-word-len"].as<uint32_t>());
+    size_t num_features = stream->num_features();
+    size_t batch_size = cmdargs["minibatch-size"].as<uint32_t>();
+    size_t epochs = cmdargs["minibatch-epochs"].as<uint32_t>();
+    size_t init_size = cmdargs["minibatch-init-size"].as<uint32_t>();
+    if (init_size == 0)
+        init_size = std::max<size_t>(3 * num_clusters, batch_size);
+    LOG_INFO << "minibatch size = " << batch_size;
+    LOG_INFO << "minibatch epochs = " << epochs;
+    LOG_INFO << "minibatch init size = " << init_size;
+
+    minibatch_kmeans mbk(metric, num_features, num_clusters);
+    std::vector<float> rows;
+    word_table words;
+    // cosine: every batch is L2-normalised and loses its near-zero rows
+    bool cosine = metric == kmcudaDistanceMetricCosine;
+    size_t zero_rows = 0;
+    auto next_batch = [&](size_t max_rows) {
+        size_t n;
+        while ((n = stream->next_batch(max_rows, rows, words)) != 0) {
+            if (!cosine
+                || vector_io::normalize_rows(rows.data(), n, num_features)
+                    == 0)
+                return n;
+            size_t kept
+                = vector_io::drop_zero_rows(rows.data(), words, num_features);
+            zero_rows += n - kept;
+            if (kept != 0)
+                return kept;
+        }
+        return n;
+    };
+    {
+        size_t n = next_batch(init_size);
+        if (n < num_clusters) {
+            std::cerr << "not enough rows (" << n << ") to seed "
+                      << num_clusters << " clusters" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        seed_centroids(init_name,
+                       cmdargs,
+                       metric,
+                       n,
+                       num_features,
+                       num_clusters,
+                       rand_seed,
+                       verbosity,
+                       rows.data(),
+                       mbk.centroids.data());
+    }
+
+    {
+        cl_timer<> fit_timer("minibatch fit");
+        for (size_t epoch = 0; epoch < epochs; epoch++) {
+            stream->rewind();
+            size_t batches = 0;
+            size_t n;
+            double dist_sum = 0.0;
+            size_t dist_rows = 0;
+            while ((n = next_batch(batch_size)) != 0) {
+                dist_sum += mbk.step(rows.data(), n) * n;
+                dist_rows += n;
+                batches++;
+            }
+            LOG_INFO << "minibatch epoch " << epoch << ": " << batches
+                     << " batches, mean distance "
+                     << (dist_rows ? dist_sum / dist_rows : 0.0);
+        }
+    }
+
+    // final streaming assignment pass
+    cl_timer<> assign_timer("minibatch assign");
+    stream->rewind();
+    std::vector<uint32_t> assignments;
+    std::vector<float> dists;
+    double inertia = 0.0;
+    size_t total = 0;
+    size_t n;
+    zero_rows = 0;
+    while ((n = next_batch(batch_size)) != 0) {
+        mbk.assign(rows.data(), n, assignments, dists);
+        for (size_t i = 0; i < n; i++) {
+            std::cout << assignments[i] << ": " << words.c_str(i) << " "
+                      << dists[i] << "\n";
+            inertia += double(dists[i]) * double(dists[i]);
+        }
+        total += n;
+    }
+    if (zero_rows != 0)
+        LOG_WARNING << "dropped " << zero_rows
+                    << " near-zero vectors (L2 norm < " << vector_io::min_norm
+                    << ")";
+    LOG_INFO << "num_samples = " << total;
+    LOG_INFO << "inertia = " << inertia << " (init = " << init_name << ")";
+    for (size_t i = 0; i < num_clusters; i++) {
+        std::cout << "CENTROID " << i << ": ";
+        for (size_t j = 0; j < num_features; j++) {
+            std::cout << mbk.centroids[i * num_features + j] << " ";
+        }
+        std::cout << "\n";
+    }
+    std::cout.flush();
 }
 
 int main(int argc, char const* argv[])
@@ -167,102 +995,593 @@ int main(int argc, char const* argv[])
 
     auto cmdargs = parse_cmdargs(argc, argv);
     auto word_vec_file = cmdargs["vec-file"].as<std::string>();
-    auto num_clusters = cmdargs["clusters"].as<uint32_t>();
-    auto device_list = cmdargs["device-list"].as<std::string>();
+    auto mode = cmdargs["mode"].as<std::string>();
+    // --mode incremental takes the cluster count from --from-clusters
+    std::vector<uint32_t> cluster_list;
+    if (cmdargs.count("clusters")) {
+        cluster_list
+            = parse_cluster_list(cmdargs["clusters"].as<std::string>());
+    } else if (mode != "incremental") {
+        std::cerr << "Missing required option: clusters" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    uint32_t num_clusters = cluster_list.empty() ? 0 : cluster_list.front();
+    bool sweep = cluster_list.size() > 1;
     auto max_word_len = cmdargs["max-word-len"].as<uint32_t>();
+    auto backend = cmdargs["backend"].as<std::string>();
+    auto num_threads = cmdargs["threads"].as<uint32_t>();
+    if (backend != "cpu" && backend != "cuda") {
+        std::cerr << "Unknown backend: " << backend << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::string device_list;
+    if (cmdargs.count("device-list")) {
+        device_list = cmdargs["device-list"].as<std::string>();
+    } else if (backend == "cuda") {
+        std::cerr << "Missing required option: device-list" << std::endl;
+        exit(EXIT_FAILURE);
+    }
     auto device_mask = generate_device_mask(device_list);
+    if (cmdargs.count("metrics-out")) {
+        metrics::global().open(cmdargs["metrics-out"].as<std::string>(),
+                               cmdargs["metrics-format"].as<std::string>());
+    }
+    parallel::set_num_threads(num_threads);
 
-    LOG_INFO << "device_list = " << device_list;
-    LOG_INFO << "device_mask = " << device_mask;
-    LOG_INFO << "num clusters = " << num_clusters;
+    LOG_INFO << "backend = " << backend;
+    if (backend == "cuda") {
+        LOG_INFO << "device_list = " << device_list;
+        LOG_INFO << "device_mask = " << device_mask;
+    } else {
+        LOG_INFO << "threads = " << parallel::num_threads();
+        LOG_INFO << "distance kernels = " << distance::kernel_name();
+    }
+    if (cmdargs.count("clusters"))
+        LOG_INFO << "num clusters = " << cmdargs["clusters"].as<std::string>();
     LOG_INFO << "max_word_len = " << max_word_len;
 
-    auto init = kmcuda::init_methods.find("kmeans++")->second;
-    auto metric = kmcuda::metrics.find("euclidean")->second;
-    auto tolerance = 0.002f;
-    auto yinyang = 0.0f;
-
-    LOG_INFO << "init = kmeans++";
-    LOG_INFO << "metric = euclidean";
-
-    auto vec_data = read_vector_data(word_vec_file, max_word_len);
+    auto init_name = cmdargs["init"].as<std::string>();
+    bool init_parallel = init_name == "kmeans||" || init_name == "k-means||";
+    if (!init_parallel && kmcuda::init_methods.count(init_name) == 0) {
+        std::cerr << "Unknown init method: " << init_name << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    auto init = init_parallel ? kmcudaInitMethodImport
+                              : kmcuda::init_methods.find(init_name)->second;
+    uint32_t afkmc2_m = cmdargs["afkmc2-m"].as<uint32_t>();
+    auto metric_name = cmdargs["metric"].as<std::string>();
+    if (kmcuda::metrics.count(metric_name) == 0) {
+        std::cerr << "Unknown metric: " << metric_name << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    auto metric = kmcuda::metrics.find(metric_name)->second;
+    bool cosine = metric == kmcudaDistanceMetricCosine;
+    auto tolerance = cmdargs["tolerance"].as<float>();
+    auto yinyang = cmdargs["yinyang"].as<float>();
 
-    size_t size_bytes = vec_data.dat.size() * sizeof(vec_data.dat[0]);
-    LOG_INFO << "data size in MiB = "
-             << float(size_bytes) / float(8 * 1024 * 1024);
+    LOG_INFO << "init = " << init_name;
+    LOG_INFO << "metric = " << metric_name;
+    LOG_INFO << "tolerance = " << tolerance;
+    LOG_INFO << "yinyang = " << yinyang;
+    LOG_INFO << "mode = " << mode;
 
     // cluster parameters
     uint32_t rand_seed = 1234;
-    int32_t fp16x2 = 0;
+    int32_t fp16x2 = cmdargs.count("fp16") ? 1 : 0;
     int32_t verbosity = 2; // 0: no output, 2: debug output
+    LOG_INFO << "fp16 = " << fp16x2;
+    if (fp16x2 && mode != "flat") {
+        std::cerr << "--fp16 is only supported with --mode flat" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    bool fp16_baseline = cmdargs.count("fp16-baseline") != 0;
+    if (fp16_baseline && (!fp16x2 || cmdargs.count("checkpoint"))) {
+        std::cerr << "--fp16-baseline needs --fp16 and no --checkpoint"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (sweep
+        && (mode != "flat" || fp16x2 || cmdargs.count("checkpoint")
+               || cmdargs.count("sweep-prefix") == 0)) {
+        std::cerr << "a --clusters sweep needs --sweep-prefix and --mode flat "
+                     "without --fp16 or --checkpoint"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    bool pq = cmdargs["pq-subspaces"].as<uint32_t>() > 0;
+    if (pq
+        && (mode != "flat" || backend != "cpu" || fp16x2 || sweep
+               || cmdargs.count("checkpoint"))) {
+        std::cerr << "--pq-subspaces needs --mode flat and --backend cpu "
+                     "without --fp16, a sweep or --checkpoint"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (cmdargs.count("distributed")
+        && (mode != "flat" || backend != "cpu" || fp16x2 || sweep || pq
+               || cmdargs.count("checkpoint")
+               || cmdargs.count("write-cache"))) {
+        std::cerr << "--distributed needs --mode flat and --backend cpu "
+                     "without --fp16, a sweep, --pq-subspaces, --checkpoint "
+                     "or --write-cache"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (cmdargs.count("tree-file") && (mode != "hierarchical" || sweep)) {
+        std::cerr << "--tree-file needs --mode hierarchical without a sweep"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (cmdargs.count("result-file") && (mode == "minibatch" || sweep)) {
+        std::cerr << "--result-file is not supported with --mode minibatch "
+                     "or a sweep"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (cmdargs.count("evaluate")
+        && (mode == "minibatch" || cmdargs.count("distributed"))) {
+        std::cerr << "--evaluate needs the vectors in memory: not supported "
+                     "with --mode minibatch or --distributed"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (cmdargs.count("distributed")) {
+        run_distributed(
+            cmdargs, init_name, metric, num_clusters, rand_seed, verbosity);
+        return EXIT_SUCCESS;
+    }
+
+    if (mode == "minibatch") {
+        run_minibatch(
+            cmdargs, init_name, metric, num_clusters, rand_seed, verbosity);
+        return EXIT_SUCCESS;
+    } else if (mode != "flat" && mode != "hierarchical"
+        && mode != "incremental") {
+        std::cerr << "Unknown mode: " << mode << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (mode == "incremental"
+        && (cmdargs.count("from-clusters") == 0 || cmdargs.count("checkpoint"))) {
+        std::cerr << "--mode incremental needs --from-clusters and does not "
+                     "support --checkpoint"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    auto vec_data = load_vector_data(word_vec_file,
+                                     cmdargs["input-format"].as<std::string>(),
+                                     max_word_len,
+                                     cosine);
+    if (cmdargs.count("write-cache")) {
+        if (cosine)
+            LOG_WARNING << "the cache holds the L2-normalised rows";
+        vector_cache::write(vec_data,
+                            cmdargs["write-cache"].as<std::string>(),
+                            max_word_len);
+    }
+
+    // fingerprint of the input for --checkpoint, taken before --fp16 drops
+    // the float rows
+    uint64_t input_fp = 0;
+    if (cmdargs.count("checkpoint"))
+        input_fp = input_fingerprint(vec_data.word_str,
+                                     vec_data.data(),
+                                     vec_data.num_samples,
+                                     vec_data.num_features);
+
+    // --fp16: pack the rows into half2 and drop the float copy (kept for
+    // --fp16-baseline). kmcuda then sees features_size half2 pairs per row.
+    std::vector<uint16_t> half_samples;
+    size_t features_size = vec_data.num_features;
+    size_t size_bytes = vec_data.size_bytes();
+    if (fp16x2) {
+        if (vec_data.num_features % 2 != 0) {
+            std::cerr << "--fp16 needs an even number of features"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        cl_timer<> half_timer("convert to fp16");
+        half_samples = half::narrow_matrix(vec_data.data(),
+                                           vec_data.num_samples,
+                                           vec_data.num_features);
+        if (!fp16_baseline)
+            vec_data.release_rows();
+        features_size = vec_data.num_features / 2;
+        size_bytes = half_samples.size() * sizeof(uint16_t);
+    }
+    LOG_INFO << "data size in MiB = "
+             << float(size_bytes) / float(8 * 1024 * 1024);
 
     LOG_INFO << "rand_seed = " << rand_seed;
     LOG_INFO << "num_features = " << vec_data.num_features;
     LOG_INFO << "num_samples = " << vec_data.num_samples;
 
-    const float* input_samples = (const float*)vec_data.dat.data();
-    std::vector<float> raw_out_centroids(num_clusters * vec_data.num_features);
+    if (sweep) {
+        run_sweep(cmdargs,
+                  cluster_list,
+                  vec_data,
+                  init_name,
+                  metric,
+                  backend,
+                  device_mask,
+                  rand_seed,
+                  verbosity);
+        return EXIT_SUCCESS;
+    }
+    if (mode == "incremental") {
+        run_incremental(cmdargs,
+                        num_clusters,
+                        vec_data,
+                        metric,
+                        backend,
+                        device_mask,
+                        rand_seed,
+                        verbosity);
+        return EXIT_SUCCESS;
+    }
+
+    const float* input_samples = fp16x2
+        ? reinterpret_cast<const float*>(half_samples.data())
+        : vec_data.data();
+    std::vector<float> raw_out_centroids(num_clusters * features_size);
     float* output_centroids = raw_out_centroids.data();
     std::vector<uint32_t> raw_out_assignments(vec_data.num_samples);
     uint32_t* output_assignments = raw_out_assignments.data();
 
+    std::string checkpoint_file;
+    if (cmdargs.count("checkpoint"))
+        checkpoint_file = cmdargs["checkpoint"].as<std::string>();
+    bool resume = cmdargs.count("resume") != 0;
+    if (resume && checkpoint_file.empty()) {
+        std::cerr << "--resume requires --checkpoint" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (mode != "flat" && !checkpoint_file.empty()) {
+        std::cerr << "--checkpoint is only supported with --mode flat"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    auto checkpoint_interval
+        = minutes(cmdargs["checkpoint-interval"].as<uint32_t>());
+
+    kmeans_cpu_options cpu_opts;
+    bool finished = false;
+    if (resume) {
+        auto ckpt = kmeans_checkpoint::load(checkpoint_file);
+        if (ckpt.num_samples != vec_data.num_samples
+            || ckpt.num_features != features_size
+            || ckpt.num_clusters != num_clusters) {
+            std::cerr << "checkpoint does not match the input data"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (ckpt.version < 2) {
+            LOG_WARNING << "checkpoint has no input fingerprint (version 1): "
+                           "metric and input are not checked";
+        } else if (ckpt.metric != uint32_t(metric)
+            || ckpt.fp16 != uint32_t(fp16x2) || ckpt.seed != rand_seed) {
+            std::cerr << "checkpoint was written with a different metric, "
+                         "--fp16 setting or seed"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        } else if (ckpt.fingerprint != input_fp) {
+            std::cerr << "checkpoint was written for a different input"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::copy(ckpt.centroids.begin(),
+                  ckpt.centroids.end(),
+                  raw_out_centroids.begin());
+        std::copy(ckpt.assignments.begin(),
+                  ckpt.assignments.end(),
+                  raw_out_assignments.begin());
+        init = kmcudaInitMethodImport;
+        cpu_opts.first_iteration = ckpt.iteration;
+        cpu_opts.keep_assignments = true;
+        finished = ckpt.finished != 0;
+        LOG_INFO << "init = import (resume at iteration " << ckpt.iteration
+                 << ")";
+    }
+    auto save_checkpoint = [&](size_t iteration, bool done) {
+        kmeans_checkpoint ckpt;
+        ckpt.iteration = iteration;
+        ckpt.num_samples = vec_data.num_samples;
+        ckpt.num_features = features_size;
+        ckpt.num_clusters = num_clusters;
+        ckpt.seed = rand_seed;
+        ckpt.finished = done;
+        ckpt.metric = uint32_t(metric);
+        ckpt.fp16 = uint32_t(fp16x2);
+        ckpt.fingerprint = input_fp;
+        ckpt.centroids = raw_out_centroids;
+        ckpt.assignments = raw_out_assignments;
+        ckpt.save(checkpoint_file);
+    };
+    auto last_checkpoint = watch::now();
+    size_t last_iteration = cpu_opts.first_iteration;
+    bool telemetry = metrics::global().enabled();
+    cpu_opts.iteration_stats = telemetry;
+    if (!checkpoint_file.empty() || telemetry) {
+        cpu_opts.on_iteration = [&](const kmeans_iteration& it) {
+            if (telemetry) {
+                metrics::iteration_record r;
+                r.algorithm = "kmeans_cpu";
+                r.iteration = it.iteration;
+                r.yinyang = it.yinyang;
+                r.converged = it.converged;
+                r.reassignments = it.reassignments;
+                r.assign_us = it.assign_us;
+                r.update_us = it.update_us;
+                r.yinyang_us = it.yinyang_us;
+                r.inertia = it.inertia;
+                r.empty_clusters = it.empty_clusters;
+                metrics::global().iteration(r);
+            }
+            last_iteration = it.iteration;
+            if (checkpoint_file.empty() || it.converged
+                || watch::now() - last_checkpoint < checkpoint_interval)
+                return;
+            save_checkpoint(it.iteration, false);
+            last_checkpoint = watch::now();
+        };
+        if (backend == "cuda")
+            LOG_WARNING << "kmeans_cuda() has no iteration hook: "
+                           "checkpoints and iteration metrics are only "
+                           "written once it returns";
+    }
+
+    // seed on the host for the cpu backend and for kmeans||, which kmcuda
+    // does not implement; kmeans_cuda() then imports the centroids
+    // (--fp16-baseline needs the seeds on the host as well)
+    std::vector<float> fp16_seeds;
+    if (mode == "flat" && !resume
+        && (init_parallel || backend == "cpu" || fp16_baseline)) {
+        seed_centroids(init_name,
+                       cmdargs,
+                       metric,
+                       vec_data.num_samples,
+                       features_size,
+                       num_clusters,
+                       rand_seed,
+                       verbosity,
+                       input_samples,
+                       output_centroids,
+                       fp16x2);
+        init = kmcudaInitMethodImport;
+        if (fp16_baseline) {
+            fp16_seeds.resize(num_clusters * vec_data.num_features);
+            half::widen(reinterpret_cast<const uint16_t*>(output_centroids),
+                        fp16_seeds.data(),
+                        fp16_seeds.size());
+        }
+    } else if (mode == "flat" && !resume) {
+        LOG_INFO << "seeding (" << init_name << ") runs inside kmeans_cuda";
+    }
+
     float avg_distance = 0.0;
+    kmeans_tree tree;
     {
-        cl_timer<> cluster_start("kmeans_cuda");
-        auto res = kmeans_cuda(init,
-                               nullptr,
-                               tolerance,
-                               yinyang,
-                               metric,
+        cl_timer<> cluster_start("kmeans_" + backend);
+        KMCUDAResult res = kmcudaSuccess;
+        if (finished) {
+            LOG_INFO << "checkpoint is final, skipping clustering";
+        } else if (mode == "hierarchical") {
+            // the coarse level runs on the selected backend, the per-group
+            // subproblems on the cpu thread pool
+            auto coarse_kmeans = [&](uint32_t n,
+                                     uint32_t k,
+                                     const float* s,
+                                     float* c,
+                                     uint32_t* a) {
+                auto coarse_init = init;
+                if (init_parallel || backend == "cpu") {
+                    seed_centroids(init_name,
+                                   cmdargs,
+                                   metric,
+                                   n,
+                                   vec_data.num_features,
+                                   k,
+                                   rand_seed,
+                                   verbosity,
+                                   s,
+                                   c);
+                    coarse_init = kmcudaInitMethodImport;
+                }
+                if (backend == "cpu") {
+                    return kmeans_cpu(coarse_init,
+                                      &afkmc2_m,
+                                      tolerance,
+                                      yinyang,
+                                      metric,
+                                      n,
+                                      vec_data.num_features,
+                                      k,
+                                      rand_seed,
+                                      fp16x2,
+                                      verbosity,
+                                      s,
+                                      c,
+                                      a,
+                                      nullptr);
+                }
+                return kmeans_cuda(coarse_init,
+                                   &afkmc2_m,
+                                   tolerance,
+                                   yinyang,
+                                   metric,
+                                   n,
+                                   vec_data.num_features,
+                                   k,
+                                   rand_seed,
+                                   device_mask,
+                                   -1,
+                                   fp16x2,
+                                   verbosity,
+                                   s,
+                                   c,
+                                   a,
+                                   nullptr);
+            };
+            hierarchical_options hopts;
+            hopts.coarse_clusters = cmdargs["coarse-clusters"].as<uint32_t>();
+            hopts.refine_iterations
+                = cmdargs["refine-iterations"].as<uint32_t>();
+            hopts.refine_probes = cmdargs["refine-probes"].as<uint32_t>();
+            // subproblems seed on the host: kmeans|| maps to kmeans++
+            auto leaf_init = init_parallel ? kmcudaInitMethodPlusPlus : init;
+            res = kmeans_hierarchical(coarse_kmeans,
+                                      leaf_init,
+                                      &afkmc2_m,
+                                      tolerance,
+                                      metric,
+                                      vec_data.num_samples,
+                                      vec_data.num_features,
+                                      num_clusters,
+                                      rand_seed,
+                                      verbosity,
+                                      input_samples,
+                                      output_centroids,
+                                      output_assignments,
+                                      tree,
+                                      hopts);
+        } else if (pq) {
+            res = run_pq(cmdargs,
+                         vec_data,
+                         metric,
+                         num_clusters,
+                         rand_seed,
+                         verbosity,
+                         output_centroids,
+                         output_assignments,
+                         &avg_distance);
+        } else if (backend == "cpu") {
+            res = kmeans_cpu(init,
+                             &afkmc2_m,
+                             tolerance,
+                             yinyang,
+                             metric,
+                             vec_data.num_samples,
+                             features_size,
+                             num_clusters,
+                             rand_seed,
+                             fp16x2,
+                             verbosity,
+                             input_samples,
+                             output_centroids,
+                             output_assignments,
+                             &avg_distance,
+                             cpu_opts);
+        } else {
+            res = kmeans_cuda(init,
+                              &afkmc2_m,
+                              tolerance,
+                              yinyang,
+                              metric,
+                              vec_data.num_samples,
+                              features_size,
+                              num_clusters,
+                              rand_seed,
+                              device_mask,
+                              -1, // device_ptrs: If negative, input and output
+                              // pointers are taken from host
+                              fp16x2,
+                              verbosity,
+                              input_samples,
+                              output_centroids,
+                              output_assignments,
+                              &avg_distance);
+        }
+
+        std::cout << "Status: " << kmcuda::statuses.find(res)->second
+                  << std::endl;
+        if (!checkpoint_file.empty() && res == kmcudaSuccess && !finished)
+            save_checkpoint(last_iteration, true);
+        // float centroids for evaluation and output
+        std::vector<float> wide_centroids;
+        float* report_centroids = output_centroids;
+        if (fp16x2) {
+            wide_centroids.resize(num_clusters * vec_data.num_features);
+            half::widen(reinterpret_cast<const uint16_t*>(output_centroids),
+                        wide_centroids.data(),
+                        wide_centroids.size());
+            report_centroids = wide_centroids.data();
+        }
+        if (res == kmcudaSuccess) {
+            kmeans_cpu_engine eval(metric,
+                                   vec_data.num_samples,
+                                   vec_data.num_features,
+                                   num_clusters,
+                                   0,
+                                   fp16x2 ? nullptr : input_samples,
+                                   report_centroids,
+                                   output_assignments);
+            if (fp16x2)
+                eval.set_half_samples(half_samples.data());
+            LOG_INFO << "inertia = " << eval.inertia()
+                     << " (init = " << init_name
+                     << (fp16x2 ? ", fp16" : ", fp32") << ")";
+            if (fp16_baseline)
+                run_fp16_baseline(cmdargs,
+                                  vec_data,
+                                  metric,
+                                  num_clusters,
+                                  rand_seed,
+                                  verbosity,
+                                  std::move(fp16_seeds),
+                                  report_centroids,
+                                  output_assignments);
+            if (cmdargs.count("evaluate"))
+                run_evaluation(cmdargs,
+                               eval,
                                vec_data.num_samples,
                                vec_data.num_features,
                                num_clusters,
-                               rand_seed,
-                               device_mask,
-                               -1, // device_ptrs: If negative, input and output
-                               // pointers are taken from host
-                               fp16x2,
-                               verbosity,
-                               input_samples,
-                               output_centroids,
                                output_assignments,
-                               &avg_distance);
-
-        std::cout << "Status: " << kmcuda::statuses.find(res)->second
-                  << std::endl;
-
-        // (2) output clusters
-        std::multimap<uint32_t, uint32_t> clusters;
-        std::vector<float> centroid_dists(raw_out_assignments.size());
-        std::vector<float> total_centroid_dists(num_clusters, 0.0f);
-        std::vector<float> centroid_sizes(num_clusters, 0.0f);
-        for (size_t i = 0; i < raw_out_assignments.size(); i++) {
-            size_t cid = raw_out_assignments[i];
-            clusters.insert({ cid, i });
-            const float* centr
-                = output_centroids + (cid * vec_data.num_features);
-            const float* vecptr = input_samples + (i * vec_data.num_features);
-            centroid_dists[i]
-                = compute_euq_distance(centr, vecptr, vec_data.num_features);
-            total_centroid_dists[cid] += centroid_dists[i];
-            centroid_sizes[cid]++;
+                               rand_seed);
         }
 
-        for (auto& x : clusters) {
-            std::string word = vec_data.word_str[x.second];
-            auto dist = centroid_dists[x.second];
-            auto avg_dist
-                = total_centroid_dists[x.first] / centroid_sizes[x.first];
-            std::cout << x.first << ": " << word << " " << dist << " "
-                      << avg_dist << std::endl;
+        // (2) output clusters
+        auto dists = cluster_report::sample_distances(
+            vec_data.num_samples,
+            vec_data.num_features,
+            fp16x2 ? nullptr : input_samples,
+            report_centroids,
+            output_assignments,
+            fp16x2 ? half_samples.data() : nullptr,
+            cosine);
+        {
+            cl_timer<> report_timer("write report");
+            write_cluster_report_dists(std::cout,
+                                       vec_data.num_samples,
+                                       vec_data.num_features,
+                                       num_clusters,
+                                       report_centroids,
+                                       output_assignments,
+                                       dists.data(),
+                                       vec_data.word_str);
         }
-        for (size_t i = 0; i < num_clusters; i++) {
-            std::cout << "CENTROID " << i << ": ";
-            for (size_t j = 0; j < vec_data.num_features; j++) {
-                std::cout << output_centroids[i * vec_data.num_features + j]
-                          << " ";
-            }
-            std::cout << std::endl;
+        if (cmdargs.count("result-file"))
+            cluster_file::write(cmdargs["result-file"].as<std::string>(),
+                                vec_data.num_samples,
+                                vec_data.num_features,
+                                num_clusters,
+                                report_centroids,
+                                output_assignments,
+                                dists.data(),
+                                vec_data.word_str,
+                                cosine);
+        // coarse level of the hierarchical mode and the parent of each
+        // leaf: after the report, or in --tree-file
+        if (cmdargs.count("tree-file")) {
+            auto tree_name = cmdargs["tree-file"].as<std::string>();
+            std::ofstream tree_out(tree_name);
+            write_tree(tree_out, tree, vec_data.num_features);
+            if (!tree_out)
+                throw std::runtime_error("error writing " + tree_name);
+        } else {
+            write_tree(std::cout, tree, vec_data.num_features);
         }
+        std::cout.flush();
     }
 }
@@ -0,0 +1,404 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "cluster_file.hpp"
+#include "cluster_report.hpp"
+#include "ivf_index.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+#include "timing.hpp"
+#include "util.hpp"
+#include "vector_io.hpp"
+#include "word_table.hpp"
+
+namespace po = boost::program_options;
+
+po::variables_map parse_cmdargs(int argc, char const* argv[])
+{
+
+    po::variables_map vm;
+    po::options_description desc("Allowed options");
+    // clang-format off
+    desc.add_options()
+        ("help,h", "produce help message")
+        ("vec-file,v",po::value<std::string>()->required(), "word vector file")
+        ("clusters-file,r",po::value<std::string>()->required(), "report or --result-file of cluster-word-vecs.x for the vector file")
+        ("max-word-len,w",po::value<uint32_t>()->default_value(32), "maximum word len")
+        ("input-format,f",po::value<std::string>()->default_value("auto"), "vector file format: auto|text|bin|cache")
+        ("threads,t",po::value<uint32_t>()->default_value(0), "CPU threads (0 = all cores)")
+        ("topk,k",po::value<uint32_t>()->default_value(10), "neighbours per query")
+        ("probes,p",po::value<std::string>()->default_value("8"), "clusters scanned per query (a list like 1,4,16 with --evaluate)")
+        ("socket,s",po::value<std::string>(), "serve queries on this unix socket instead of stdin")
+        ("evaluate,e",po::value<uint32_t>()->default_value(0), "measure recall@k and QPS on this many sampled words against brute force")
+        ("seed",po::value<uint32_t>()->default_value(1234), "seed for sampling evaluation queries");
+    // clang-format on
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        if (vm.count("help")) {
+            std::cout << desc << "\n";
+            exit(EXIT_SUCCESS);
+        }
+        po::notify(vm);
+    } catch (const po::required_option& e) {
+        std::cout << desc;
+        std::cerr << "Missing required option: " << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    } catch (po::error& e) {
+        std::cout << desc;
+        std::cerr << "Error parsing options: " << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return vm;
+}
+
+std::vector<size_t> parse_probe_list(const std::string& list)
+{
+    std::vector<size_t> probes;
+    std::stringstream ss(list);
+    std::string p;
+    while (std::getline(ss, p, ',')) {
+        if (!p.empty())
+            probes.push_back(std::stoul(p));
+    }
+    if (probes.empty())
+        probes.push_back(1);
+    return probes;
+}
+
+// --clusters-file is either a text report or a binary cluster file
+cluster_result load_clusters(const std::string& file_name)
+{
+    if (!cluster_file::is_cluster_file(file_name))
+        return read_cluster_report(file_name);
+    cluster_file::reader file(file_name);
+    cluster_result res;
+    res.num_clusters = file.num_clusters();
+    res.num_features = file.num_features();
+    res.centroids.assign(file.centroids(),
+        file.centroids() + res.num_clusters * res.num_features);
+    const word_table& words = file.words();
+    res.words.reserve(words.size(), words.bytes());
+    res.word_cluster.resize(words.size());
+    res.word_dist.resize(words.size());
+    for (size_t i = 0; i < words.size(); i++) {
+        res.words.push_back(words.c_str(i), words.length(i));
+        res.word_cluster[i] = file.cluster_of(i);
+        res.word_dist[i] = file.distance_of(i);
+    }
+    return res;
+}
+
+struct query_engine {
+    ivf_index index;
+    // indexed; may view the mapping of a vector cache
+    word_table words;
+    size_t topk;
+    size_t probes;
+
+    // answers one query line "<word> [k]" with
+    // "<word>: <neighbour> <dist> ..." (euclidean distances). k must be a
+    // positive integer and is capped at the number of words.
+    void answer(const std::string& line, std::string& out) const
+    {
+        std::stringstream ss(line);
+        std::string word, k_str;
+        ss >> word >> k_str;
+        if (word.empty())
+            return;
+        out += word;
+        out += ':';
+        size_t k = topk;
+        if (!k_str.empty()) {
+            char* end = nullptr;
+            errno = 0;
+            long long v = strtoll(k_str.c_str(), &end, 10);
+            if (*end != '\0' || errno == ERANGE || v < 1) {
+                out += " INVALID_K\n";
+                return;
+            }
+            k = size_t(v);
+        }
+        k = std::min(k, index.size());
+        uint32_t id = words.find(word);
+        if (id == word_table::npos) {
+            out += " NOT_FOUND\n";
+            return;
+        }
+        auto res = index.search(index.vector(id), k, probes, id);
+        for (const auto& r : res) {
+            out += ' ';
+            out.append(words.c_str(r.id), words.length(r.id));
+            out += ' ';
+            out += std::to_string(std::sqrt(r.dist));
+        }
+        out += '\n';
+    }
+
+    // answers a batch of query lines on all threads, in order
+    std::string answer_batch(const std::vector<std::string>& lines) const
+    {
+        std::vector<std::string> outs(lines.size());
+        parallel::parallel_for(0, lines.size(), 1,
+            [&](size_t b, size_t e, size_t) {
+                for (size_t i = b; i < e; i++)
+                    answer(lines[i], outs[i]);
+            });
+        std::string out;
+        for (auto& o : outs)
+            out += o;
+        return out;
+    }
+};
+
+bool write_all(int fd, const std::string& buf)
+{
+    size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t w = write(fd, buf.data() + done, buf.size() - done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        done += size_t(w);
+    }
+    return true;
+}
+
+// reads query lines from in_fd until EOF. Every read() returns whatever the
+// client has sent so far; its complete lines form one batch.
+void serve_fd(const query_engine& engine, int in_fd, int out_fd)
+{
+    std::vector<char> buf(1 << 16);
+    std::string pending;
+    while (true) {
+        ssize_t r = read(in_fd, buf.data(), buf.size());
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        pending.append(buf.data(), size_t(r));
+        std::vector<std::string> lines;
+        size_t start = 0;
+        size_t nl;
+        while ((nl = pending.find('\n', start)) != std::string::npos) {
+            lines.emplace_back(pending, start, nl - start);
+            start = nl + 1;
+        }
+        pending.erase(0, start);
+        if (!lines.empty() && !write_all(out_fd, engine.answer_batch(lines)))
+            return;
+    }
+    if (!pending.empty())
+        write_all(out_fd, engine.answer_batch({ pending }));
+}
+
+void serve_socket(const query_engine& engine, const std::string& path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw std::runtime_error("cannot create socket: "
+            + std::string(strerror(errno)));
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("socket path too long: " + path);
+    strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+        || listen(fd, 16) != 0)
+        throw std::runtime_error("cannot listen on " + path + ": "
+            + strerror(errno));
+    LOG_INFO << "listening on " << path;
+    while (true) {
+        int conn = accept(fd, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("accept failed: "
+                + std::string(strerror(errno)));
+        }
+        serve_fd(engine, conn, conn);
+        close(conn);
+    }
+}
+
+// recall@k and queries per second of the index against brute force
+void evaluate(const query_engine& engine,
+              size_t num_queries,
+              const std::vector<size_t>& probe_list,
+              uint32_t seed)
+{
+    size_t n = engine.index.size();
+    num_queries = std::min(num_queries, n);
+    std::vector<uint32_t> ids(n);
+    std::iota(ids.begin(), ids.end(), 0);
+    std::mt19937_64 rng(seed);
+    std::shuffle(ids.begin(), ids.end(), rng);
+    ids.resize(num_queries);
+    size_t k = engine.topk;
+
+    std::vector<std::vector<ivf_neighbor>> exact(num_queries);
+    auto start = watch::now();
+    parallel::parallel_for(0, num_queries, 1, [&](size_t b, size_t e, size_t) {
+        for (size_t q = b; q < e; q++)
+            exact[q] = engine.index.brute_force(
+                engine.index.vector(ids[q]), k, ids[q]);
+    });
+    double secs = duration<double>(watch::now() - start).count();
+    LOG_INFO << "brute force: " << num_queries << " queries, "
+             << double(num_queries) / secs << " QPS";
+
+    for (size_t probes : probe_list) {
+        std::vector<size_t> hits(num_queries, 0);
+        start = watch::now();
+        parallel::parallel_for(
+            0, num_queries, 1, [&](size_t b, size_t e, size_t) {
+                for (size_t q = b; q < e; q++) {
+                    auto res = engine.index.search(
+                        engine.index.vector(ids[q]), k, probes, ids[q]);
+                    for (const auto& r : res) {
+                        for (const auto& x : exact[q]) {
+                            if (x.id == r.id) {
+                                hits[q]++;
+                                break;
+                            }
+                        }
+                    }
+                }
+            });
+        secs = duration<double>(watch::now() - start).count();
+        size_t total_hits = std::accumulate(hits.begin(), hits.end(), size_t(0));
+        size_t total_exact = 0;
+        for (const auto& x : exact)
+            total_exact += x.size();
+        LOG_INFO << "probes = " << probes << " recall@" << k << " = "
+                 << (total_exact ? double(total_hits) / total_exact : 1.0)
+                 << " QPS = " << double(num_queries) / secs;
+    }
+}
+
+int main(int argc, char const* argv[])
+{
+    logging::init();
+
+    auto cmdargs = parse_cmdargs(argc, argv);
+    parallel::set_num_threads(cmdargs["threads"].as<uint32_t>());
+    signal(SIGPIPE, SIG_IGN);
+
+    // stdout is the answer stream: the logs and the loader's status line
+    // that print there go to stderr
+    std::cout.flush();
+    int answer_fd = dup(STDOUT_FILENO);
+    if (answer_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        std::cerr << "cannot redirect stdout: " << strerror(errno)
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    auto vec_data = load_vector_data(cmdargs["vec-file"].as<std::string>(),
+                                     cmdargs["input-format"].as<std::string>(),
+                                     cmdargs["max-word-len"].as<uint32_t>());
+    auto clusters = load_clusters(cmdargs["clusters-file"].as<std::string>());
+    LOG_INFO << "num clusters = " << clusters.num_clusters;
+    if (clusters.num_clusters == 0
+        || clusters.num_features != vec_data.num_features) {
+        std::cerr << "clusters file does not match the vector file"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (!vec_data.word_str.has_index()) {
+        cl_timer<> index_timer("build word index");
+        vec_data.word_str.build_index();
+    }
+
+    // assignments from the report; words it does not list go to their
+    // nearest centroid
+    const uint32_t unassigned = word_table::npos;
+    std::vector<uint32_t> assignments(vec_data.num_samples, unassigned);
+    for (size_t w = 0; w < clusters.words.size(); w++) {
+        uint32_t id = vec_data.word_str.find(
+            clusters.words.c_str(w), clusters.words.length(w));
+        if (id != word_table::npos
+            && clusters.word_cluster[w] < clusters.num_clusters)
+            assignments[id] = clusters.word_cluster[w];
+    }
+    std::vector<size_t> missing(parallel::num_threads(), 0);
+    parallel::parallel_for(
+        0, vec_data.num_samples, [&](size_t b, size_t e, size_t slot) {
+            for (size_t i = b; i < e; i++) {
+                if (assignments[i] != unassigned)
+                    continue;
+                const float* x = vec_data.data() + i * vec_data.num_features;
+                float best = std::numeric_limits<float>::max();
+                for (size_t c = 0; c < clusters.num_clusters; c++) {
+                    float d = distance::l2_sq(x,
+                        clusters.centroids.data() + c * clusters.num_features,
+                        clusters.num_features);
+                    if (d < best) {
+                        best = d;
+                        assignments[i] = uint32_t(c);
+                    }
+                }
+                missing[slot]++;
+            }
+        });
+    LOG_INFO << "words assigned to their nearest centroid = "
+             << std::accumulate(missing.begin(), missing.end(), size_t(0));
+
+    query_engine engine;
+    {
+        cl_timer<> index_timer("build ivf index");
+        engine.index = ivf_index(vec_data.data(),
+                                 vec_data.num_samples,
+                                 vec_data.num_features,
+                                 clusters.centroids.data(),
+                                 clusters.num_clusters,
+                                 assignments.data());
+    }
+    vec_data.release_rows();
+    // a view of a cache keeps pointing into vec_data.mapping, which lives
+    // until the end of main
+    engine.words = std::move(vec_data.word_str);
+    engine.topk = cmdargs["topk"].as<uint32_t>();
+    if (engine.topk == 0) {
+        std::cerr << "--topk must be at least 1" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    auto probe_list = parse_probe_list(cmdargs["probes"].as<std::string>());
+    engine.probes = probe_list.front();
+    LOG_INFO << "topk = " << engine.topk;
+    LOG_INFO << "probes = " << engine.probes;
+
+    if (cmdargs["evaluate"].as<uint32_t>() > 0) {
+        evaluate(engine,
+                 cmdargs["evaluate"].as<uint32_t>(),
+                 probe_list,
+                 cmdargs["seed"].as<uint32_t>());
+    } else if (cmdargs.count("socket")) {
+        serve_socket(engine, cmdargs["socket"].as<std::string>());
+    } else {
+        serve_fd(engine, STDIN_FILENO, answer_fd);
+    }
+    return EXIT_SUCCESS;
+}